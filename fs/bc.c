@@ -1,6 +1,43 @@
 
 #include "fs.h"
 
+// The cache holds at most BC_NPAGES blocks, besides the superblock and
+// the bitmap, which stay in memory for good.  When it's full, a miss
+// evicts a block chosen by CLOCK: the hand sweeps bc_slots, clearing
+// PTE_A on each block it passes, and takes the first block that hasn't
+// been touched since its last pass, and isn't waiting for a journal
+// transaction to commit (see log.c).
+#define BC_NPAGES	512
+
+// Clearing PTE_A means remapping the page, which clears PTE_D along
+// with it, so a page that was dirty then carries that in PTE_BC_DIRTY
+// (one of the PTE_AVAIL bits) until flush_block writes it out.
+#define PTE_BC_DIRTY	0x200
+
+// Most blocks one disk read can bring in: 256 sectors.
+#define BC_MAXRUN	(DISK_MAXSECS / BLKSECTS)
+
+// Read-ahead runs are started without waiting for them when the disk
+// allows, as many at once as it has slots, each into its own BC_MAXRUN
+// pages from BC_STAGEVA, and the fs server gets on with its next
+// request meanwhile.  A run's blocks are put in place once it's over,
+// by bc_finish, which waits for it if someone needs them first.
+#define BC_NRUNS	32
+
+struct bc_run {
+	uint64_t blockno;	// First block of the run
+	uint32_t n;		// and how many, 0 if this run is free
+	uint32_t seq;		// Order started in
+	struct diskreq req;
+};
+
+static uint32_t bc_slots[BC_NPAGES];	// Cached block in each slot, or 0
+static int bc_hand;
+static struct bc_run bc_runs[BC_NRUNS];
+static uint32_t bc_nruns;		// Runs in flight
+static uint32_t bc_runseq;
+static struct Fsret_bcstats bcstats;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint64_t blockno)
@@ -21,18 +58,251 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return (uvpt[PGNUM(va)] & (PTE_D | PTE_BC_DIRTY)) != 0;
+}
+
+// The superblock and the bitmap blocks are never evicted.
+static bool
+bc_pinned(uint64_t blockno)
+{
+	return blockno == 1
+		|| (super && blockno < 2 + ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE);
+}
+
+// Make room for 'blockno' in the cache, evicting a block if it's full.
+static void
+bc_admit(uint64_t blockno)
+{
+	void *va;
+	pte_t pte;
+	int r;
+
+	while (bc_slots[bc_hand] && va_is_mapped(diskaddr(bc_slots[bc_hand]))) {
+		va = diskaddr(bc_slots[bc_hand]);
+		pte = uvpt[PGNUM(va)];
+		if (!(pte & PTE_A) && !log_holds(bc_slots[bc_hand])) {
+			flush_block(va);
+			if ((r = sys_page_unmap(0, va)) < 0)
+				panic("in bc_admit, sys_page_unmap: %e", r);
+			bcstats.ret_evictions++;
+			break;
+		}
+		if ((r = sys_page_map(0, va, 0, va, (pte & PTE_SYSCALL)
+				      | (pte & PTE_D ? PTE_BC_DIRTY : 0))) < 0)
+			panic("in bc_admit, sys_page_map: %e", r);
+		bc_hand = (bc_hand + 1) % BC_NPAGES;
+	}
+	bc_slots[bc_hand] = blockno;
+	bc_hand = (bc_hand + 1) % BC_NPAGES;
+}
+
+// Count a lookup of the block at 'va' as a hit if it's in memory.  A
+// miss is counted when the access faults it in.
+void
+bc_lookup(void *va)
+{
+	if (va_is_mapped(va))
+		bcstats.ret_hits++;
+}
+
+void
+bc_stats(struct Fsret_bcstats *st)
+{
+	int i;
+
+	*st = bcstats;
+	st->ret_io_cycles = disk_io_cycles;
+	st->ret_allocs = alloc_count;
+	st->ret_alloc_cycles = alloc_cycles;
+	st->ret_resident = 0;
+	for (i = 0; i < BC_NPAGES; i++)
+		if (bc_slots[i] && va_is_mapped(diskaddr(bc_slots[i])))
+			st->ret_resident++;
+	st->ret_capacity = BC_NPAGES;
+}
+
+// Read the n blocks from 'blockno' on, none of them in memory, into
+// the cache with a single disk read.
+static void
+bc_read_run(uint64_t blockno, uint32_t n)
+{
+	void *va = diskaddr(blockno);
+	uint32_t i;
+	int r;
+
+	assert(n <= BC_MAXRUN);
+	for (i = 0; i < n; i++) {
+		if (!bc_pinned(blockno + i))
+			bc_admit(blockno + i);
+		if ((r = sys_page_alloc(0, va + i * BLKSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_read_run, sys_page_alloc: %e", r);
+	}
+	if ((r = disk_read(blockno * BLKSECTS, va, n * BLKSECTS)) < 0)
+		panic("in bc_read_run, disk_read: %e", r);
+	// Reading the blocks in dirtied the pages; they're clean.
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_map(0, va + i * BLKSIZE, 0, va + i * BLKSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_read_run, sys_page_map: %e", r);
+}
+
+static void *
+bc_stage(struct bc_run *run)
+{
+	return (void *) BC_STAGEVA + (run - bc_runs) * BC_MAXRUN * PGSIZE;
+}
+
+// The run in flight that 'blockno' is part of, if any.
+static struct bc_run *
+bc_run_of(uint64_t blockno)
+{
+	int i;
+
+	if (bc_nruns == 0)
+		return NULL;
+	for (i = 0; i < BC_NRUNS; i++)
+		if (bc_runs[i].n && blockno >= bc_runs[i].blockno
+		    && blockno < bc_runs[i].blockno + bc_runs[i].n)
+			return &bc_runs[i];
+	return NULL;
+}
+
+// Start reading the n blocks from 'blockno' on, none of them in
+// memory, into a free run.  Returns < 0, having started nothing, if
+// the disk can't do it that way.
+static int
+bc_start_run(struct bc_run *run, uint64_t blockno, uint32_t n)
+{
+	void *stage = bc_stage(run);
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, stage + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_start_run, sys_page_alloc: %e", r);
+	if ((r = disk_start_read(&run->req, blockno * BLKSECTS, stage,
+				 n * BLKSECTS)) < 0) {
+		for (i = 0; i < n; i++)
+			sys_page_unmap(0, stage + i * PGSIZE);
+		return r;
+	}
+	run->blockno = blockno;
+	run->n = n;
+	run->seq = bc_runseq++;
+	bc_nruns++;
+	return 0;
+}
+
+// Wait for 'run' and move its blocks into the cache.
+static void
+bc_finish(struct bc_run *run)
+{
+	void *stage = bc_stage(run);
+	uint32_t i;
+	int r;
+
+	if ((r = disk_wait(&run->req)) < 0)
+		panic("in bc_finish, disk_wait: %e", r);
+	for (i = 0; i < run->n; i++) {
+		if (!bc_pinned(run->blockno + i))
+			bc_admit(run->blockno + i);
+		if ((r = sys_page_map(0, stage + i * PGSIZE, 0,
+				      diskaddr(run->blockno + i),
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_finish, sys_page_map: %e", r);
+		sys_page_unmap(0, stage + i * PGSIZE);
+	}
+	run->n = 0;
+	bc_nruns--;
+}
+
+// A free run, finishing the oldest in flight first if the disk has no
+// more slots.  NULL if runs can't be started ahead at all.
+static struct bc_run *
+bc_free_run(void)
+{
+	uint32_t max = MIN(disk_slots(), BC_NRUNS);
+	struct bc_run *oldest = NULL;
+	int i;
+
+	if (max == 0)
+		return NULL;
+	if (bc_nruns >= max) {
+		for (i = 0; i < BC_NRUNS; i++)
+			if (bc_runs[i].n && (!oldest
+			    || (int32_t) (bc_runs[i].seq - oldest->seq) < 0))
+				oldest = &bc_runs[i];
+		bc_finish(oldest);
+	}
+	for (i = 0; i < BC_NRUNS; i++)
+		if (bc_runs[i].n == 0)
+			return &bc_runs[i];
+	panic("bc_free_run: no free run");
+}
+
+// Bring the n blocks from 'blockno' on into the cache ahead of use,
+// reading each run of them that isn't in memory or on its way yet with
+// one disk read of up to BC_MAXRUN blocks.  Those runs may still be in
+// flight when this returns.
+void
+bc_readahead(uint64_t blockno, uint32_t n)
+{
+	struct bc_run *rp;
+	uint32_t i, run;
+
+	if (super)
+		n = MIN(n, super->s_nblocks - blockno);
+	for (i = 0; i < n; i += run) {
+		for (run = 0; i + run < n && run < BC_MAXRUN; run++)
+			if (va_is_mapped(diskaddr(blockno + i + run))
+			    || bc_run_of(blockno + i + run))
+				break;
+		if (run == 0) {
+			run = 1;
+			continue;
+		}
+		if (!(rp = bc_free_run())
+		    || bc_start_run(rp, blockno + i, run) < 0)
+			bc_read_run(blockno + i, run);
+		bcstats.ret_readahead += run;
+	}
+}
+
+// Bring the newly allocated block 'blockno' into the cache zeroed,
+// without reading what was on disk there first, and return its address.
+void *
+bc_zero(uint64_t blockno)
+{
+	void *va = diskaddr(blockno);
+	struct bc_run *run;
+	int r;
+
+	// Read-ahead mustn't land on top of it later.
+	if ((run = bc_run_of(blockno)))
+		bc_finish(run);
+	if (va_is_mapped(va)) {
+		memset(va, 0, BLKSIZE);
+		return va;
+	}
+	if (!bc_pinned(blockno))
+		bc_admit(blockno);
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("in bc_zero, sys_page_alloc: %e", r);
+	// A fresh page isn't dirty, but the disk has to get the zeroes.
+	*(volatile char *) va = 0;
+	return va;
 }
 
 // Fault any disk block that is read in to memory by
 // loading it from disk.
-// Hint: Use ide_read and BLKSECTS.
+// Hint: Use disk_read and BLKSECTS.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint64_t blockno = ((uint64_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	struct bc_run *run;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -43,27 +313,17 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// Hint: first round addr to page boundary.
-	//
-	// LAB 5: your code here:
-	int ret = sys_page_alloc(thisenv->env_id, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), PTE_U | PTE_P | PTE_W);
-	if(ret < 0) { 
-		panic("");
-	}
-
-
-
-	// LAB 5: Your code here
-	ret = ide_read(blockno * BLKSECTS, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), BLKSECTS);
-	if(ret < 0) { 
-		panic("");
+	// A block on its way in already just has to be waited for.
+	if ((run = bc_run_of(blockno))) {
+		bc_finish(run);
+		return;
 	}
 
+	// Allocate a page in the disk map region, read the contents
+	// of the block from the disk into that page.
+	bc_read_run(blockno, 1);
+	bcstats.ret_misses++;
 
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
 	// in?)
@@ -72,10 +332,11 @@ bc_pgfault(struct UTrapframe *utf)
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then clear the PTE_D (and PTE_BC_DIRTY) bit using
+// sys_page_map.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
+// Hint: Use va_is_mapped, va_is_dirty, and disk_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
 void
@@ -87,21 +348,56 @@ flush_block(void *addr)
 		panic("flush_block of bad va %08x", addr);
 
 	// LAB 5: Your code here.
-	if(!va_is_mapped(addr)) {
+	if(!va_is_mapped(addr) || log_holds(blockno)) {
 		return;
 	} 
 	if(!va_is_dirty(addr)) {
 		return;
 	}
-	int r = ide_write(blockno * BLKSECTS, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), BLKSECTS);
+	int r = disk_write(blockno * BLKSECTS, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), BLKSECTS);
 	if(r != 0)
 		panic("%e", r);
+	bcstats.ret_writebacks++;
 	int64_t permission = uvpt[((int64_t)addr >> PGSHIFT)] & 0xFFFLL;
-	r = sys_page_map(0, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), 0, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), permission & PTE_SYSCALL);
+	r = sys_page_map(0, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), 0, (void*)ROUNDDOWN((int64_t)addr, PGSIZE), permission & PTE_SYSCALL & ~PTE_BC_DIRTY);
 	if(r != 0)
 		panic("%e", r);
 }
 
+// Write out whichever of the n blocks from 'blockno' on are in memory
+// and dirty, each stretch of consecutive ones (up to BC_MAXRUN) with a
+// single disk write, and mark them clean.  Blocks in the running
+// transaction wait for it to commit.
+void
+flush_blocks(uint64_t blockno, uint64_t n)
+{
+	uint64_t i, run, j;
+	void *va;
+	int r;
+
+	for (i = 0; i < n; i += run) {
+		for (run = 0; i + run < n && run < BC_MAXRUN; run++) {
+			va = diskaddr(blockno + i + run);
+			if (!va_is_mapped(va) || !va_is_dirty(va)
+			    || log_holds(blockno + i + run))
+				break;
+		}
+		if (run == 0) {
+			run = 1;
+			continue;
+		}
+		va = diskaddr(blockno + i);
+		if ((r = disk_write((blockno + i) * BLKSECTS, va, run * BLKSECTS)) < 0)
+			panic("in flush_blocks, disk_write: %e", r);
+		for (j = 0; j < run; j++)
+			if ((r = sys_page_map(0, va + j * BLKSIZE, 0, va + j * BLKSIZE,
+					      uvpt[PGNUM(va + j * BLKSIZE)] & PTE_SYSCALL
+					      & ~PTE_BC_DIRTY)) < 0)
+				panic("in flush_blocks, sys_page_map: %e", r);
+		bcstats.ret_writebacks += run;
+	}
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -135,6 +431,9 @@ void
 bc_init(void)
 {
 	struct Super super;
+
+	static_assert(DISKMAP + DISKSIZE <= FILEVA);
+	static_assert(BC_STAGEVA + BC_NRUNS * BC_MAXRUN * PGSIZE <= USTACKTOP - PGSIZE);
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
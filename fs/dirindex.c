@@ -0,0 +1,252 @@
+#include <inc/string.h>
+
+#include "fs.h"
+
+// Hashed directory index.  A directory's entries are an array of struct
+// Files, as ever; once it outgrows a block, f_dirindex points to a hash
+// table of its entries, so that finding a name means reading one bucket
+// instead of every block of the directory.  The table grows by linear
+// hashing, splitting one bucket at a time as entries are added, so that
+// each change is to a few blocks the journal has room for.  The table's
+// blocks are metadata, like the directory's own.
+//
+// A bucket that fills up anyway (with hundreds of thousands of entries)
+// drops the index, and the directory is searched linearly again, as
+// are directories too big to index all at once that don't have one.
+
+#define DI_NBUCKETS	(BLKSIZE / 4 - 3)
+#define DB_NENT		((BLKSIZE - 4) / 8)
+// A bucket is split when there are more than this many entries per
+// bucket.
+#define DI_LOAD		64
+// Most buckets a new index for a directory may start with.
+#define DI_BUILDMAX	4
+
+struct DirIndex {
+	uint32_t di_level;		// The table has 2^di_level buckets,
+	uint32_t di_split;		// plus this many split off them
+	uint32_t di_count;		// Entries in it
+	uint32_t di_bucket[DI_NBUCKETS];
+};
+
+struct DirBucket {
+	uint32_t db_n;
+	struct {
+		uint32_t hash;		// of f_name
+		uint32_t slot;		// Entry number in the directory
+	} db_ent[DB_NENT];
+};
+
+// FNV-1a.
+static uint32_t
+di_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619u;
+	return h;
+}
+
+static struct DirBucket *
+di_bucket(struct DirIndex *di, uint32_t h)
+{
+	uint32_t b = h & ((1u << di->di_level) - 1);
+
+	if (b < di->di_split)
+		b = h & ((2u << di->di_level) - 1);
+	return diskaddr(di->di_bucket[b]);
+}
+
+// Allocate a zeroed block for an index.
+static int
+di_alloc(void)
+{
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	bc_zero(r);
+	log_write(diskaddr(r));
+	return r;
+}
+
+// Entry number 'slot' of dir, or NULL if there's no such entry.
+static struct File *
+di_entry(struct File *dir, uint32_t slot)
+{
+	char *blk;
+
+	if (slot >= dir->f_size / sizeof(struct File)
+	    || file_get_block(dir, slot / BLKFILES, &blk) < 0)
+		return NULL;
+	return (struct File *) blk + slot % BLKFILES;
+}
+
+// Free dir's index, if it has one.
+void
+dirindex_free(struct File *dir)
+{
+	struct DirIndex *di;
+	uint32_t i;
+
+	if (!dir->f_dirindex)
+		return;
+	di = diskaddr(dir->f_dirindex);
+	for (i = 0; i < (1u << di->di_level) + di->di_split; i++)
+		free_block(di->di_bucket[i]);
+	free_block(dir->f_dirindex);
+	dir->f_dirindex = 0;
+	log_write(dir);
+}
+
+static int
+di_insert(struct DirIndex *di, uint32_t h, uint32_t slot)
+{
+	struct DirBucket *db = di_bucket(di, h);
+
+	if (db->db_n == DB_NENT)
+		return -E_NO_DISK;
+	db->db_ent[db->db_n].hash = h;
+	db->db_ent[db->db_n].slot = slot;
+	db->db_n++;
+	log_write(db);
+	di->di_count++;
+	log_write(di);
+	return 0;
+}
+
+// If the table is fuller than DI_LOAD, split the next bucket in line,
+// moving the entries that now hash past the old buckets to a new one.
+static void
+di_split(struct DirIndex *di)
+{
+	uint32_t nbuckets = (1u << di->di_level) + di->di_split, i;
+	struct DirBucket *old, *new;
+	int r;
+
+	if (nbuckets == DI_NBUCKETS || di->di_count <= nbuckets * DI_LOAD)
+		return;
+	if ((r = di_alloc()) < 0)
+		return;
+	di->di_bucket[nbuckets] = r;
+	old = diskaddr(di->di_bucket[di->di_split]);
+	new = diskaddr(r);
+	for (i = 0; i < old->db_n; )
+		if ((old->db_ent[i].hash >> di->di_level) & 1) {
+			new->db_ent[new->db_n++] = old->db_ent[i];
+			old->db_ent[i] = old->db_ent[--old->db_n];
+		} else
+			i++;
+	log_write(old);
+	if (++di->di_split == 1u << di->di_level) {
+		di->di_level++;
+		di->di_split = 0;
+	}
+	log_write(di);
+}
+
+// Index dir, which has no index, with enough buckets to begin with
+// that none is fuller than DI_LOAD on average.
+static int
+di_build(struct File *dir)
+{
+	uint32_t n = dir->f_size / sizeof(struct File), level, root, slot, i;
+	struct DirIndex *di;
+	struct File *f;
+	int r;
+
+	for (level = 0; (1u << level) * DI_LOAD < n; level++)
+		/* do nothing */;
+	if ((1u << level) > DI_BUILDMAX)
+		return -E_NO_DISK;
+	if ((r = di_alloc()) < 0)
+		return r;
+	root = r;
+	di = diskaddr(root);
+	for (i = 0; i < (1u << level); i++) {
+		if ((r = di_alloc()) < 0) {
+			while (i > 0)
+				free_block(di->di_bucket[--i]);
+			free_block(root);
+			return r;
+		}
+		di->di_bucket[i] = r;
+	}
+	di->di_level = level;
+	dir->f_dirindex = root;
+	log_write(dir);
+
+	for (slot = 0; slot < n; slot++)
+		if ((f = di_entry(dir, slot)) && f->f_name[0] != '\0'
+		    && (r = di_insert(di, di_hash(f->f_name), slot)) < 0) {
+			dirindex_free(dir);
+			return r;
+		}
+	return 0;
+}
+
+// Look 'name' up in dir's index, indexing dir first if it has grown
+// past a block without one.  Returns 0 and sets *pf, or -E_NOT_FOUND;
+// or -E_NOT_SUPP if dir has no index, for the caller to search it.
+int
+dirindex_lookup(struct File *dir, const char *name, struct File **pf)
+{
+	struct DirBucket *db;
+	struct File *f;
+	uint32_t h = di_hash(name), i;
+
+	if (!dir->f_dirindex && (dir->f_size <= BLKSIZE || di_build(dir) < 0))
+		return -E_NOT_SUPP;
+	db = di_bucket(diskaddr(dir->f_dirindex), h);
+	for (i = 0; i < db->db_n; i++)
+		if (db->db_ent[i].hash == h
+		    && (f = di_entry(dir, db->db_ent[i].slot))
+		    && strcmp(f->f_name, name) == 0) {
+			*pf = f;
+			return 0;
+		}
+	return -E_NOT_FOUND;
+}
+
+// Entry 'slot' of dir has just been named 'name'.
+void
+dirindex_add(struct File *dir, uint32_t slot, const char *name)
+{
+	struct DirIndex *di;
+
+	if (!dir->f_dirindex)
+		return;
+	di = diskaddr(dir->f_dirindex);
+	if (di_insert(di, di_hash(name), slot) < 0) {
+		dirindex_free(dir);
+		return;
+	}
+	di_split(di);
+}
+
+// Take dir's entry f, about to be removed, out of its index.  Returns
+// f's entry number, or -E_NOT_SUPP if dir has no index.
+int
+dirindex_remove(struct File *dir, struct File *f)
+{
+	struct DirIndex *di;
+	struct DirBucket *db;
+	uint32_t h = di_hash(f->f_name), i;
+
+	if (!dir->f_dirindex)
+		return -E_NOT_SUPP;
+	di = diskaddr(dir->f_dirindex);
+	db = di_bucket(di, h);
+	for (i = 0; i < db->db_n; i++)
+		if (db->db_ent[i].hash == h
+		    && di_entry(dir, db->db_ent[i].slot) == f) {
+			h = db->db_ent[i].slot;
+			db->db_ent[i] = db->db_ent[--db->db_n];
+			log_write(db);
+			di->di_count--;
+			log_write(di);
+			return h;
+		}
+	return -E_NOT_FOUND;
+}
@@ -0,0 +1,164 @@
+#include "fs.h"
+#include <inc/x86.h>
+
+// The disk under the block cache.  Transfers of whole pages go through
+// the kernel's disk driver when there is one (see inc/disk.h): by DMA
+// on our IDE drive, and always for a disk on any other controller,
+// which there's no other way to reach.  Anything else goes by PIO, in
+// ide.c.
+//
+// Reads can also be started now and waited for later, as many at once
+// as the driver has slots.  A transfer that needs a slot, or needs the
+// IDE channel to itself for PIO, first waits for the oldest of them,
+// keeping its result in its struct diskreq for disk_wait.
+
+#define MAXPENDING	32
+
+static struct diskinfo info;
+static int diskno;		// Our IDE drive
+static bool dma_ok;		// Whole pages go through the kernel
+
+// Started reads not reaped yet, oldest first.
+static struct diskreq *pending[MAXPENDING];
+static int npending;
+
+// TSC cycles spent driving the disk: all of a PIO transfer, but only
+// the system calls around a DMA one, not the wait for the interrupt.
+uint64_t disk_io_cycles;
+
+void
+disk_init(void)
+{
+	if (sys_disk_info(&info) < 0)
+		info.di_type = DISK_NONE;
+	dma_ok = info.di_type != DISK_NONE;
+	if (info.di_type == DISK_NONE || info.di_type == DISK_IDE) {
+		// Find a JOS disk.  Use the second IDE disk (number 1) if
+		// available.
+		diskno = ide_probe_disk1() ? 1 : 0;
+		ide_set_disk(diskno);
+	}
+}
+
+// How many reads can be in flight at once; 0 if they can't be started
+// ahead at all.
+int
+disk_slots(void)
+{
+	return dma_ok ? MIN(info.di_slots, MAXPENDING) : 0;
+}
+
+static int
+reap(int tag)
+{
+	uint64_t start;
+	int r;
+
+	do {
+		start = read_tsc();
+		r = sys_disk_reap(tag);
+	} while (r == -E_AGAIN);
+	disk_io_cycles += read_tsc() - start;
+	return r;
+}
+
+static void
+reap_oldest(void)
+{
+	struct diskreq *req = pending[0];
+
+	req->result = reap(req->tag);
+	req->pending = false;
+	memmove(&pending[0], &pending[1], --npending * sizeof(pending[0]));
+}
+
+// Have the kernel start a transfer, waiting for a slot if they're all
+// taken.  Returns its tag.
+static int
+submit(uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	uint64_t start;
+	int r;
+
+	while (1) {
+		start = read_tsc();
+		r = sys_disk_submit(diskno, secno, va, nsecs, write);
+		disk_io_cycles += read_tsc() - start;
+		if (r != -E_AGAIN || npending == 0)
+			return r;
+		reap_oldest();
+	}
+}
+
+static bool
+kernel_can(const void *va, size_t nsecs)
+{
+	return dma_ok && (uintptr_t) va % PGSIZE == 0 && nsecs % BLKSECTS == 0;
+}
+
+static int
+transfer(uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	uint64_t start;
+	int r;
+
+	assert(nsecs <= DISK_MAXSECS);
+	if (kernel_can(va, nsecs) && (r = submit(secno, va, nsecs, write)) >= 0)
+		return reap(r);
+	if (info.di_type != DISK_NONE && info.di_type != DISK_IDE)
+		panic("disk can't transfer %d sectors at %p", nsecs, va);
+	while (npending)
+		reap_oldest();
+	start = read_tsc();
+	r = write ? ide_write(secno, va, nsecs) : ide_read(secno, va, nsecs);
+	disk_io_cycles += read_tsc() - start;
+	return r;
+}
+
+int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return transfer(secno, dst, nsecs, 0);
+}
+
+int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return transfer(secno, (void *) src, nsecs, 1);
+}
+
+// Start reading 'nsecs' sectors from 'secno' into the whole pages at
+// 'dst' and return without waiting for them; disk_wait(req) waits.
+// Returns -E_NOT_SUPP, having started nothing, if the read can't be
+// done that way; disk_read can do it.
+int
+disk_start_read(struct diskreq *req, uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	if (!kernel_can(dst, nsecs) || npending == MAXPENDING)
+		return -E_NOT_SUPP;
+	if ((r = submit(secno, dst, nsecs, 0)) < 0)
+		return -E_NOT_SUPP;
+	req->tag = r;
+	req->pending = true;
+	pending[npending++] = req;
+	return 0;
+}
+
+// Wait for the read 'req' if it's still going, and return its result.
+int
+disk_wait(struct diskreq *req)
+{
+	int i;
+
+	if (req->pending) {
+		for (i = 0; pending[i] != req; i++)
+			/* do nothing */;
+		memmove(&pending[i], &pending[i + 1],
+			(--npending - i) * sizeof(pending[0]));
+		req->result = reap(req->tag);
+		req->pending = false;
+	}
+	return req->result;
+}
@@ -0,0 +1,228 @@
+#include "fs.h"
+
+// Extent maps, on disks formatted with them (see inc/fs.h).  A file
+// there has no holes: growing it allocates and zeroes its new blocks,
+// so extents are only added at its end -- or the last one lengthened,
+// when the new blocks follow it on disk -- and only taken off its end.
+//
+// A lookup is a binary search of the extents, but the extent the last
+// one found is tried first, so that reading a file in order costs one
+// search per extent rather than one per block.
+
+#define EXT_MAX		(NEXTINLINE + NEXTPERBLK + NINDIRECT * NEXTPERBLK)
+
+static struct {
+	struct File *f;		// 0 if there's none
+	struct Extent e;
+} ext_hint;
+
+// Allocate a zeroed block for f's extent tree and point *pblockno at it.
+static int
+ext_tree_block(uint32_t *pblockno)
+{
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	bc_zero(r);
+	log_write(diskaddr(r));
+	*pblockno = r;
+	log_write(pblockno);
+	return 0;
+}
+
+// Extent number i of f.  If the tree has no block for it yet, allocate
+// one if 'alloc' is set; otherwise, or if that fails, return NULL.
+static struct Extent *
+ext_slot(struct File *f, uint32_t i, bool alloc)
+{
+	uint32_t *ptrs;
+
+	if (i < NEXTINLINE)
+		return &f->f_ext[i];
+	i -= NEXTINLINE;
+	if (i < NEXTPERBLK) {
+		if (!f->f_extind && (!alloc || ext_tree_block(&f->f_extind) < 0))
+			return NULL;
+		return (struct Extent *) diskaddr(f->f_extind) + i;
+	}
+	i -= NEXTPERBLK;
+	if (i >= NINDIRECT * NEXTPERBLK)
+		return NULL;
+	if (!f->f_extdind && (!alloc || ext_tree_block(&f->f_extdind) < 0))
+		return NULL;
+	ptrs = diskaddr(f->f_extdind);
+	if (!ptrs[i / NEXTPERBLK]
+	    && (!alloc || ext_tree_block(&ptrs[i / NEXTPERBLK]) < 0))
+		return NULL;
+	return (struct Extent *) diskaddr(ptrs[i / NEXTPERBLK]) + i % NEXTPERBLK;
+}
+
+// How many blocks f's extents map.
+static uint32_t
+ext_nblocks(struct File *f)
+{
+	struct Extent *e;
+
+	if (f->f_nextents == 0)
+		return 0;
+	e = ext_slot(f, f->f_nextents - 1, 0);
+	return e->e_fileblk + e->e_len;
+}
+
+// f's disk block for 'filebno', or 0 if it has none.  If 'prun' isn't
+// NULL, sets *prun to how many blocks from 'filebno' on lie in order on
+// disk from there.
+uint32_t
+ext_lookup(struct File *f, uint32_t filebno, uint32_t *prun)
+{
+	struct Extent *e;
+	uint32_t lo, hi, mid;
+
+	if (ext_hint.f != f || filebno < ext_hint.e.e_fileblk
+	    || filebno - ext_hint.e.e_fileblk >= ext_hint.e.e_len) {
+		if (f->f_nextents == 0)
+			return 0;
+		// The last extent starting at or before 'filebno'.
+		for (lo = 0, hi = f->f_nextents; hi - lo > 1; ) {
+			mid = (lo + hi) / 2;
+			if (ext_slot(f, mid, 0)->e_fileblk <= filebno)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		e = ext_slot(f, lo, 0);
+		if (filebno < e->e_fileblk || filebno - e->e_fileblk >= e->e_len)
+			return 0;
+		ext_hint.f = f;
+		ext_hint.e = *e;
+	}
+	if (prun)
+		*prun = ext_hint.e.e_len - (filebno - ext_hint.e.e_fileblk);
+	return ext_hint.e.e_start + (filebno - ext_hint.e.e_fileblk);
+}
+
+// Map f's blocks up to 'nblocks', allocating the ones it doesn't have
+// yet in as few runs as the disk allows, and zeroing them.  A request
+// gets one transaction's worth of log (see log_init), so this adds at
+// most one extent, and for a directory one block, per call.  Returns
+// how many blocks f maps now, which may be fewer than 'nblocks': the
+// caller's request is then complete as far as it got, and its client
+// is to ask again.
+int
+ext_grow(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t have = ext_nblocks(f), start, i;
+	bool added = 0;
+	int got;
+
+	if (nblocks > MAXEXTFILESIZE / BLKSIZE)
+		return -E_INVAL;
+	if (f->f_type == FTYPE_DIR)
+		nblocks = MIN(nblocks, have + 1);
+	ext_hint.f = NULL;
+	while (have < nblocks) {
+		e = f->f_nextents ? ext_slot(f, f->f_nextents - 1, 0) : NULL;
+		if ((got = alloc_run(e ? e->e_start + e->e_len : 0,
+				     nblocks - have, &start)) < 0)
+			return got;
+		if (e && e->e_start + e->e_len == start) {
+			e->e_len += got;
+			log_write(e);
+		} else {
+			if (added || f->f_nextents == EXT_MAX
+			    || !(e = ext_slot(f, f->f_nextents, 1))) {
+				for (i = 0; i < got; i++)
+					free_block(start + i);
+				if (added)
+					break;
+				return -E_NO_DISK;
+			}
+			e->e_fileblk = have;
+			e->e_start = start;
+			e->e_len = got;
+			log_write(e);
+			f->f_nextents++;
+			log_write(f);
+			added = 1;
+		}
+		for (i = 0; i < got; i++) {
+			bc_zero(start + i);
+			// A directory's blocks are metadata too.
+			if (f->f_type == FTYPE_DIR)
+				log_write(diskaddr(start + i));
+		}
+		have += got;
+	}
+	return have;
+}
+
+// Free f's blocks from 'nblocks' on, and whatever blocks of its extent
+// tree it no longer needs.
+void
+ext_truncate(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t *ptrs, keep, i, n;
+
+	ext_hint.f = NULL;
+	while (f->f_nextents > 0) {
+		e = ext_slot(f, f->f_nextents - 1, 0);
+		if (e->e_fileblk + e->e_len <= nblocks)
+			break;
+		keep = nblocks > e->e_fileblk ? nblocks - e->e_fileblk : 0;
+		for (i = keep; i < e->e_len; i++)
+			free_block(e->e_start + i);
+		if (keep > 0) {
+			e->e_len = keep;
+			log_write(e);
+			break;
+		}
+		f->f_nextents--;
+	}
+	log_write(f);
+
+	n = f->f_nextents;
+	if (f->f_extdind) {
+		// Leaf blocks the double-indirect block still needs.
+		keep = n > NEXTINLINE + NEXTPERBLK
+			? ROUNDUP(n - NEXTINLINE - NEXTPERBLK, NEXTPERBLK) / NEXTPERBLK : 0;
+		ptrs = diskaddr(f->f_extdind);
+		for (i = keep; i < NINDIRECT; i++)
+			if (ptrs[i]) {
+				free_block(ptrs[i]);
+				ptrs[i] = 0;
+				log_write(&ptrs[i]);
+			}
+		if (keep == 0) {
+			free_block(f->f_extdind);
+			f->f_extdind = 0;
+		}
+	}
+	if (n <= NEXTINLINE && f->f_extind) {
+		free_block(f->f_extind);
+		f->f_extind = 0;
+	}
+}
+
+// Write out f's dirty data blocks, each extent's with as few writes as
+// it takes, and its extent tree.
+void
+ext_flush(struct File *f)
+{
+	struct Extent *e;
+	uint32_t *ptrs, i;
+
+	for (i = 0; i < f->f_nextents; i++)
+		if ((e = ext_slot(f, i, 0)))
+			flush_blocks(e->e_start, e->e_len);
+	if (f->f_extind)
+		flush_block(diskaddr(f->f_extind));
+	if (f->f_extdind) {
+		ptrs = diskaddr(f->f_extdind);
+		for (i = 0; i < NINDIRECT && ptrs[i]; i++)
+			flush_block(diskaddr(ptrs[i]));
+		flush_block(ptrs);
+	}
+}
@@ -1,4 +1,5 @@
 #include <inc/string.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
@@ -6,6 +7,7 @@
 // A better design would have some way to organize more than one...
 struct Super *super;	// superblock
 uint32_t *bitmap;	// bitmap blocks mapped in memory
+bool fs_extents;	// Files are mapped by extents (extent.c)
 
 // --------------------------------------------------------------
 // Super block
@@ -21,6 +23,9 @@ check_super(void)
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
+	if (super->s_version > FS_VERSION_EXTENTS)
+		panic("unknown file system version %d", super->s_version);
+
 	cprintf("superblock is good\n");
 }
 
@@ -48,36 +53,91 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	log_write(&bitmap[blockno/32]);
+}
+
+// Allocation is next-fit: the search starts where the last one ended,
+// rather than at the start of the disk every time.
+static uint32_t alloc_cursor = 2;
+uint64_t alloc_count;		// Blocks allocated
+uint64_t alloc_cycles;		// and TSC cycles spent doing it
+
+// The blocks of the bitmap's 64-bit word 'w' that may be allocated:
+// free, not freed by the running transaction, and on the disk.
+static uint64_t
+alloc_word(uint32_t w)
+{
+	uint64_t bits = ((uint64_t *) bitmap)[w] & log_alloc_mask(w);
+
+	// The bitmap's last block has bits set past the end of the disk.
+	if ((w + 1) * 64 > super->s_nblocks)
+		bits &= (1ULL << (super->s_nblocks % 64)) - 1;
+	return bits;
+}
+
+// The first block at or after 'goal' that may be allocated, wrapping
+// around the end of the disk, or -E_NO_DISK.  Whole words at a time.
+static int
+alloc_find(uint32_t goal)
+{
+	uint32_t nwords = ROUNDUP(super->s_nblocks, 64) / 64;
+	uint32_t w = goal / 64, i;
+	uint64_t bits = alloc_word(w) & (~0ULL << (goal % 64));
+
+	// The first word is looked at twice: from 'goal' on, and at the
+	// end, below it.
+	for (i = 0; i < nwords; i++) {
+		if (bits)
+			return w * 64 + __builtin_ctzll(bits);
+		w = (w + 1) % nwords;
+		bits = alloc_word(w);
+	}
+	if (bits)
+		return w * 64 + __builtin_ctzll(bits);
+	return -E_NO_DISK;
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Allocate up to 'want' consecutive blocks, the first of them the first
+// free block at or after 'goal', or after the cursor if 'goal' is 0.
+// Sets *pstart to the first and returns how many it got, at least 1;
+// or returns -E_NO_DISK.
+int
+alloc_run(uint32_t goal, uint32_t want, uint32_t *pstart)
+{
+	uint64_t tsc = read_tsc();
+	uint32_t n;
+	int b;
+
+	if (goal < 2 || goal >= super->s_nblocks)
+		goal = alloc_cursor;
+	if ((b = alloc_find(goal)) < 0)
+		return b;
+	for (n = 0; n < want && b + n < super->s_nblocks
+		     && (alloc_word((b + n) / 64) >> ((b + n) % 64)) & 1; n++) {
+		bitmap[(b + n) / 32] &= ~(1 << ((b + n) % 32));
+		log_write(&bitmap[(b + n) / 32]);
+	}
+	alloc_cursor = b + n < super->s_nblocks ? b + n : 2;
+	alloc_count += n;
+	alloc_cycles += read_tsc() - tsc;
+	*pstart = b;
+	return n;
+}
+
+// Search the bitmap for a free block and allocate it.  The changed
+// bitmap block is written back with everything else (see fs_sync).
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	uint32_t blockno;
+	int r;
 
-	// LAB 5: Your code here.
-	uint32_t blockno = 2;
-	while(blockno < super->s_nblocks) {
-		if(block_is_free(blockno)) {
-			bitmap[blockno/32] &= ~(1<<(blockno%32));
-			flush_block(bitmap);
-			flush_block(diskaddr(blockno));
-			return blockno;
-		}
-		blockno += 1;
-	}
-	return -E_NO_DISK;
-	
+	if ((r = alloc_run(0, 1, &blockno)) < 0)
+		return r;
+	return blockno;
 }
 
 // Validate the file system bitmap.
@@ -97,6 +157,10 @@ check_bitmap(void)
 	assert(!block_is_free(0));
 	assert(!block_is_free(1));
 
+	// And the journal.
+	for (i = 0; i < super->s_nlog; i++)
+		assert(!block_is_free(super->s_logstart + i));
+
 	cprintf("bitmap is good\n");
 }
 
@@ -112,11 +176,7 @@ fs_init(void)
 	static_assert(sizeof(struct File) == 256);
 
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
+	disk_init();
 
 
 	bc_init();
@@ -124,6 +184,10 @@ fs_init(void)
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	fs_extents = super->s_version == FS_VERSION_EXTENTS;
+
+	// Replay the journal before anything reads what it may hold.
+	log_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
@@ -173,11 +237,12 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 					if(new_indirect < 0) 
 						return new_indirect;
 					f->f_indirect = new_indirect;
+					log_write(f);
 
 					memset(diskaddr(new_indirect), 0, PGSIZE);
+					log_write(diskaddr(new_indirect));
 					uint32_t* indirect_ptr = diskaddr(f->f_indirect);
 					*ppdiskbno = (indirect_ptr + (size_t) (filebno - 10));
-					flush_block(diskaddr(new_indirect));
 					return 0;
 				} else { 
 					return -E_NOT_FOUND;
@@ -192,6 +257,87 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		return 0;
 }
 
+// f's disk block for 'filebno', or 0 if it has none yet.  Unlike
+// file_block_walk, never allocates.
+static uint32_t
+file_peek_block(struct File *f, uint32_t filebno)
+{
+	if (filebno < NDIRECT)
+		return f->f_direct[filebno];
+	if (filebno >= NDIRECT + NINDIRECT || f->f_indirect == 0)
+		return 0;
+	return ((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
+}
+
+// f's disk block for 'filebno', or 0 if it has none, in whichever way
+// the disk maps it.  If 'prun' isn't NULL, sets *prun to how many blocks
+// from 'filebno' on are known to follow it on disk, at least 1.
+static uint32_t
+file_map_block(struct File *f, uint32_t filebno, uint32_t *prun)
+{
+	if (fs_extents)
+		return ext_lookup(f, filebno, prun);
+	if (prun)
+		*prun = 1;
+	return file_peek_block(f, filebno);
+}
+
+// Where block 'filebno' of f had best go: right after the block
+// before it, so that the file lies in order on disk.  0 for anywhere.
+static uint32_t
+file_goal(struct File *f, uint32_t filebno)
+{
+	uint32_t prev;
+
+	if (filebno == 0 || (prev = file_peek_block(f, filebno - 1)) == 0)
+		return 0;
+	return prev + 1;
+}
+
+// Point f's block slot 'pdiskbno' at the new block 'blockno', zeroed.
+static void
+file_set_block(struct File *f, uint32_t *pdiskbno, uint32_t blockno)
+{
+	bc_zero(blockno);
+	*pdiskbno = blockno;
+	log_write(pdiskbno);
+	// A directory's blocks are metadata too.
+	if (f->f_type == FTYPE_DIR)
+		log_write(diskaddr(blockno));
+}
+
+// Give each of blocks filebno .. filebno+n-1 of f that has no disk
+// block one, with each stretch of them that's missing allocated as one
+// run where the disk has room for it.
+static int
+file_alloc_blocks(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t *pdiskbno, start, want, i;
+	int r, got;
+
+	while (n > 0) {
+		if (file_peek_block(f, filebno)) {
+			filebno++;
+			n--;
+			continue;
+		}
+		for (want = 1; want < n && !file_peek_block(f, filebno + want); want++)
+			/* do nothing */;
+		// Any indirect block first, so that it doesn't split the run.
+		if ((r = file_block_walk(f, filebno + want - 1, &pdiskbno, 1)) < 0)
+			return r;
+		if ((got = alloc_run(file_goal(f, filebno), want, &start)) < 0)
+			return got;
+		for (i = 0; i < got; i++) {
+			file_block_walk(f, filebno + i, &pdiskbno, 1);
+			file_set_block(f, pdiskbno, start + i);
+		}
+		filebno += got;
+		n -= got;
+	}
+	return 0;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -204,17 +350,34 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	// LAB 5: Your code here.
 	uint32_t* ppdiskbno = NULL;
+	uint32_t diskbno;
 	int ret;
+
+	if (fs_extents) {
+		// Past what's mapped: map up to it, as for a block format
+		// file's hole.
+		if ((diskbno = ext_lookup(f, filebno, NULL)) == 0) {
+			if ((ret = ext_grow(f, filebno + 1)) < 0)
+				return ret;
+			if ((uint32_t) ret <= filebno)
+				return -E_AGAIN;
+			diskbno = ext_lookup(f, filebno, NULL);
+		} else
+			bc_lookup(diskaddr(diskbno));
+		*blk = diskaddr(diskbno);
+		return 0;
+	}
 	ret = file_block_walk(f, filebno, &ppdiskbno, 1);
 	if(ret < 0)
 		return ret;
 	if(*ppdiskbno == 0) {
-		ret = alloc_block();
+		uint32_t blockno;
+		ret = alloc_run(file_goal(f, filebno), 1, &blockno);
 		if(ret < 0)
 			return ret;
-		memset(diskaddr(ret), 0, PGSIZE);
-		*ppdiskbno = ret;
-	}
+		file_set_block(f, ppdiskbno, blockno);
+	} else
+		bc_lookup(diskaddr(*ppdiskbno));
 	*blk = diskaddr(*ppdiskbno);
 	return 0;
 }
@@ -235,6 +398,8 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+	if ((r = dirindex_lookup(dir, name, file)) != -E_NOT_SUPP)
+		return r;
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -249,10 +414,11 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pslot to
+// its entry number.  The search starts at dir's f_dirfree hint.  The
+// caller is responsible for filling in the File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pslot)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -261,13 +427,17 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	for (i = dir->f_dirfree / BLKFILES; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
+			if (i * BLKFILES + j >= dir->f_dirfree
+			    && f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pslot = i * BLKFILES + j;
+				dir->f_dirfree = *pslot + 1;
+				log_write(dir);
 				return 0;
 			}
 	}
@@ -276,9 +446,26 @@ dir_alloc_file(struct File *dir, struct File **file)
 		return r;
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pslot = i * BLKFILES;
+	dir->f_dirfree = *pslot + 1;
+	log_write(dir);
 	return 0;
 }
 
+// The entry number of f in dir, looking through dir's blocks for it.
+static uint32_t
+dir_slot_of(struct File *dir, struct File *f)
+{
+	uint32_t i;
+	char *blk;
+
+	for (i = 0; i < dir->f_size / BLKSIZE; i++)
+		if (file_get_block(dir, i, &blk) == 0
+		    && (char *) f >= blk && (char *) f < blk + BLKSIZE)
+			return i * BLKFILES + ((char *) f - blk) / sizeof(struct File);
+	panic("dir_slot_of: %s isn't in %s", f->f_name, dir->f_name);
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -355,17 +542,21 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t slot;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &slot)) < 0)
 		return r;
+	// A removed file's entry may still hold some of its fields.
+	memset(f, 0, sizeof(*f));
 	strcpy(f->f_name, name);
+	log_write(f);
+	dirindex_add(dir, slot, name);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -404,6 +595,31 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Bring blocks filebno .. filebno+n-1 of f into the block cache ahead
+// of use, with blocks that follow each other on disk read together.  Stops at the end of the file or a hole.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t diskbno, run, start = 0, len = 0, end;
+
+	end = MIN(filebno + n, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (; filebno < end; filebno += run) {
+		if ((diskbno = file_map_block(f, filebno, &run)) == 0)
+			break;
+		run = MIN(run, end - filebno);
+		if (len && diskbno == start + len) {
+			len += run;
+			continue;
+		}
+		if (len)
+			bc_readahead(start, len);
+		start = diskbno;
+		len = run;
+	}
+	if (len)
+		bc_readahead(start, len);
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -416,10 +632,16 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
-	// Extend file if necessary
+	// Extend file if necessary.  -E_AGAIN means the file grew, but not
+	// far enough yet to write to; the client sends the write again.
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
+	// (With extents, file_set_size has allocated them.)
+	if (count > 0 && !fs_extents
+	    && (r = file_alloc_blocks(f, offset / BLKSIZE,
+				      (offset + count - 1) / BLKSIZE - offset / BLKSIZE + 1)) < 0)
+		return r;
 
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
@@ -448,6 +670,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		log_write(ptr);
 	}
 	return 0;
 }
@@ -469,6 +692,10 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (fs_extents) {
+		ext_truncate(f, new_nblocks);
+		return;
+	}
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
@@ -480,34 +707,65 @@ file_truncate_blocks(struct File *f, off_t newsize)
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Extending a file on a disk with extents allocates its new blocks,
+// as many as one request may (see ext_grow); if that's not all of
+// them, f grows to the blocks it has, and this returns -E_AGAIN.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	uint32_t nblocks = ROUNDUP((uint32_t) newsize, BLKSIZE) / BLKSIZE;
+	int r;
+
+	if (newsize < 0)
+		return -E_INVAL;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
+	else if (fs_extents && (r = ext_grow(f, nblocks)) < 0) {
+		file_truncate_blocks(f, f->f_size);
+		return r;
+	} else if (fs_extents && (uint32_t) r < nblocks) {
+		f->f_size = r * BLKSIZE;
+		log_write(f);
+		return -E_AGAIN;
+	}
 	f->f_size = newsize;
-	flush_block(f);
+	log_write(f);
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Flush the contents and metadata of file f out to disk: its blocks,
+// each stretch of them that's contiguous on disk in one write, its
+// indirect block, the directory block holding f, and the bitmap.  With
+// a journal, the metadata goes by committing the running transaction.
 void
 file_flush(struct File *f)
 {
 	int i;
 	uint32_t *pdiskbno;
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
+	uint32_t start = 0, n = 0;
+
+	for (i = 0; !fs_extents && i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		if (n > 0 && *pdiskbno == start + n) {
+			n++;
+			continue;
+		}
+		if (n > 0)
+			flush_blocks(start, n);
+		start = *pdiskbno;
+		n = 1;
 	}
-	flush_block(f);
-	if (f->f_indirect)
+	if (n > 0)
+		flush_blocks(start, n);
+	if (fs_extents)
+		ext_flush(f);
+	else if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	flush_block(f);
+	flush_blocks(2, (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+	log_commit();
 }
 
 // Remove a file by truncating it and then zeroing the name.
@@ -515,25 +773,45 @@ int
 file_remove(const char *path)
 {
 	int r;
-	struct File *f;
+	struct File *dir, *f;
 
-	if ((r = walk_path(path, 0, &f, 0)) < 0)
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
 		return r;
 
+	if (dir) {
+		if ((r = dirindex_remove(dir, f)) < 0)
+			r = dir_slot_of(dir, f);
+		dir->f_dirfree = MIN(dir->f_dirfree, (uint32_t) r);
+		log_write(dir);
+	}
+	dirindex_free(f);
 	file_truncate_blocks(f, 0);
 	f->f_name[0] = '\0';
 	f->f_size = 0;
-	flush_block(f);
+	log_write(f);
 
 	return 0;
 }
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system, writing each stretch of consecutive
+// dirty blocks with one disk write.
+//
+// The cache is write-back.  A write, create, truncate or remove is
+// done once it's in memory, and reaches the disk only:
+//  - at the next fs_sync: FSREQ_SYNC, which user/fsflush sends every
+//    few seconds;
+//  - for one file, at FSREQ_FLUSH (file_flush);
+//  - a block at a time, when the cache evicts a dirty block;
+//  - for metadata, when the journal commits (log.c).
+// A crash can lose any change made since the last commit.  With a
+// journal, the metadata on disk is always as of some commit, and file
+// data written before it has reached the disk too.  On a disk
+// formatted without one, nothing orders these writes, and a crash can
+// leave some of a change's blocks on disk but not others.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	flush_blocks(1, super->s_nblocks - 1);
+	log_commit();
 }
 
@@ -13,8 +13,20 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* The rest of the server's address space above the disk map.  Each
+ * region must end before the next begins; the file that owns it checks
+ * that with a static_assert.
+ *	FILEVA		open files' Fd pages (serv.c)
+ *	LOG_STAGEVA	journal I/O and the last commit's bitmap (log.c)
+ *	BC_STAGEVA	read-ahead runs in flight (bc.c)
+ *	USTACKTOP	the stack */
+#define FILEVA		0xD0000000
+#define LOG_STAGEVA	0xD8000000
+#define BC_STAGEVA	0xE0000000
+
 extern struct Super *super;	// superblock
 extern uint32_t *bitmap;	// bitmap blocks mapped in memory
+extern bool fs_extents;		// Files are mapped by extents
 
 /* ide.c */
 bool   ide_probe_disk1(void);
@@ -22,19 +34,60 @@ void   ide_set_disk(int diskno);
 int    ide_read(uint32_t secno, void *dst, size_t nsecs);
 int    ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* disk.c */
+struct diskreq {
+	int tag;		// The kernel's, while it's in flight
+	bool pending;		// Not reaped yet
+	int result;		// once it has been
+};
+
+void   disk_init(void);
+int    disk_slots(void);
+int    disk_read(uint32_t secno, void *dst, size_t nsecs);
+int    disk_write(uint32_t secno, const void *src, size_t nsecs);
+int    disk_start_read(struct diskreq *req, uint32_t secno, void *dst, size_t nsecs);
+int    disk_wait(struct diskreq *req);
+extern uint64_t disk_io_cycles;
+
 /* bc.c */
 void*  diskaddr(uint64_t blockno);
 bool   va_is_mapped(void *va);
 bool   va_is_dirty(void *va);
 void   flush_block(void *addr);
+void   flush_blocks(uint64_t blockno, uint64_t n);
+void   bc_lookup(void *va);
+void   bc_readahead(uint64_t blockno, uint32_t n);
+void*  bc_zero(uint64_t blockno);
+void   bc_stats(struct Fsret_bcstats *st);
 void   bc_init(void);
 
+/* log.c */
+void   log_init(void);
+void   log_begin(void);
+void   log_write(void *va);
+bool   log_holds(uint64_t blockno);
+uint64_t log_alloc_mask(uint32_t w);
+void   log_commit(void);
+
+/* extent.c */
+uint32_t ext_lookup(struct File *f, uint32_t filebno, uint32_t *prun);
+int    ext_grow(struct File *f, uint32_t nblocks);
+void   ext_truncate(struct File *f, uint32_t nblocks);
+void   ext_flush(struct File *f);
+
+/* dirindex.c */
+int    dirindex_lookup(struct File *dir, const char *name, struct File **pf);
+void   dirindex_add(struct File *dir, uint32_t slot, const char *name);
+int    dirindex_remove(struct File *dir, struct File *f);
+void   dirindex_free(struct File *dir);
+
 /* fs.c */
 void   fs_init(void);
 int    file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int    file_create(const char *path, struct File **f);
 int    file_open(const char *path, struct File **f);
 ssize_t file_read(struct File *f, void *buf, size_t count, off_t offset);
+void   file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int    file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int    file_set_size(struct File *f, off_t newsize);
 void   file_flush(struct File *f);
@@ -43,7 +96,10 @@ void   fs_sync(void);
 int    file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc);
 /* int	map_block(uint32_t); */
 bool   block_is_free(uint32_t blockno);
+void   free_block(uint32_t blockno);
 int    alloc_block(void);
+int    alloc_run(uint32_t goal, uint32_t want, uint32_t *pstart);
+extern uint64_t alloc_count, alloc_cycles;
 
 /* test.c */
 void   fs_test(void);
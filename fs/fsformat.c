@@ -47,6 +47,7 @@ struct Dir
 };
 
 uint32_t nblocks;
+int extents;		// Map files with extents (FS_VERSION_EXTENTS)
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
@@ -116,12 +117,17 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_version = extents ? FS_VERSION_EXTENTS : FS_VERSION_BLOCKS;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty journal: its header block is all zeroes.
+	super->s_logstart = blockof(alloc(FS_LOGBLOCKS * BLKSIZE));
+	super->s_nlog = FS_LOGBLOCKS;
 }
 
 void
@@ -142,6 +148,16 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	int i;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
+	// Files are laid out in one piece: at most one extent.
+	if (extents) {
+		if (len > 0) {
+			f->f_nextents = 1;
+			f->f_ext[0].e_fileblk = 0;
+			f->f_ext[0].e_start = start;
+			f->f_ext[0].e_len = len / BLKSIZE;
+		}
+		return;
+	}
 	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
 	if (i == NDIRECT) {
@@ -156,7 +172,7 @@ void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -197,7 +213,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= (extents ? MAXEXTFILESIZE : MAXFILESIZE))
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -216,7 +232,8 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-e] fs.img NBLOCKS files...\n"
+		"  -e  map files with extents\n");
 	exit(2);
 }
 
@@ -231,11 +248,17 @@ main(int argc, char **argv)
 	struct File *b, *sb;
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+		extents = 1;
+		argc--;
+		argv++;
+	}
 	if (argc < 3)
 		usage();
 
+	// Up to 3 GB, all the fs server can map (DISKSIZE in fs/fs.h).
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 10240)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > 0xC0000000 / BLKSIZE)
 		usage();
 
 	opendisk(argv[1]);
@@ -2,6 +2,9 @@
  * Minimal PIO-based (non-interrupt-driven) IDE driver code.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
+ *
+ * The block cache doesn't call these directly but through fs/disk.c,
+ * which has the kernel do page-sized transfers by DMA when it can.
  */
 
 #include "fs.h"
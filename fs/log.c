@@ -0,0 +1,211 @@
+#include "fs.h"
+
+// Metadata journal, after xv6's log.  Blocks holding metadata -- the
+// superblock, the bitmap, directory and indirect blocks, the blocks
+// holding struct Files -- are registered with log_write as they're
+// changed, and then stay in memory, dirty, until the transaction they
+// are part of commits.  log_commit writes copies of them all to the
+// log with one sequential write, then the header saying where each
+// goes, which is the commit point; then it writes them home and clears
+// the header.  After a crash in between, log_init finds the header and
+// writes them home again.
+//
+// A transaction takes in as many requests as fit (group commit): the
+// serve loop calls log_begin before each one, which commits only if
+// the log might not hold another request's worth of blocks.  fs_sync
+// and file_flush commit too.  File data isn't journaled, but is
+// written out before the metadata pointing at it commits (ext3's
+// ordered mode), and a block freed in a transaction isn't handed out
+// again until that commits, so no file's committed blocks ever hold
+// another file's data.
+
+// Pages for log I/O from LOG_STAGEVA (see fs.h): the header, then a
+// copy of each block.  The bitmap as of the last commit follows, in at
+// most as many pages as the largest disk's bitmap takes.
+#define LOG_FREEVA	(LOG_STAGEVA + FS_LOGBLOCKS * PGSIZE)
+#define LOG_NPAGES	(FS_LOGBLOCKS + DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+struct Loghdr {
+	uint32_t lh_n;				// Blocks in the transaction
+	uint32_t lh_block[FS_LOGBLOCKS - 1];	// Where each goes
+};
+
+static bool log_on;
+static uint32_t log_size;		// Blocks a transaction can hold
+static uint32_t log_opmax;		// Most blocks one request changes
+static uint32_t log_nbitblocks;
+static struct Loghdr lh;		// The running transaction
+static uint32_t *log_freemap;
+
+// Move the n blocks from log block 'first' on (block 0 being the
+// header) between the disk and their staging pages.
+static void
+log_io(uint32_t first, uint32_t n, bool write)
+{
+	uint32_t i, run;
+	void *va;
+	int r;
+
+	for (i = 0; i < n; i += run) {
+		run = MIN(n - i, DISK_MAXSECS / BLKSECTS);
+		va = (void *) LOG_STAGEVA + (first + i) * PGSIZE;
+		if (write)
+			r = disk_write((super->s_logstart + first + i) * BLKSECTS,
+				       va, run * BLKSECTS);
+		else
+			r = disk_read((super->s_logstart + first + i) * BLKSECTS,
+				      va, run * BLKSECTS);
+		if (r < 0)
+			panic("log_io: %e", r);
+	}
+}
+
+// Finish installing a transaction that committed before a crash.
+static void
+log_recover(void)
+{
+	struct Loghdr *hdr = (struct Loghdr *) LOG_STAGEVA;
+	uint32_t i, n;
+	int r;
+
+	log_io(0, 1, 0);
+	if ((n = hdr->lh_n) == 0)
+		return;
+	if (n > log_size)
+		panic("log_recover: bad header, %d blocks", n);
+	log_io(1, n, 0);
+	for (i = 0; i < n; i++) {
+		if ((r = disk_write(hdr->lh_block[i] * BLKSECTS,
+				    (void *) LOG_STAGEVA + (1 + i) * PGSIZE,
+				    BLKSECTS)) < 0)
+			panic("log_recover: %e", r);
+		// Whatever's cached is out of date.
+		if (va_is_mapped(diskaddr(hdr->lh_block[i])))
+			sys_page_unmap(0, diskaddr(hdr->lh_block[i]));
+	}
+	hdr->lh_n = 0;
+	log_io(0, 1, 1);
+	cprintf("log: recovered %d blocks\n", n);
+}
+
+// Set up the journal, if the disk has one, and recover from it.  Call
+// before anything reads the bitmap or a directory.
+void
+log_init(void)
+{
+	uint32_t i;
+	int r;
+
+	static_assert(LOG_STAGEVA + LOG_NPAGES * PGSIZE <= BC_STAGEVA);
+	if (super->s_nlog == 0)
+		return;
+	if (super->s_nlog < 2 || super->s_nlog > FS_LOGBLOCKS)
+		panic("log_init: bad log size %d", super->s_nlog);
+	log_size = super->s_nlog - 1;
+	log_nbitblocks = ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE;
+	// The File a request is about and its indirect block, a directory
+	// block, the directory's indirect block and its own File, and at
+	// worst every bitmap block; with extents, besides, two blocks of
+	// extents and the block pointing at them; and a directory index
+	// being built, with its buckets and one split off them.
+	log_opmax = 8 + 6 + log_nbitblocks;
+	if (log_opmax > log_size)
+		panic("log_init: a %d-block log is too small", super->s_nlog);
+
+	for (i = 0; i < FS_LOGBLOCKS + log_nbitblocks; i++)
+		if ((r = sys_page_alloc(0, (void *) LOG_STAGEVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("log_init: %e", r);
+	log_freemap = (uint32_t *) LOG_FREEVA;
+
+	log_recover();
+	memmove(log_freemap, diskaddr(2), log_nbitblocks * BLKSIZE);
+	log_on = true;
+}
+
+// The block holding 'va' has been changed, and is metadata: make it
+// part of the running transaction.
+void
+log_write(void *va)
+{
+	uint32_t blockno = ((uintptr_t) va - DISKMAP) / BLKSIZE;
+	uint32_t i;
+
+	if (!log_on)
+		return;
+	for (i = 0; i < lh.lh_n; i++)
+		if (lh.lh_block[i] == blockno)
+			return;
+	if (lh.lh_n == log_size)
+		panic("log_write: transaction too big");
+	lh.lh_block[lh.lh_n++] = blockno;
+}
+
+// Is 'blockno' part of the running transaction?  Then it mustn't be
+// written home, or leave the cache, before it commits.
+bool
+log_holds(uint64_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < lh.lh_n; i++)
+		if (lh.lh_block[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Which of the blocks in the bitmap's 64-bit word 'w' may be allocated
+// if free: not those freed by the running transaction.
+uint64_t
+log_alloc_mask(uint32_t w)
+{
+	return log_on ? ((uint64_t *) log_freemap)[w] : ~0ULL;
+}
+
+// Start on a request: commit first if it might not fit.
+void
+log_begin(void)
+{
+	if (log_on && lh.lh_n + log_opmax > log_size)
+		log_commit();
+}
+
+// Commit the running transaction and install it.
+void
+log_commit(void)
+{
+	struct Loghdr *hdr = (struct Loghdr *) LOG_STAGEVA;
+	uint32_t i, j, n, b, start;
+
+	if (!log_on || lh.lh_n == 0)
+		return;
+	flush_blocks(1, super->s_nblocks - 1);
+
+	n = lh.lh_n;
+	for (i = 0; i < n; i++)
+		memmove((void *) LOG_STAGEVA + (1 + i) * PGSIZE,
+			diskaddr(lh.lh_block[i]), BLKSIZE);
+	log_io(1, n, 1);
+	*hdr = lh;
+	log_io(0, 1, 1);
+
+	// Install, blocks next to each other on disk together.  Once
+	// they're out of the transaction, flush_blocks will write them.
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && hdr->lh_block[j - 1] > hdr->lh_block[j]; j--) {
+			b = hdr->lh_block[j];
+			hdr->lh_block[j] = hdr->lh_block[j - 1];
+			hdr->lh_block[j - 1] = b;
+		}
+	lh.lh_n = 0;
+	for (i = 0; i < n; i = j) {
+		start = hdr->lh_block[i];
+		for (j = i + 1; j < n && hdr->lh_block[j] == start + (j - i); j++)
+			/* do nothing */;
+		flush_blocks(start, j - i);
+	}
+	hdr->lh_n = 0;
+	log_io(0, 1, 1);
+
+	memmove(log_freemap, bitmap, log_nbitblocks * BLKSIZE);
+}
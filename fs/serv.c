@@ -34,17 +34,25 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	off_t o_ra_pos;		// Where a sequential reader reads next
+	uint32_t o_ra_end;	// First file block past those read ahead
+	int o_ra_window;	// Blocks to read ahead; 0 while reads are random
 };
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
-#define FILEVA		0xD0000000
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
+// Read-ahead starts at RA_MIN blocks once reads look sequential and
+// doubles each time the reader closes in on the end of what's been
+// read ahead, up to RA_MAX.
+#define RA_MIN		4
+#define RA_MAX		64
+
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
@@ -53,6 +61,8 @@ serve_init(void)
 {
 	int i;
 	uintptr_t va = FILEVA;
+
+	static_assert(FILEVA + MAXOPEN * PGSIZE <= LOG_STAGEVA);
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
@@ -155,6 +165,9 @@ try_open:
 
 	// Save the file pointer
 	o->o_file = f;
+	o->o_ra_pos = 0;
+	o->o_ra_end = 0;
+	o->o_ra_window = 0;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
@@ -197,6 +210,35 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Note a read of n bytes of o at 'offset', and if o is being read
+// sequentially, read ahead of it: the blocks this read needs and then
+// o_ra_window more, whenever the reader gets within half a window of
+// the end of those read ahead last time.
+static void
+serve_readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t bn, last, start;
+
+	if (offset != o->o_ra_pos) {
+		o->o_ra_window = 0;
+		o->o_ra_end = 0;
+	} else if (o->o_ra_window == 0)
+		o->o_ra_window = RA_MIN;
+	n = MIN(n, o->o_file->f_size - offset);
+	o->o_ra_pos = offset + n;
+	if (o->o_ra_window == 0 || n == 0)
+		return;
+
+	bn = offset / BLKSIZE;
+	last = (offset + n - 1) / BLKSIZE;
+	if (last + o->o_ra_window / 2 < o->o_ra_end)
+		return;
+	start = MAX(bn, o->o_ra_end);
+	file_readahead(o->o_file, start, last + 1 + o->o_ra_window - start);
+	o->o_ra_end = last + 1 + o->o_ra_window;
+	o->o_ra_window = MIN(o->o_ra_window * 2, RA_MAX);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -228,6 +270,8 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if(req->req_n < PGSIZE) {
 		read_size = req->req_n;
 	}
+	if (o->o_fd->fd_offset < o->o_file->f_size)
+		serve_readahead(o, o->o_fd->fd_offset, read_size);
 	r = file_read(o->o_file, ret->ret_buf, read_size, o->o_fd->fd_offset);
 	if(r < 0)
 		return -E_INVAL;
@@ -259,13 +303,15 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 		write_size = req->req_n;
 	}
 	r = file_write(o->o_file, req->req_buf, write_size, o->o_fd->fd_offset);
+	if(r == -E_AGAIN)
+		return r;
 	if(r < 0)
 		return -E_INVAL;
 	if((o->o_fd->fd_offset + r) > o->o_file->f_size) {
 		o->o_file->f_size = o->o_fd->fd_offset + r;
+		log_write(o->o_file);
 	}
 	o->o_fd->fd_offset += r;
-	file_flush(o->o_file);
 	return r;
 }
 
@@ -328,6 +374,39 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	return file_remove(path);
 }
 
+// Lend the caller the block of req->req_fileid holding byte
+// req->req_offset: the page itself, from the block cache, read-only.
+// Returns the number of file bytes on it from req_offset on (0 at end
+// of file), or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return 0;
+	serve_readahead(o, req->req_offset, BLKSIZE - req->req_offset % BLKSIZE);
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	// Fault the block in; ipc can only pass a page we have mapped.
+	(void) *(volatile char *) blk;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return MIN(o->o_file->f_size - req->req_offset,
+		   BLKSIZE - req->req_offset % BLKSIZE);
+}
+
 // Sync the file system.
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -336,19 +415,29 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Report the block cache's counters.
+int
+serve_bcstats(envid_t envid, union Fsipc *ipc)
+{
+	bc_stats(&ipc->bcstatsRet);
+	return 0;
+}
+
 
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_REMOVE] =	(fshandler)serve_remove,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_BCSTATS] =	serve_bcstats
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
@@ -374,8 +463,11 @@ serve(void)
 		}
 
 		pg = NULL;
+		log_begin();
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
@@ -0,0 +1,29 @@
+#ifndef JOS_INC_DISK_H
+#define JOS_INC_DISK_H
+
+#include <inc/types.h>
+
+// Definitions shared by the kernel's disk drivers and the file system
+// server, which has transfers done by them: sys_disk_submit starts
+// one and returns a tag, sys_disk_reap waits for it.
+
+// Kinds of disk driver.  The fs env can also drive a DISK_IDE disk
+// itself by PIO; the others it can only reach through the kernel.
+enum {
+	DISK_NONE = 0,
+	DISK_IDE,		// PIIX bus master DMA (kern/ide.c)
+	DISK_AHCI,		// AHCI, with NCQ if the drive has it (kern/ahci.c)
+	DISK_VIRTIO,		// virtio-blk (kern/virtio_blk.c)
+};
+
+// Most sectors one transfer can move.  Transfers are of whole pages.
+#define DISK_MAXSECS	256
+
+// What sys_disk_info reports.
+struct diskinfo {
+	int di_type;		// DISK_*
+	int di_slots;		// Transfers that can be in flight at once
+	uint64_t di_nsecs;	// Size of the disk, 0 if not known
+};
+
+#endif	// !JOS_INC_DISK_H
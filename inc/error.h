@@ -33,6 +33,12 @@ enum {
 	E_VMX_ON = 19,    // Couldn't transition the cpu to VMX root mode
 	E_VMCS_INIT = 20, // Couldn't init the VMCS region
 	E_NO_ENT = 21,
+
+	// Network driver error codes
+	E_RX_EMPTY	= 22,	// Receive ring has no packet ready
+	E_TX_FULL	= 23,	// Transmit ring has no free descriptors
+	E_AGAIN		= 24,	// Operation would block
+	E_CONN		= 25,	// Connection refused or reset
 	MAXERROR
 };
 
@@ -21,14 +21,25 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Which of 'events' (POLLIN, POLLOUT) fd is ready for now, plus
+	// POLLHUP if the other end is gone.  Null means always ready.
+	int (*dev_poll)(struct Fd *fd, int events);
 };
 
 struct FdFile {
 	int id;
 };
 
+// With a sharded network server, a listening TCP socket has a replica
+// on every other shard (see listen() in lib/sockets.c).
+#define FDSOCK_MAXPEERS	7
+
 struct FdSock {
 	int sockid;
+	int npeers;
+	int peers[FDSOCK_MAXPEERS];	// The replicas' sockids
+	uint32_t namelen;
+	uint8_t name[16];		// Address given to bind(), for the replicas
 };
 
 struct Fd {
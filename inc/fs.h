@@ -26,19 +26,53 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// On a disk formatted with extents (FS_VERSION_EXTENTS), a File maps
+// its blocks with extents instead: stretches of blocks that follow each
+// other both in the file and on disk.  The first NEXTINLINE (8) are in
+// the File, the next NEXTPERBLK (341) in the block f_extind, and the
+// rest, NEXTPERBLK to a block, in the blocks that f_extdind, like an
+// indirect block, points to.
+struct Extent {
+	uint32_t e_fileblk;		// First block in the file
+	uint32_t e_start;		// First block on disk
+	uint32_t e_len;			// Number of blocks
+};
+
+#define NEXTINLINE	8
+#define NEXTPERBLK	(BLKSIZE / sizeof(struct Extent))
+
+// Files there are limited only by off_t.
+#define MAXEXTFILESIZE	(0x7FFFFFFF / BLKSIZE * BLKSIZE)
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
-
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	// Sizes below must add up to 256 bytes; must do arithmetic with
+	// fixed-size types in case we're compiling fsformat on a 64-bit
+	// machine.
+	union {
+		// Block pointers.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Or extents, in file order, with no holes between them.
+		struct {
+			uint32_t f_nextents;		// extents in use
+			uint32_t f_extind;		// block of extents
+			uint32_t f_extdind;		// block of blocks of them
+			struct Extent f_ext[NEXTINLINE];
+		};
+	};
+
+	// Directories only; 0 in anything else, and in directories
+	// written before they were kept.
+	uint32_t f_dirindex;		// hash index block (fs/dirindex.c)
+	uint32_t f_dirfree;		// no free entry comes before this one
+	uint8_t f_pad[4];
 } __attribute__((packed, aligned(32)));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -53,12 +87,23 @@ struct File {
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
 
+// On-disk format versions: the original block pointers, or extents.
+#define FS_VERSION_BLOCKS	0
+#define FS_VERSION_EXTENTS	1
+
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_logstart;		// First block of the journal
+	uint32_t s_nlog;		// and its size, 0 if there's none
+	uint32_t s_version;		// FS_VERSION_*; 0 on older disks
 };
 
+// Size of the journal fsformat reserves after the bitmap: a header
+// block, then room for the blocks of one transaction.
+#define FS_LOGBLOCKS	64
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
@@ -70,7 +115,12 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns the file's block at req_offset, read-only, as the
+	// reply page
+	FSREQ_MAP,
+	// Bcstats returns a Fsret_bcstats on the request page
+	FSREQ_BCSTATS
 };
 
 union Fsipc {
@@ -108,6 +158,22 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsret_bcstats {
+		uint64_t ret_hits;	// Block lookups that found it in memory
+		uint64_t ret_misses;	// Blocks read in from disk
+		uint64_t ret_evictions;
+		uint64_t ret_writebacks;	// Dirty blocks written out
+		uint64_t ret_readahead;	// Blocks read in ahead of use
+		uint64_t ret_io_cycles;	// Spent driving the disk (see fs/ide.c)
+		uint64_t ret_allocs;	// Blocks allocated
+		uint64_t ret_alloc_cycles;	// Spent finding them
+		uint32_t ret_resident;	// Evictable blocks in memory now
+		uint32_t ret_capacity;	// and the most there can be
+	} bcstatsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -22,6 +22,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/nic.h>
+#include <inc/disk.h>
 
 #define USED(x)		(void)(x)
 
@@ -62,8 +64,19 @@ int	sys_ipc_recv(void *rcv_pg);
 int sys_get_pte_permission(void *va);
 int sys_child_mmap(envid_t a1, envid_t a2);
 unsigned int sys_time_msec(void);
+int sys_sleep(unsigned int msec);
 int sys_send_packet(void* buffer, int length);
 int sys_receive_packet(void* buffer);
+int sys_send_packet_map(struct pkt_frag* frags, int nfrags, int flags);
+int sys_receive_packet_map(void* dstva);
+int sys_send_packets(struct pkt_batch* batch, int skip);
+int sys_receive_packets(struct pkt_batch* batch);
+int sys_net_attach(uint32_t queue, void* va, struct nic_rx_map* map);
+int sys_net_rx_doorbell(uint32_t queue, uint32_t tail);
+int sys_ncpu(void);
+int sys_disk_submit(int diskno, uint32_t secno, void *va, size_t nsecs, bool write);
+int sys_disk_reap(int tag);
+int sys_disk_info(struct diskinfo *info);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -88,6 +101,8 @@ envid_t	ipc_find_env(enum EnvType type);
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+int	prefork(int n);
+int	page_cow(void *va);
 
 // fd.c
 int	close(int fd);
@@ -99,17 +114,39 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	fcntl(int fd, int cmd, int arg);
+
+#define	F_GETFL		3	// fcntl: get file status flags
+#define	F_SETFL		4	// fcntl: set them (only O_NONBLOCK changes)
 
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_bcstats(struct Fsret_bcstats *st);
+int	fmap(int fd, off_t offset, void *dstva);
+ssize_t	sendfile(int outfd, int infd, off_t offset, size_t count);
 
 
 // pageref.c
 int	pageref(void *addr);
 
+// poll.c
+struct pollfd {
+	int fd;
+	short events;		// Which of these to wait for
+	short revents;		// Which happened
+};
+
+#define	POLLIN		0x01	// Can read (or accept) without blocking
+#define	POLLOUT		0x04	// Can write without blocking
+#define	POLLERR		0x08	// Error (revents only)
+#define	POLLHUP		0x10	// Peer gone (revents only)
+#define	POLLNVAL	0x20	// fd not open (revents only)
+
+int	poll(struct pollfd *fds, int nfds, int timeout);
+
 // sockets.c
 int     accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 int     bind(int s, struct sockaddr *name, socklen_t namelen);
@@ -117,6 +154,21 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+ssize_t sendto(int s, const void *buf, size_t len, int flags,
+	       const struct sockaddr *to, socklen_t tolen);
+ssize_t recvfrom(int s, void *buf, size_t len, int flags,
+		 struct sockaddr *from, socklen_t *fromlen);
+
+// One datagram of sendmmsg/recvmmsg.  For recvmmsg, msg_len is the
+// size of msg_buf going in and the datagram's length coming out.
+struct mmsg {
+	void *msg_buf;
+	size_t msg_len;
+	struct sockaddr_in msg_addr;
+};
+
+int     sendmmsg(int s, struct mmsg *msgs, int n, int flags);
+int     recvmmsg(int s, struct mmsg *msgs, int n, int flags);
 
 // nsipc.c
 int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
@@ -127,7 +179,18 @@ int     nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
+int     nsipc_sendto(int s, const void *buf, int size, unsigned int flags,
+		     const struct sockaddr *to, socklen_t tolen);
+int     nsipc_recvfrom(int s, void *mem, int len, unsigned int flags,
+		       struct sockaddr *from, socklen_t *fromlen);
+int     nsipc_sendmmsg(int s, struct mmsg *msgs, int n, unsigned int flags);
+int     nsipc_recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_socket_on(int shard, int domain, int type, int protocol);
+int     nsipc_try_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int     nsipc_nshards(void);
+int     nsipc_stats(int shard, struct Nsret_stats *st);
+int     nsipc_poll(int shard, struct Nspollfd *fds, int n, int timeout);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
@@ -156,5 +219,7 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#undef	O_NONBLOCK			/* lwIP's (via inc/ns.h) clashes with O_MKDIR */
+#define	O_NONBLOCK	0x1000		/* fail with -E_AGAIN, don't block (sockets) */
 
 #endif	// !JOS_INC_LIB_H
@@ -0,0 +1,180 @@
+#ifndef JOS_INC_NIC_H
+#define JOS_INC_NIC_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Definitions shared by the kernel e1000 driver and the user-level
+// network environments.
+
+// Maximum number of fragments in one zero-copy transmit.
+#define PKT_MAXFRAGS	8
+
+// One piece of an outgoing frame, in the sender's address space.
+// A frame is the concatenation of its fragments; the kernel points a
+// TX descriptor straight at each one instead of copying it.
+struct pkt_frag {
+	void *pf_va;
+	uint32_t pf_len;
+};
+
+// Per-frame offload flags.
+// On transmit they ask the card to fill in checksums the sender left
+// for it: the IP header checksum must be zero and the TCP/UDP checksum
+// must hold the pseudo-header sum (without the length for TSO).  TSO
+// also carries the segment size in the top 16 bits.
+#define PKT_TX_IPCSUM		0x0001	// Compute the IPv4 header checksum
+#define PKT_TX_L4CSUM		0x0002	// Compute the TCP or UDP checksum
+#define PKT_TX_TSO		0x0004	// Cut a large TCP frame into segments
+#define PKT_TX_MSS(mss)		((mss) << 16)
+#define PKT_FLAGS_MSS(f)	((uint32_t) (f) >> 16)
+// On receive they say which checksums the card has already verified.
+// Frames it found bad are dropped before they get this far.
+#define PKT_RX_IPCSUM_OK	0x0100
+#define PKT_RX_L4CSUM_OK	0x0200
+
+// A page of back-to-back frames, moved by the batched packet syscalls
+// and passed whole between the ns helper environments.  Each record
+// starts on a 4-byte boundary.
+struct pkt_rec {
+	int pr_len;
+	int pr_flags;		// PKT_TX_* or PKT_RX_*
+	char pr_data[0];
+};
+
+struct pkt_batch {
+	int pb_count;		// Number of records
+	int pb_used;		// Bytes of pb_data in use
+	char pb_data[0];
+};
+
+#define PKT_BATCH_DATASZ	(PGSIZE - sizeof(struct pkt_batch))
+#define PKT_REC_SIZE(len)	ROUNDUP(sizeof(struct pkt_rec) + (len), 4)
+
+// First and next record of a batch.
+#define PKT_BATCH_FIRST(b)	((struct pkt_rec *) (b)->pb_data)
+#define PKT_BATCH_NEXT(r)	((struct pkt_rec *) ((char *) (r) + PKT_REC_SIZE((r)->pr_len)))
+
+// Whether a frame of 'len' bytes still fits in batch 'b'.
+#define PKT_BATCH_FITS(b, len)	((b)->pb_used + PKT_REC_SIZE(len) <= PKT_BATCH_DATASZ)
+
+// The e1000 receive descriptor.  Besides the kernel driver, the network
+// server reads these directly once it owns the RX ring (sys_net_attach).
+struct rx_desc
+{
+	uint64_t addr;
+	uint16_t length;
+	uint16_t checksum;
+	uint8_t status;
+	uint8_t errors;
+	uint16_t special;
+};
+
+#define E1000_RXD_STAT_DD	0x01	// Descriptor Done
+#define E1000_RXD_STAT_IXSM	0x04	// Ignore checksum
+#define E1000_RXD_STAT_TCPCS	0x20	// TCP/UDP checksum calculated
+#define E1000_RXD_STAT_IPCS	0x40	// IP checksum calculated
+#define E1000_RXD_ERR_TCPE	0x20	// TCP/UDP checksum error
+#define E1000_RXD_ERR_IPE	0x40	// IP checksum error
+
+// The extended descriptor an 82574 writes back when it spreads frames
+// over several queues.  The kernel filled in only a buffer address.
+struct rx_desc_ext
+{
+	uint32_t mrq;		// RSS type and queue
+	uint32_t rss_hash;
+	uint32_t status_error;	// Status in the low byte, errors in the top one
+	uint16_t length;
+	uint16_t vlan;
+};
+
+// Read descriptor 'i' of a ring of either kind into 'rd', as if it were
+// a legacy one.  Only length, status and errors are filled in.
+static inline void
+nic_rx_desc_read(const volatile void *ring, bool ext, uint32_t i, struct rx_desc *rd)
+{
+	if (ext) {
+		const volatile struct rx_desc_ext *xd = (const volatile struct rx_desc_ext *) ring + i;
+		uint32_t se = xd->status_error;
+		rd->status = se & 0xff;
+		rd->errors = se >> 24;
+		rd->length = xd->length;
+	} else {
+		*rd = ((const volatile struct rx_desc *) ring)[i];
+	}
+}
+
+// The checksum verdict of a filled RX descriptor: the PKT_RX_* flags for
+// whatever the card verified, or -1 if it found a bad checksum.
+static inline int
+nic_rx_csum_flags(const volatile struct rx_desc *rd)
+{
+	int flags = 0;
+
+	if (rd->status & E1000_RXD_STAT_IXSM)
+		return 0;
+	if (rd->status & E1000_RXD_STAT_IPCS) {
+		if (rd->errors & E1000_RXD_ERR_IPE)
+			return -1;
+		flags |= PKT_RX_IPCSUM_OK;
+	}
+	if (rd->status & E1000_RXD_STAT_TCPCS) {
+		if (rd->errors & E1000_RXD_ERR_TCPE)
+			return -1;
+		flags |= PKT_RX_L4CSUM_OK;
+	}
+	return flags;
+}
+
+// An RX queue as sys_net_attach maps it, read-only, into the env that
+// takes it over.  Descriptor i's frame is at nm_bufs + i * nm_bufsize;
+// read descriptors with nic_rx_desc_read(nm_ring, nm_ext, i, ...).
+// Descriptors go back to the card with sys_net_rx_doorbell.
+struct nic_rx_map {
+	volatile void *nm_ring;
+	const char *nm_bufs;
+	uint32_t nm_count;	// Ring size
+	uint32_t nm_bufsize;	// Bytes per buffer
+	uint32_t nm_next;	// First descriptor the card will fill
+	uint32_t nm_queue;	// Which queue this is
+	uint32_t nm_nqueues;	// How many queues the card has
+	bool nm_ext;		// Extended descriptors (struct rx_desc_ext)
+};
+
+// Receive-side scaling.  With several queues, the card hashes each
+// TCP/IPv4 frame's (source address, destination address, source port,
+// destination port), in network byte order, with the Toeplitz function
+// under NIC_RSS_KEY, and the low 7 bits of the hash pick its queue.
+// Everything else goes to queue 0.
+#define NIC_RSS_KEYLEN		40
+#define NIC_RSS_KEY { \
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, \
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, \
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, \
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c, \
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa }
+#define NIC_RSS_QUEUE(hash, nq)	(((hash) & 0x7f) % (nq))
+
+// The Toeplitz hash of 'len' (at most NIC_RSS_KEYLEN - 4) bytes at 'in'.
+static inline uint32_t
+nic_rss_hash(const uint8_t *in, int len)
+{
+	static const uint8_t key[NIC_RSS_KEYLEN] = NIC_RSS_KEY;
+	uint32_t hash = 0;
+	uint32_t window = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+	int i, b;
+
+	for (i = 0; i < len; i++)
+		for (b = 7; b >= 0; b--) {
+			if (in[i] & (1 << b))
+				hash ^= window;
+			window = (window << 1) | ((key[i + 4] >> b) & 1);
+		}
+	return hash;
+}
+
+// IPC value the kernel sends the RX ring's owner (from envid 0) when
+// frames arrive while it is blocked in ipc_recv.
+#define NIC_RX_NOTIFY		0x7e1000
+
+#endif	// !JOS_INC_NIC_H
@@ -5,8 +5,18 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/nic.h>
 #include <lwip/sockets.h>
 
+// With a multi-queue NIC the network server runs as one shard per RX
+// queue, each with its own lwIP.  A client's socket ID carries the
+// shard that owns it in its top bits.
+#define NS_MAXSHARDS		8
+#define NS_SOCKID(shard, s)	(((shard) << 16) | (s))
+#define NS_SOCKID_SHARD(id)	((id) >> 16)
+#define NS_SOCKID_LOCAL(id)	((id) & 0xffff)
+
 struct jif_pkt {
 	int jp_len;
 	char jp_data[0];
@@ -26,6 +36,30 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Shards returns a Nsret_shards on the request page.
+	NSREQ_SHARDS,
+	// Stats returns a Nsret_stats on the request page.
+	NSREQ_STATS,
+	// Like recv, but a full page of data comes back as the reply's
+	// page, to be mapped over the (page-aligned) buffer.  Less than
+	// that comes back in the request page, as for recv.
+	NSREQ_RECV_PAGE,
+	// Poll returns the number of ready sockets, and their revents in
+	// the request page.
+	NSREQ_POLL,
+	// A page of data to send, lent as the IPC page itself.  This
+	// one goes as the IPC value NSREQ_SENDPAGE_BIT | s, since the page
+	// has no room for a request; see nsipc_send.  Returns PGSIZE.
+	NSREQ_SENDPAGE,
+	// Send with a destination address, for UDP.
+	NSREQ_SENDTO,
+	// Like recv, but returns a Nsret_recvfrom on the request page.
+	NSREQ_RECVFROM,
+	// Many datagrams at once, packed in the request page as a
+	// Nsreq_mmsg of struct Nsdgram records.  Both return the number
+	// of datagrams; recv fills the records in.
+	NSREQ_SENDMMSG,
+	NSREQ_RECVMMSG,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -33,13 +67,50 @@ enum {
 	// network server, to the output environment
 	NSREQ_OUTPUT,
 
+	// The batched versions of the two above pass a page containing a
+	// struct pkt_batch (see inc/nic.h)
+	NSREQ_INPUT_BATCH,
+	NSREQ_OUTPUT_BATCH,
+
 	// The following message passes no page
 	NSREQ_TIMER,
 };
 
+#define NSREQ_SENDPAGE_BIT	0x80000000
+
+// Most sockets one NSREQ_POLL can carry.
+#define NSPOLL_MAX	((PGSIZE - sizeof(struct Nsreq_poll)) / sizeof(struct Nspollfd))
+
+// One socket of an NSREQ_POLL; events are POLLIN, POLLOUT, ... (inc/lib.h).
+struct Nspollfd {
+	int s;
+	short events;
+	short revents;
+};
+
+// One datagram of an NSREQ_SENDMMSG or NSREQ_RECVMMSG: the peer, in
+// network byte order, and the data.
+struct Nsdgram {
+	uint32_t nd_addr;
+	uint16_t nd_port;
+	uint16_t nd_len;
+	char nd_data[0];
+};
+
+#define NSMMSG_DATASZ		(PGSIZE - sizeof(struct Nsreq_mmsg))
+#define NSDGRAM_SIZE(len)	ROUNDUP(sizeof(struct Nsdgram) + (len), 4)
+
+// First and next record of a Nsreq_mmsg.
+#define NSMMSG_FIRST(m)		((struct Nsdgram *) (m)->req_data)
+#define NSMMSG_NEXT(d)		((struct Nsdgram *) ((char *) (d) + NSDGRAM_SIZE((d)->nd_len)))
+
+// Whether a datagram of 'len' bytes still fits in Nsreq_mmsg 'm'.
+#define NSMMSG_FITS(m, len)	((m)->req_used + NSDGRAM_SIZE(len) <= NSMMSG_DATASZ)
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
+		int req_flags;	// MSG_DONTWAIT: fail with -E_AGAIN, don't block
 	} accept;
 
 	struct Nsret_accept {
@@ -90,14 +161,63 @@ union Nsipc {
 		char req_buf[0];
 	} send;
 
+	struct Nsreq_sendto {
+		int req_s;
+		int req_size;
+		unsigned int req_flags;
+		struct sockaddr req_to;
+		socklen_t req_tolen;
+		char req_buf[0];
+	} sendto;
+
+	struct Nsret_recvfrom {
+		struct sockaddr ret_from;
+		socklen_t ret_fromlen;
+		char ret_buf[0];
+	} recvfromRet;
+
+	// For recv, req_count is the most datagrams to return and
+	// req_maxlen the most bytes of each; longer ones are cut short.
+	struct Nsreq_mmsg {
+		int req_s;
+		unsigned int req_flags;
+		int req_count;
+		int req_maxlen;
+		int req_used;		// Bytes of req_data in use
+		char req_data[0];
+	} mmsg;
+
 	struct Nsreq_socket {
 		int req_domain;
 		int req_type;
 		int req_protocol;
 	} socket;
 
+	struct Nsret_shards {
+		envid_t ret_envids[NS_MAXSHARDS];
+	} shardsRet;
+
+	// Request page pool of one shard.  ret_waits counts the times
+	// the pool ran dry and the shard stopped taking requests until
+	// one finished; the rest got a page straight away.
+	struct Nsret_stats {
+		uint32_t ret_bufs;	// Pages in the pool
+		uint32_t ret_inuse;
+		uint32_t ret_hiwat;	// Most ever in use at once
+		uint64_t ret_allocs;	// Requests taken
+		uint64_t ret_waits;
+	} statsRet;
+
+	struct Nsreq_poll {
+		int req_n;
+		int req_timeout;	// ms; 0: don't wait, < 0: no limit
+		struct Nspollfd req_fds[0];
+	} poll;
+
 	struct jif_pkt pkt;
 
+	struct pkt_batch batch;
+
 	// Ensure Nsipc is one page
 	char _pad[PGSIZE];
 };
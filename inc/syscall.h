@@ -22,6 +22,17 @@ enum {
 	SYS_time_msec,
 	SYS_send_packet,
 	SYS_receive_packet,
+	SYS_receive_packet_map,
+	SYS_send_packet_map,
+	SYS_send_packets,
+	SYS_receive_packets,
+	SYS_net_attach,
+	SYS_net_rx_doorbell,
+	SYS_ncpu,
+	SYS_disk_submit,
+	SYS_disk_reap,
+	SYS_disk_info,
+	SYS_sleep,
 	NSYSCALLS
 };
 
@@ -0,0 +1,358 @@
+// AHCI driver for the file system server's disk: the first SATA disk
+// on the controller.  It sits behind sys_disk_* (see kern/disk.h) like
+// IDE DMA, but the fs env has no way to reach the disk other than
+// through it.  Every command slot can hold a transfer, so the fs env
+// can have as many in flight as the HBA has slots, and with a drive
+// that does native command queueing they are all queued at the drive
+// at once and done in whatever order suits it.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/ahci.h>
+#include <kern/disk.h>
+#include <kern/pcireg.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define SECTSIZE	512
+#define NSLOTS		32
+// Every page of a transfer gets a descriptor of its own.
+#define MAXPRDS		(DISK_MAXSECS * SECTSIZE / PGSIZE)
+
+struct ahci_cmdtbl {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t rsvd[48];
+	struct ahci_prd prdt[MAXPRDS];
+};
+
+uint8_t ahci_irq;
+
+static volatile uint8_t *abar;
+static int port;			// The disk's port
+static bool ncq;			// Queue commands at the drive
+
+static struct ahci_cmdhdr cmdlist[NSLOTS] __attribute__((aligned(1024)));
+static uint8_t rfis[256] __attribute__((aligned(256)));
+static struct ahci_cmdtbl cmdtbl[NSLOTS] __attribute__((aligned(128)));
+static uint16_t identify[256] __attribute__((aligned(PGSIZE)));
+
+static struct slot {
+	bool busy;		// Holds a transfer not yet reaped
+	bool done;		// which is over, with 'result'
+	int result;
+	envid_t owner;
+	envid_t waiter;		// Asleep in ahci_reap, or 0
+	int npages;
+	struct PageInfo *pages[MAXPRDS];	// Held until it's over
+} slots[NSLOTS];
+static uint32_t issued;		// Slots the HBA is working on
+
+static int ahci_submit(struct Env *e, int diskno, uint32_t secno, void *va,
+		       size_t nsecs, bool write);
+static int ahci_reap(struct Env *e, int tag);
+
+static struct disk_driver ahci_driver = {
+	{ DISK_AHCI, 1, 0 }, ahci_submit, ahci_reap
+};
+
+static uint32_t
+hba_read(uint32_t reg)
+{
+	return *(volatile uint32_t *) (abar + reg);
+}
+
+static void
+hba_write(uint32_t reg, uint32_t v)
+{
+	*(volatile uint32_t *) (abar + reg) = v;
+}
+
+static uint32_t
+port_read(uint32_t reg)
+{
+	return hba_read(AHCI_PORT(port) + reg);
+}
+
+static void
+port_write(uint32_t reg, uint32_t v)
+{
+	hba_write(AHCI_PORT(port) + reg, v);
+}
+
+// Stop the port's command engine, which also forgets every command it
+// had, and start it again.
+static void
+port_restart(void)
+{
+	port_write(AHCI_PxCMD, port_read(AHCI_PxCMD) & ~AHCI_CMD_ST);
+	while (port_read(AHCI_PxCMD) & AHCI_CMD_CR)
+		/* do nothing */;
+	port_write(AHCI_PxSERR, ~0);
+	port_write(AHCI_PxIS, ~0);
+	port_write(AHCI_PxCMD, port_read(AHCI_PxCMD) | AHCI_CMD_FRE);
+	while ((port_read(AHCI_PxTFD) & 0x88) != 0)	// BSY, DRQ
+		/* do nothing */;
+	port_write(AHCI_PxCMD, port_read(AHCI_PxCMD) | AHCI_CMD_ST);
+}
+
+// Fill in slot 'i' with an ATA command moving 'nsecs' sectors at 'lba'
+// between the disk and 'npa' pages at physical addresses 'pa'.
+static void
+slot_fill(int i, uint8_t command, uint64_t lba, size_t nsecs,
+	  physaddr_t *pa, int npa, bool write)
+{
+	struct ahci_cmdtbl *t = &cmdtbl[i];
+	struct fis_h2d *fis = (struct fis_h2d *) t->cfis;
+	int j;
+
+	memset(fis, 0, sizeof(*fis));
+	fis->type = FIS_TYPE_H2D;
+	fis->flags = FIS_H2D_CMD;
+	fis->command = command;
+	fis->device = 0x40;	// LBA
+	fis->lba0 = lba;
+	fis->lba1 = lba >> 8;
+	fis->lba2 = lba >> 16;
+	fis->lba3 = lba >> 24;
+	fis->lba4 = lba >> 32;
+	fis->lba5 = lba >> 40;
+	if (command == ATA_CMD_READ_FPDMA_QUEUED
+	    || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+		// The count goes in the features; the count field has the tag.
+		fis->featurel = nsecs;
+		fis->featureh = nsecs >> 8;
+		fis->countl = i << 3;
+	} else {
+		fis->countl = nsecs;
+		fis->counth = nsecs >> 8;
+	}
+
+	for (j = 0; j < npa; j++) {
+		t->prdt[j].dba = pa[j];
+		t->prdt[j].dbau = 0;
+		t->prdt[j].rsvd = 0;
+		t->prdt[j].dbc = (nsecs * SECTSIZE > PGSIZE * (j + 1)
+				  ? PGSIZE : nsecs * SECTSIZE - PGSIZE * j) - 1;
+	}
+
+	cmdlist[i].flags = (sizeof(*fis) / 4) | (write ? AHCI_HDR_W : 0);
+	cmdlist[i].prdtl = npa;
+	cmdlist[i].prdbc = 0;
+	cmdlist[i].ctba = PADDR(t);
+	cmdlist[i].ctbau = 0;
+}
+
+// Find out what the drive can do, by polling; interrupts are off.
+static int
+ahci_identify(void)
+{
+	physaddr_t pa = PADDR(identify);
+	int timeout;
+
+	slot_fill(0, ATA_CMD_IDENTIFY, 0, 1, &pa, 1, 0);
+	cmdtbl[0].prdt[0].dbc = sizeof(identify) - 1;
+	((struct fis_h2d *) cmdtbl[0].cfis)->device = 0;
+	port_write(AHCI_PxCI, 1);
+	for (timeout = 0; timeout < 10000000; timeout++)
+		if (!(port_read(AHCI_PxCI) & 1))
+			break;
+	port_write(AHCI_PxIS, ~0);
+	if ((port_read(AHCI_PxCI) & 1) || (port_read(AHCI_PxTFD) & 0x01))
+		return -E_UNSPECIFIED;
+	return 0;
+}
+
+int
+pci_ahci_attach(struct pci_func *pcif)
+{
+	uint32_t cap, pi;
+	int depth;
+
+	if (PCI_INTERFACE(pcif->dev_class) != 0x01)	// AHCI, not IDE-like
+		return 0;
+	pci_func_enable(pcif);
+	abar = mmio_map_region(pcif->reg_base[5], pcif->reg_size[5]);
+	hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_AE);
+	cap = hba_read(AHCI_CAP);
+	pi = hba_read(AHCI_PI);
+
+	for (port = 0; port < 32; port++)
+		if ((pi & (1u << port))
+		    && AHCI_SSTS_DET(port_read(AHCI_PxSSTS)) == AHCI_DET_PRESENT
+		    && port_read(AHCI_PxSIG) == AHCI_SIG_ATA)
+			break;
+	if (port == 32) {
+		cprintf("ahci: no disk\n");
+		return 0;
+	}
+
+	port_write(AHCI_PxCMD, port_read(AHCI_PxCMD) & ~(AHCI_CMD_ST | AHCI_CMD_FRE));
+	while (port_read(AHCI_PxCMD) & (AHCI_CMD_CR | AHCI_CMD_FR))
+		/* do nothing */;
+	port_write(AHCI_PxCLB, PADDR(cmdlist));
+	port_write(AHCI_PxCLBU, 0);
+	port_write(AHCI_PxFB, PADDR(rfis));
+	port_write(AHCI_PxFBU, 0);
+	port_write(AHCI_PxIE, 0);
+	port_restart();
+
+	if (ahci_identify() < 0) {
+		cprintf("ahci: IDENTIFY failed on port %d\n", port);
+		return 0;
+	}
+	// Words 100-103: sectors reachable with 48-bit commands.  Word 76
+	// bit 8: NCQ; word 75: queue depth - 1.
+	ahci_driver.info.di_nsecs = identify[100] | ((uint64_t) identify[101] << 16)
+		| ((uint64_t) identify[102] << 32) | ((uint64_t) identify[103] << 48);
+	ncq = (cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8));
+	depth = ncq ? (identify[75] & 0x1F) + 1 : NSLOTS;
+	ahci_driver.info.di_slots = MIN(MIN(AHCI_CAP_NCS(cap), NSLOTS), depth);
+
+	port_write(AHCI_PxIE, AHCI_IS_DHRS | AHCI_IS_SDBS | AHCI_IS_ERRORS);
+	hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_IE);
+	// No IOAPIC here; INTx goes through the 8259A, as for the e1000.
+	ahci_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << ahci_irq));
+
+	cprintf("ahci: disk on port %d, %llu sectors, %d slots%s\n", port,
+		(unsigned long long) ahci_driver.info.di_nsecs,
+		ahci_driver.info.di_slots, ncq ? ", NCQ" : "");
+	disk_register(&ahci_driver);
+	return 1;
+}
+
+static void
+slot_release(struct slot *s)
+{
+	int i;
+
+	for (i = 0; i < s->npages; i++)
+		page_decref(s->pages[i]);
+	s->npages = 0;
+}
+
+static void
+slot_done(struct slot *s, int result)
+{
+	struct Env *e;
+
+	slot_release(s);
+	s->result = result;
+	s->done = true;
+	if (s->waiter && envid2env(s->waiter, &e, 0) == 0
+	    && e->env_status == ENV_NOT_RUNNABLE)
+		e->env_status = ENV_RUNNABLE;
+	s->waiter = 0;
+}
+
+// Start a transfer in a free slot and return the slot as its tag.
+// 'diskno' means nothing here: there's one disk.  Errors are as for
+// ide_dma_submit.
+static int
+ahci_submit(struct Env *e, int diskno, uint32_t secno, void *va,
+	    size_t nsecs, bool write)
+{
+	physaddr_t pa[MAXPRDS];
+	struct slot *s = NULL;
+	struct Env *owner;
+	struct PageInfo *pp;
+	pte_t *pte;
+	uint8_t command;
+	int i, n, tag;
+
+	if (nsecs == 0 || nsecs > DISK_MAXSECS || nsecs % (PGSIZE / SECTSIZE)
+	    || (uintptr_t) va % PGSIZE || (uintptr_t) va + nsecs * SECTSIZE > UTOP)
+		return -E_INVAL;
+	// A finished transfer whose env is gone won't be reaped.
+	for (tag = 0; tag < ahci_driver.info.di_slots; tag++) {
+		s = &slots[tag];
+		if (!s->busy || (s->done && envid2env(s->owner, &owner, 0) < 0))
+			break;
+	}
+	if (tag == ahci_driver.info.di_slots)
+		return -E_AGAIN;
+
+	n = nsecs / (PGSIZE / SECTSIZE);
+	s->npages = 0;
+	for (i = 0; i < n; i++) {
+		pp = page_lookup(e->env_pml4e, va + i * PGSIZE, &pte);
+		if (!pp || !(*pte & PTE_U) || (!write && !(*pte & PTE_W))) {
+			slot_release(s);
+			return -E_FAULT;
+		}
+		pp->pp_ref++;
+		s->pages[s->npages++] = pp;
+		pa[i] = page2pa(pp);
+	}
+
+	if (ncq)
+		command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+	else
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	slot_fill(tag, command, secno, nsecs, pa, n, write);
+
+	s->busy = true;
+	s->done = false;
+	s->owner = e->env_id;
+	s->waiter = 0;
+	issued |= 1u << tag;
+	if (ncq)
+		port_write(AHCI_PxSACT, 1u << tag);
+	port_write(AHCI_PxCI, 1u << tag);
+	return tag;
+}
+
+static int
+ahci_reap(struct Env *e, int tag)
+{
+	struct slot *s;
+
+	if (tag < 0 || tag >= NSLOTS)
+		return -E_INVAL;
+	s = &slots[tag];
+	if (!s->busy || s->owner != e->env_id)
+		return -E_INVAL;
+	if (!s->done) {
+		s->waiter = e->env_id;
+		e->env_status = ENV_NOT_RUNNABLE;
+		return -E_AGAIN;
+	}
+	s->busy = false;
+	return s->result;
+}
+
+// Interrupt handler for ahci_irq, which the e1000 may share.  A slot
+// is done once the HBA has cleared its bit in both PxCI and PxSACT.
+// After an error the port has stopped; every transfer it had fails and
+// it's restarted.
+void
+ahci_intr(void)
+{
+	uint32_t is, pis, pending, done;
+	int i;
+
+	if (!abar || !((is = hba_read(AHCI_IS)) & (1u << port)))
+		return;
+	pis = port_read(AHCI_PxIS);
+	port_write(AHCI_PxIS, pis);
+	hba_write(AHCI_IS, is);
+
+	if (pis & AHCI_IS_ERRORS) {
+		for (i = 0; i < NSLOTS; i++)
+			if (issued & (1u << i))
+				slot_done(&slots[i], -E_UNSPECIFIED);
+		issued = 0;
+		port_restart();
+		return;
+	}
+	pending = port_read(AHCI_PxCI) | port_read(AHCI_PxSACT);
+	done = issued & ~pending;
+	for (i = 0; i < NSLOTS; i++)
+		if (done & (1u << i))
+			slot_done(&slots[i], 0);
+	issued &= pending;
+}
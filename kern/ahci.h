@@ -0,0 +1,96 @@
+#ifndef JOS_KERN_AHCI_H
+#define JOS_KERN_AHCI_H
+
+#include <inc/types.h>
+#include <kern/pci.h>
+
+/* HBA registers, from BAR 5 */
+#define AHCI_CAP	0x00	/* Capabilities */
+#define AHCI_CAP_NCS(c)	((((c) >> 8) & 0x1F) + 1)	/* Command slots */
+#define AHCI_CAP_SNCQ	(1u << 30)	/* Supports NCQ */
+#define AHCI_GHC	0x04	/* Global HBA control */
+#define AHCI_GHC_IE	(1u << 1)	/* Interrupt enable */
+#define AHCI_GHC_AE	(1u << 31)	/* AHCI enable */
+#define AHCI_IS		0x08	/* Interrupt status, a bit per port */
+#define AHCI_PI		0x0C	/* Ports implemented */
+
+/* Port registers, AHCI_PORT(n) + reg */
+#define AHCI_PORT(n)	(0x100 + (n) * 0x80)
+#define AHCI_PxCLB	0x00	/* Command list base */
+#define AHCI_PxCLBU	0x04
+#define AHCI_PxFB	0x08	/* Received FIS base */
+#define AHCI_PxFBU	0x0C
+#define AHCI_PxIS	0x10	/* Interrupt status */
+#define AHCI_PxIE	0x14	/* Interrupt enable */
+#define AHCI_PxCMD	0x18
+#define AHCI_PxTFD	0x20	/* Task file data: ATA status in bits 7:0 */
+#define AHCI_PxSIG	0x24	/* Signature of the attached device */
+#define AHCI_PxSSTS	0x28	/* SATA status */
+#define AHCI_PxSERR	0x30	/* SATA error */
+#define AHCI_PxSACT	0x34	/* Queued commands outstanding */
+#define AHCI_PxCI	0x38	/* Commands issued */
+
+#define AHCI_CMD_ST	(1u << 0)	/* Start processing the command list */
+#define AHCI_CMD_FRE	(1u << 4)	/* FIS receive enable */
+#define AHCI_CMD_FR	(1u << 14)	/* FIS receive running */
+#define AHCI_CMD_CR	(1u << 15)	/* Command list running */
+
+#define AHCI_IS_DHRS	(1u << 0)	/* Device to host register FIS */
+#define AHCI_IS_PSS	(1u << 1)	/* PIO setup FIS */
+#define AHCI_IS_SDBS	(1u << 3)	/* Set device bits FIS: NCQ done */
+#define AHCI_IS_TFES	(1u << 30)	/* Task file error */
+#define AHCI_IS_ERRORS	0x78000000	/* TFES, HBFS, HBDS, IFS: the port stops */
+
+#define AHCI_SSTS_DET(s)	((s) & 0xF)
+#define AHCI_DET_PRESENT	3	/* Device there, link up */
+#define AHCI_SIG_ATA	0x00000101
+
+#define ATA_CMD_READ_DMA_EXT		0x25
+#define ATA_CMD_WRITE_DMA_EXT		0x35
+#define ATA_CMD_READ_FPDMA_QUEUED	0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED	0x61
+#define ATA_CMD_IDENTIFY		0xEC
+
+/* One entry of the command list */
+struct ahci_cmdhdr {
+	uint16_t flags;		/* CFL in 4:0, W (write) in 6 */
+	uint16_t prdtl;		/* PRDT entries */
+	uint32_t prdbc;		/* Bytes transferred */
+	uint32_t ctba;		/* Command table, 128-byte aligned */
+	uint32_t ctbau;
+	uint32_t rsvd[4];
+};
+
+#define AHCI_HDR_CFL(dw)	((dw) & 0x1F)
+#define AHCI_HDR_W		(1u << 6)
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t rsvd;
+	uint32_t dbc;		/* Byte count - 1; bit 31: interrupt */
+};
+
+/* Host to device register FIS, which carries an ATA command */
+struct fis_h2d {
+	uint8_t type;		/* FIS_TYPE_H2D */
+	uint8_t flags;		/* FIS_H2D_CMD */
+	uint8_t command;
+	uint8_t featurel;
+	uint8_t lba0, lba1, lba2;
+	uint8_t device;
+	uint8_t lba3, lba4, lba5;
+	uint8_t featureh;
+	uint8_t countl, counth;
+	uint8_t icc, control;
+	uint8_t rsvd[4];
+};
+
+#define FIS_TYPE_H2D	0x27
+#define FIS_H2D_CMD	0x80	/* This FIS updates the command register */
+
+int	pci_ahci_attach(struct pci_func *pcif);
+void	ahci_intr(void);
+extern uint8_t ahci_irq;
+
+#endif	// !JOS_KERN_AHCI_H
@@ -0,0 +1,22 @@
+#ifndef JOS_KERN_DISK_H
+#define JOS_KERN_DISK_H
+
+#include <inc/disk.h>
+#include <kern/env.h>
+
+// A driver sys_disk_* can hand transfers to.
+struct disk_driver {
+	struct diskinfo info;
+	// Start moving 'nsecs' sectors between 'secno' and e's whole pages
+	// at 'va', into them unless 'write'.  Returns a tag, or < 0.
+	int (*submit)(struct Env *e, int diskno, uint32_t secno, void *va,
+		      size_t nsecs, bool write);
+	// The result of e's transfer 'tag', or -E_AGAIN with e put to
+	// sleep until it's over.
+	int (*reap)(struct Env *e, int tag);
+};
+
+void	disk_register(struct disk_driver *d);
+extern struct disk_driver *disk_driver;
+
+#endif	// !JOS_KERN_DISK_H
@@ -5,51 +5,479 @@
 #include <kern/pmap.h>
 #include <inc/memlayout.h>
 #include <kern/sched.h>
+#include <kern/env.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+
+// IRQ line the card is wired to; filled in by pci_e1000_attach.
+uint8_t e1000_irq;
+// Environments asleep in sys_receive_packet* until the next RX
+// interrupt, which wakes them all; 0 in a free entry.
+#define RX_MAXWAITERS 32
+static envid_t rx_waiters[RX_MAXWAITERS];
+
+// Ring sizes, fixed by e1000_tx_init/e1000_rx_init at boot, and how
+// many TX/RX queue pairs are in use: one on an 82540, two on an 82574.
+uint32_t e1000_ntx = E1000_TXRING;
+uint32_t e1000_nrx = E1000_RXRING;
+int e1000_nqueues = 1;
+
+// How one frame is offloaded: the context it needs (queued only if it
+// differs from the queue's last one) and the bits each of its data
+// descriptors carry.  dcmd == 0 means no offload, i.e. plain legacy
+// descriptors.
+struct tx_offload {
+    struct tx_ctx_desc ctx;
+    bool need_ctx;
+    uint8_t dcmd;
+    uint8_t popts;
+};
+
+// One TX queue.  Rings and buffers are reached through the kernel's
+// direct map of physical memory.
+struct e1000_txq {
+    volatile struct tx_desc* ring;
+    physaddr_t bufs;
+    int tdt;                    // This queue's TDT register
+    // Oldest descriptor not yet reclaimed.  Everything from here up to
+    // TDT has been handed to the card; everything else is ours to fill.
+    uint32_t clean;
+    // User pages pinned by zero-copy transmits, per slot.  A page stays
+    // pinned until the hardware has set DD on its descriptor.
+    struct PageInfo* pinned[E1000_MAX_DESC];
+    // The context descriptor last queued.  The card applies it to every
+    // extended data descriptor on this queue until it sees another, so
+    // frames with the same header layout need only one.
+    struct tx_ctx_desc ctx;
+    bool ctx_valid;
+};
+
+// One RX queue.  With extended descriptors the card overwrites the
+// buffer address on writeback, so every used descriptor is rewritten
+// in full before it goes back (rx_rearm).
+struct e1000_rxq {
+    volatile struct rx_desc* ring;
+    physaddr_t ring_pa, bufs_pa;
+    int rdt;                    // This queue's RDT register
+    bool ext;
+    // Environment that has taken this queue over (see e1000_rx_attach),
+    // and whether frames arrived while it wasn't waiting for them.
+    envid_t owner;
+    bool owner_pending;
+};
+
+static struct e1000_txq txqs[E1000_MAX_QUEUES];
+static struct e1000_rxq rxqs[E1000_MAX_QUEUES];
+
+#define ETH_HLEN        14
+#define IP_HLEN_MIN     20
+#define TCP_HLEN_MIN    20
+#define IPPROTO_TCP     6
+#define IPPROTO_UDP     17
+
+#define E1000_REG(r) (*(volatile int*)((int64_t)e1000_viraddr + (r)))
+
+static uint32_t ring_size(uint32_t n) {
+    n = MAX(n, E1000_MIN_DESC);
+    n = MIN(n, E1000_MAX_DESC);
+    return ROUNDDOWN(n, E1000_MIN_DESC);
+}
+
+// Physically contiguous, zeroed memory for the card that is never freed.
+static physaddr_t dma_alloc(size_t size) {
+    int i, n = ROUNDUP(size, PGSIZE) / PGSIZE;
+    struct PageInfo* pp = page_alloc_npages(ALLOC_ZERO, n);
+    if(pp == NULL)
+        panic("e1000: no %d contiguous pages for DMA", n);
+    for(i = 0; i < n; i++)
+        pp[i].pp_ref = 1;
+    return page2pa(pp);
+}
+
+// Set up TX queue 'q' and its packed buffers; returns the ring's
+// physical address for its TDBAL.
+physaddr_t e1000_tx_init(int q) {
+    struct e1000_txq* tq = &txqs[q];
+    e1000_ntx = ring_size(e1000_ntx);
+    physaddr_t ring = dma_alloc(e1000_ntx * TD_SIZE);
+    tq->ring = (volatile struct tx_desc*)KADDR(ring);
+    tq->bufs = dma_alloc(e1000_ntx * E1000_TXBUF_SIZE);
+    tq->tdt = E1000_QREG(E1000_TDT, q);
+    tq->clean = 0;
+    return ring;
+}
+
+// Point RX descriptor 'i' of 'rq' back at its buffer and clear its
+// status, ready for the card to fill again.
+static void rx_rearm(struct e1000_rxq* rq, uint32_t i) {
+    if(rq->ext) {
+        volatile uint64_t* d = (volatile uint64_t*)&rq->ring[i];
+        d[0] = rq->bufs_pa + i * E1000_RXBUF_SIZE;
+        d[1] = 0;
+    } else {
+        rq->ring[i].status = 0;
+    }
+}
+
+// Set up RX queue 'q' and point every descriptor at a buffer; returns
+// the ring's physical address for its RDBAL.  'ext' says the card will
+// use extended descriptors, which only work with packed buffers.
+physaddr_t e1000_rx_init(int q, bool ext) {
+    struct e1000_rxq* rq = &rxqs[q];
+    uint32_t i;
+    e1000_nrx = ring_size(e1000_nrx);
+    physaddr_t ring = dma_alloc(e1000_nrx * RD_SIZE);
+    rq->ring = (volatile struct rx_desc*)KADDR(ring);
+    rq->ring_pa = ring;
+    rq->rdt = E1000_QREG(E1000_RDT, q);
+    rq->ext = ext;
+    if(E1000_RX_PAGESLOTS) {
+        assert(!ext);
+        for(i = 0; i < e1000_nrx; i++) {
+            struct PageInfo* pp = page_alloc(ALLOC_ZERO);
+            if(pp == NULL)
+                panic("e1000: out of memory for RX buffers");
+            pp->pp_ref = 1;    // the ring's reference
+            rq->ring[i].addr = page2pa(pp) + E1000_RXBUF_OFFSET;
+        }
+    } else {
+        rq->bufs_pa = dma_alloc(e1000_nrx * E1000_RXBUF_SIZE);
+        for(i = 0; i < e1000_nrx; i++)
+            rq->ring[i].addr = rq->bufs_pa + i * E1000_RXBUF_SIZE;
+    }
+    if(q == e1000_nqueues - 1)
+        cprintf("e1000: %d queue(s) of %d TX / %d RX descriptors\n",
+                e1000_nqueues, e1000_ntx, e1000_nrx);
+    return ring;
+}
+
+// Whether a live env has taken over RX queue 'q'.  The receive syscalls
+// are off limits for queue 0 while one has.
+static bool rx_owned(int q) {
+    struct Env* e;
+    return rxqs[q].owner != 0 && envid2env(rxqs[q].owner, &e, 0) == 0;
+}
+
+// Spread TCP flows over the longest run of RX queues from 0 that all
+// have an owner, so none lands on a queue nobody reads.  With no owner
+// at all, everything stays on queue 0.
+static void rss_update(void) {
+    int i, n = 0;
+    uint32_t reta = 0;
+
+    if(e1000_nqueues < 2)
+        return;
+    while(n < e1000_nqueues && rx_owned(n))
+        n++;
+    n = MAX(n, 1);
+    // 128 one-byte entries, four to a register; entry (hash & 0x7f) picks
+    // the queue, hence NIC_RSS_QUEUE.
+    for(i = 0; i < 128; i++) {
+        if(NIC_RSS_QUEUE(i, n) == 1)
+            reta |= E1000_RETA_QUEUE1 << (8 * (i % 4));
+        if(i % 4 == 3) {
+            E1000_REG(E1000_RETA + i / 4 * 4) = reta;
+            reta = 0;
+        }
+    }
+}
+
+// The TX queue 'e' sends on: the one paired with the RX queue it owns,
+// so each network stack instance has a queue of its own.
+static struct e1000_txq* tx_queue(struct Env* e) {
+    int q;
+    for(q = 1; q < e1000_nqueues; q++)
+        if(rxqs[q].owner == e->env_id)
+            return &txqs[q];
+    return &txqs[0];
+}
+
+// Reclaim every descriptor the card has finished with, in one pass over
+// the DD bits from tq->clean, dropping any page a zero-copy send pinned.
+// Returns how many descriptors may be filled now.  One always stays
+// empty, because TDT == TDH means an empty ring to the card, not a full one.
+static int tx_reclaim(struct e1000_txq* tq) {
+    uint32_t tail = E1000_REG(tq->tdt);
+    while(tq->clean != tail && (tq->ring[tq->clean].status & E1000_TXD_STAT_DD)) {
+        if(tq->pinned[tq->clean]) {
+            page_decref(tq->pinned[tq->clean]);
+            tq->pinned[tq->clean] = NULL;
+        }
+        tq->clean = (tq->clean + 1) % e1000_ntx;
+    }
+    return e1000_ntx - 1 - (tail - tq->clean + e1000_ntx) % e1000_ntx;
+}
+
+// Work out the offloads 'flags' asks for on a 'len'-byte frame whose
+// first 'hlen' bytes, at 'hdr', hold at least its headers.  The card
+// only needs offsets, which we read from the headers ourselves rather
+// than trust the caller for.
+// Returns -E_INVAL if the frame isn't IPv4, or TCP/UDP for PKT_TX_L4CSUM,
+// or TCP for PKT_TX_TSO.
+static int tx_offload_setup(struct e1000_txq* tq, const uint8_t* hdr, uint32_t hlen,
+                            uint32_t len, int flags, struct tx_offload* o) {
+    uint32_t l4off, hdrlen, paylen = 0;
+    uint8_t proto, tucmd;
+
+    memset(o, 0, sizeof(*o));
+    if(!(flags & (PKT_TX_IPCSUM | PKT_TX_L4CSUM | PKT_TX_TSO)))
+        return 0;
+    if(hlen < ETH_HLEN + IP_HLEN_MIN || hdr[12] != 0x08 || hdr[13] != 0x00)
+        return -E_INVAL;
+    l4off = ETH_HLEN + (hdr[ETH_HLEN] & 0xf) * 4;
+    proto = hdr[ETH_HLEN + 9];
+    if(l4off < ETH_HLEN + IP_HLEN_MIN || l4off > hlen)
+        return -E_INVAL;
+
+    o->ctx.ipcss = ETH_HLEN;
+    o->ctx.ipcso = ETH_HLEN + 10;
+    o->ctx.ipcse = l4off - 1;
+    tucmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_TUCMD_IP;
+    if(flags & PKT_TX_IPCSUM)
+        o->popts |= E1000_TXD_POPTS_IXSM;
+
+    if(flags & (PKT_TX_L4CSUM | PKT_TX_TSO)) {
+        if(proto == IPPROTO_TCP) {
+            o->ctx.tucso = l4off + 16;
+            tucmd |= E1000_TXD_TUCMD_TCP;
+        } else if(proto == IPPROTO_UDP && !(flags & PKT_TX_TSO)) {
+            o->ctx.tucso = l4off + 6;
+        } else {
+            return -E_INVAL;
+        }
+        if(o->ctx.tucso + 2 > hlen)
+            return -E_INVAL;
+        o->ctx.tucss = l4off;
+        o->ctx.tucse = 0;
+        o->popts |= E1000_TXD_POPTS_TXSM;
+    }
+
+    if(flags & PKT_TX_TSO) {
+        // Every segment gets fresh IP and TCP checksums.
+        if(l4off + 13 > hlen)
+            return -E_INVAL;
+        hdrlen = l4off + (hdr[l4off + 12] >> 4) * 4;
+        if(hdrlen < l4off + TCP_HLEN_MIN || hdrlen > hlen || hdrlen > 0xff
+           || len <= hdrlen || PKT_FLAGS_MSS(flags) == 0)
+            return -E_INVAL;
+        paylen = len - hdrlen;
+        o->ctx.hdrlen = hdrlen;
+        o->ctx.mss = PKT_FLAGS_MSS(flags);
+        tucmd |= E1000_TXD_CMD_TSE;
+        o->dcmd |= E1000_TXD_CMD_TSE;
+        o->popts |= E1000_TXD_POPTS_IXSM | E1000_TXD_POPTS_TXSM;
+    }
+
+    o->ctx.cmd_len = paylen | (E1000_TXD_DTYP_C << 20) | ((uint32_t)tucmd << 24);
+    o->dcmd |= E1000_TXD_CMD_DEXT;
+    // A TSO context carries this frame's payload length, so never reuse one.
+    o->need_ctx = (flags & PKT_TX_TSO) || !tq->ctx_valid
+        || memcmp(&o->ctx, &tq->ctx, sizeof(tq->ctx)) != 0;
+    return 0;
+}
+
+// Queue o's context descriptor at 'slot' if the frame needs a new one.
+// Returns the next free slot.
+static int tx_put_ctx(struct e1000_txq* tq, int slot, const struct tx_offload* o) {
+    if(!o->need_ctx)
+        return slot;
+    *(volatile struct tx_ctx_desc*)&tq->ring[slot] = o->ctx;
+    tq->ctx = o->ctx;
+    tq->ctx_valid = true;
+    return (slot + 1) % e1000_ntx;
+}
+
+// Point TX slot 'slot' at 'length' bytes at physical address 'addr',
+// with a legacy descriptor or, if 'o' asks for offloads, an extended one.
+static void tx_put_data(struct e1000_txq* tq, int slot, physaddr_t addr,
+                        uint32_t length, bool eop, const struct tx_offload* o) {
+    if(o == NULL || o->dcmd == 0) {
+        struct tx_desc td;
+        memset(&td, 0, sizeof(td));
+        td.addr = addr;
+        td.length = length;
+        td.cmd = E1000_TXD_CMD_RS | (eop ? E1000_TXD_CMD_EOP : 0);
+        tq->ring[slot] = td;
+    } else {
+        struct tx_data_desc dd;
+        memset(&dd, 0, sizeof(dd));
+        dd.addr = addr;
+        dd.length = length;
+        dd.dtyp = E1000_TXD_DTYP_D << 4;
+        dd.dcmd = o->dcmd | E1000_TXD_CMD_RS | (eop ? E1000_TXD_CMD_EOP : 0);
+        dd.popts = o->popts;
+        *(volatile struct tx_data_desc*)&tq->ring[slot] = dd;
+    }
+}
+
+// Fill TX slot 'slot' with a copy of a 'length'-byte frame.
+static void tx_fill_copy(struct e1000_txq* tq, int slot, const void* buffer,
+                         int length, const struct tx_offload* o) {
+    physaddr_t addr = tq->bufs + slot * E1000_TXBUF_SIZE;
+    memmove(KADDR(addr), buffer, length);
+    tx_put_data(tq, slot, addr, length, true, o);
+}
 
 // LAB 6: Your driver code here
+// Returns 0 on success, -E_INVAL for a bad length, or -E_TX_FULL if every
+// descriptor is still in flight; the caller should back off and retry.
 int transmit_packet(void* buffer, int length) {
-    int tail = *(volatile int*)((int64_t)e1000_viraddr + E1000_TDT);
-
-    volatile struct tx_desc* tdbase = ((volatile struct tx_desc*)(E1000_TDBASE_TRANSMIT));
-    struct tx_desc td = tdbase[tail];
-
-    while(true){
-        if(td.cmd & (1 << 3)) {
-            if(td.status & (1 << 0)) {
-                td.status &= (~(1 << 0));
-                td.addr = ring_buffers[tail];
-                td.length = length;
-                memmove((void*)(E1000_PACKET + tail * PGSIZE), buffer, length);
-                break;
-            } else {
-                sched_yield();
-                continue;
-            } 
-        } else {
-            td.cmd |= (1 << 3) | (1 << 0); // set RS bit
-            td.status &= (~(1 << 0));
-            td.addr = ring_buffers[tail];
-            td.length = length;
-            memmove((void*)(E1000_PACKET + tail * PGSIZE), buffer, length);
+    struct e1000_txq* tq = tx_queue(curenv);
+    int tail = E1000_REG(tq->tdt);
+
+    if(length <= 0 || length > E1000_TXBUF_SIZE)
+        return -E_INVAL;
+    if(tx_reclaim(tq) == 0)
+        return -E_TX_FULL;
+
+    tx_fill_copy(tq, tail, buffer, length, NULL);
+    E1000_REG(tq->tdt) = (tail + 1) % e1000_ntx;
+    return 0;
+}
+
+// Queue as many frames from batch 'b' as the ring has room for, starting
+// with record 'skip', and bump TDT once for the lot.  Each record's
+// pr_flags may ask for checksum offload or TSO.
+// Returns the number of frames queued (0 if the ring is full), or
+// -E_INVAL if a record is malformed.
+int transmit_packets(struct pkt_batch* b, int skip) {
+    struct e1000_txq* tq = tx_queue(curenv);
+    int tail = E1000_REG(tq->tdt);
+    char* rec = b->pb_data;
+    // The header and each record are read once: the env could change
+    // them between our checks and our use.
+    int count = b->pb_count;
+    char* end = b->pb_data + MIN((size_t)b->pb_used, PKT_BATCH_DATASZ);
+    int i, sent = 0, used = 0, room = tx_reclaim(tq);
+    struct pkt_rec r;
+    struct tx_offload o;
+
+    if(count < 0 || skip < 0)
+        return -E_INVAL;
+    for(i = 0; i < count; i++, rec += PKT_REC_SIZE(r.pr_len)) {
+        if(rec + sizeof(r) > end)
+            goto bad;
+        memmove(&r, rec, sizeof(r));
+        if(r.pr_len <= 0 || r.pr_len > E1000_TXBUF_SIZE
+           || r.pr_len > end - rec - (int)sizeof(r))
+            goto bad;
+        if(i < skip)
+            continue;
+        if(tx_offload_setup(tq, (uint8_t*)rec + sizeof(r), r.pr_len, r.pr_len,
+                            r.pr_flags, &o) < 0)
+            goto bad;
+        if(used + 1 + o.need_ctx > room)
             break;
+        tail = tx_put_ctx(tq, tail, &o);
+        tx_fill_copy(tq, tail, rec + sizeof(r), r.pr_len, &o);
+        tail = (tail + 1) % e1000_ntx;
+        used += 1 + o.need_ctx;
+        sent++;
+    }
+    if(sent)
+        E1000_REG(tq->tdt) = tail;
+    return sent;
+
+bad:
+    // Whatever we filled in past TDT is dropped, including any context.
+    tq->ctx_valid = false;
+    return -E_INVAL;
+}
+
+// Zero-copy transmit of one frame made of 'nfrags' fragments living in
+// e's address space.  Each fragment gets its own descriptor (two if it
+// straddles a page boundary) pointing at the physical page, and only the
+// last one carries EOP.  The pages are pinned with a reference until
+// tx_reclaim sees the hardware is done with them, so the env may unmap
+// them right away; it must not modify them while the frame is in flight.
+// 'flags' may ask for checksum offload or TSO; the headers they need
+// must all be in the first fragment.
+//
+// 'frags' must be a kernel copy: it is read more than once.
+//
+// Returns 0 on success, -E_INVAL for bad fragments, or -E_TX_FULL if the
+// ring can't take the whole frame right now (nothing is queued then).
+int transmit_packet_map(struct Env* e, const struct pkt_frag* frags, int nfrags, int flags) {
+    struct e1000_txq* tq = tx_queue(e);
+    int tail = E1000_REG(tq->tdt);
+    int i, ndesc = 0, npages = 0, slot;
+    uint32_t len = 0;
+    struct tx_offload o;
+    // Each page piece of the frame, pinned before anything is queued.
+    struct PageInfo* pages[2 * PKT_MAXFRAGS];
+
+    if(nfrags <= 0 || nfrags > PKT_MAXFRAGS)
+        return -E_INVAL;
+    for(i = 0; i < nfrags; i++) {
+        uintptr_t va = (uintptr_t)frags[i].pf_va;
+        if(frags[i].pf_len == 0 || frags[i].pf_len > PGSIZE)
+            return -E_INVAL;
+        if(user_mem_check(e, (void*)va, frags[i].pf_len, PTE_U|PTE_P) < 0)
+            return -E_INVAL;
+        ndesc += (ROUNDDOWN(va, PGSIZE) == ROUNDDOWN(va + frags[i].pf_len - 1, PGSIZE)) ? 1 : 2;
+        len += frags[i].pf_len;
+    }
+    if(tx_offload_setup(tq, frags[0].pf_va, frags[0].pf_len, len, flags, &o) < 0)
+        return -E_INVAL;
+    ndesc += o.need_ctx;
+    if(ndesc >= e1000_ntx)
+        return -E_INVAL;
+    if(ndesc > tx_reclaim(tq))
+        return -E_TX_FULL;
+
+    for(i = 0; i < nfrags; i++) {
+        uintptr_t va = (uintptr_t)frags[i].pf_va;
+        uint32_t left = frags[i].pf_len;
+        while(left > 0) {
+            uint32_t n = MIN(left, PGSIZE - PGOFF(va));
+            pte_t* pte;
+            struct PageInfo* pp = page_lookup(e->env_pml4e, (void*)ROUNDDOWN(va, PGSIZE), &pte);
+
+            if(pp == NULL || !(*pte & PTE_U)) {
+                while(npages > 0)
+                    page_decref(pages[--npages]);
+                return -E_INVAL;
+            }
+            pp->pp_ref++;
+            pages[npages++] = pp;
+            left -= n;
+            va += n;
         }
     }
 
-    tdbase[tail] = td;
-    if((tail + 1) == TD_MAX)
-        *(volatile int*)((int64_t)e1000_viraddr + E1000_TDT) = 0;
-    else
-        *(volatile int*)((int64_t)e1000_viraddr + E1000_TDT) = tail + 1;
+    slot = tx_put_ctx(tq, tail, &o);
+    npages = 0;
+    for(i = 0; i < nfrags; i++) {
+        uintptr_t va = (uintptr_t)frags[i].pf_va;
+        uint32_t left = frags[i].pf_len;
+        while(left > 0) {
+            uint32_t n = MIN(left, PGSIZE - PGOFF(va));
+            struct PageInfo* pp = pages[npages++];
 
+            tq->pinned[slot] = pp;
+            left -= n;
+            tx_put_data(tq, slot, page2pa(pp) + PGOFF(va), n,
+                        i == nfrags - 1 && left == 0, &o);
+            va += n;
+            slot = (slot + 1) % e1000_ntx;
+        }
+    }
+    E1000_REG(tq->tdt) = slot;
     return 0;
 }
 
+// The receive syscalls below all work on queue 0, which is the only one
+// the card fills until some env takes a queue over.
+
 int receive_packet(void* buffer) {
-    int tail = *(volatile int*)((int64_t)e1000_viraddr + E1000_RDT);
-    int curr = (tail + 1) % RD_MAX;
+    struct e1000_rxq* rq = &rxqs[0];
+    int tail = E1000_REG(rq->rdt);
+    int curr = (tail + 1) % e1000_nrx;
+    if(rx_owned(0))
+        return -E_NOT_SUPP;
     // cprintf("tail is %llx\n", tail);
-    volatile struct rx_desc* rdbase = ((volatile struct rx_desc*)(E1000_TDBASE_RECEIVE));
-    struct rx_desc rd = rdbase[curr];
+    struct rx_desc rd;
+    nic_rx_desc_read(rq->ring, rq->ext, curr, &rd);
 
     // if the memory is owned by hardware, software should not access it
     // which is why I GOT F U C K I N G   P A G E F A U L T S
@@ -65,22 +493,260 @@ int receive_packet(void* buffer) {
     // cprintf("\n");
     
     if((rd.status & (1 << 0)) ) {
-        memcpy(buffer, (void*)(E1000_PACKET_RECEIVE + curr * PGSIZE), rd.length);
-        memset((void*)(E1000_PACKET_RECEIVE + curr * PGSIZE), 0, PGSIZE);
-        rd.status &= (~(1 << 0));
+        physaddr_t addr = rq->ext ? rq->bufs_pa + curr * E1000_RXBUF_SIZE : rq->ring[curr].addr;
+        memcpy(buffer, KADDR(addr), rd.length);
     } else {
-        return -99;
+        return -E_RX_EMPTY;
     } 
     
 
-    rdbase[curr] = rd;
-    if((tail + 1) == RD_MAX)
-        *(volatile int*)((int64_t)e1000_viraddr + E1000_RDT) = 0;
-    else
-        *(volatile int*)((int64_t)e1000_viraddr + E1000_RDT) = tail + 1;
+    rx_rearm(rq, curr);
+    E1000_REG(rq->rdt) = curr;
     if(rd.length < 0) {
         panic("");
     }
 
     return rd.length;
-}
\ No newline at end of file
+}
+
+// Copy as many received frames into batch 'b' as fit, and hand all of
+// their descriptors back to the card with a single RDT write.  Each
+// record says in pr_flags which checksums the card has verified; frames
+// with a bad one are dropped here.
+// Returns the number of frames received, or -E_RX_EMPTY if there were none.
+int receive_packets(struct pkt_batch* b) {
+    struct e1000_rxq* rq = &rxqs[0];
+    int tail = E1000_REG(rq->rdt);
+    int curr = (tail + 1) % e1000_nrx;
+    int old_tail = tail, flags;
+    struct rx_desc rd;
+
+    if(rx_owned(0))
+        return -E_NOT_SUPP;
+    b->pb_count = 0;
+    b->pb_used = 0;
+    for(;;) {
+        struct pkt_rec* rec = (struct pkt_rec*)(b->pb_data + b->pb_used);
+        physaddr_t addr;
+
+        nic_rx_desc_read(rq->ring, rq->ext, curr, &rd);
+        if(!(rd.status & E1000_RXD_STAT_DD) || !PKT_BATCH_FITS(b, rd.length))
+            break;
+        addr = rq->ext ? rq->bufs_pa + curr * E1000_RXBUF_SIZE : rq->ring[curr].addr;
+        if((flags = nic_rx_csum_flags(&rd)) >= 0) {
+            rec->pr_len = rd.length;
+            rec->pr_flags = flags;
+            memcpy(rec->pr_data, KADDR(addr), rd.length);
+            b->pb_used += PKT_REC_SIZE(rd.length);
+            b->pb_count++;
+        }
+
+        rx_rearm(rq, curr);
+        tail = curr;
+        curr = (curr + 1) % e1000_nrx;
+    }
+    if(tail != old_tail)
+        E1000_REG(rq->rdt) = tail;
+    if(b->pb_count == 0)
+        return -E_RX_EMPTY;
+    return b->pb_count;
+}
+
+// Zero-copy receive: instead of copying the frame out, hand the whole
+// RX buffer page to 'e' at 'dstva' and put a fresh page in its ring slot.
+// The page is laid out as a struct jif_pkt (length word, then frame), so
+// the caller can pass it straight on to ns.  It goes back to the page
+// allocator, and from there to a ring slot again, once every env that
+// mapped it has unmapped it.  Only possible when every RX slot has a
+// page of its own (E1000_RX_PAGESLOTS); returns -E_NOT_SUPP otherwise.
+int receive_packet_map(struct Env* e, void* dstva) {
+    struct e1000_rxq* rq = &rxqs[0];
+    int tail = E1000_REG(rq->rdt);
+    int curr = (tail + 1) % e1000_nrx;
+    struct rx_desc rd = rq->ring[curr];
+
+    if(!E1000_RX_PAGESLOTS || rx_owned(0))
+        return -E_NOT_SUPP;
+    if(!(rd.status & (1 << 0)))
+        return -E_RX_EMPTY;
+
+    // Zeroed: the whole page goes to some env once a frame lands in it.
+    struct PageInfo* fresh = page_alloc(ALLOC_ZERO);
+    if(fresh == NULL)
+        return -E_NO_MEM;
+    struct PageInfo* full = pa2page(PTE_ADDR(rd.addr));
+    *(int*)page2kva(full) = rd.length;
+    if(page_insert(e->env_pml4e, full, dstva, PTE_P|PTE_U|PTE_W) < 0) {
+        page_free(fresh);
+        return -E_NO_MEM;
+    }
+    // The env now owns 'full'; the ring holds 'fresh' instead.
+    page_decref(full);
+    fresh->pp_ref = 1;
+
+    rd.addr = page2pa(fresh) + E1000_RXBUF_OFFSET;
+    rd.status &= (~(1 << 0));
+    rq->ring[curr] = rd;
+    E1000_REG(rq->rdt) = curr;
+
+    return rd.length;
+}
+
+// Put 'envid' to sleep until the card raises a receive interrupt.
+// The caller has just seen an empty ring and will retry once woken.
+// If the wait list is full it isn't put to sleep, and just retries.
+void e1000_rx_sleep(envid_t envid) {
+    struct Env* e;
+    int i, slot = -1;
+    if(envid2env(envid, &e, 0) < 0)
+        return;
+    for(i = 0; i < RX_MAXWAITERS; i++)
+        if(rx_waiters[i] == envid)
+            slot = i;
+        else if(rx_waiters[i] == 0 && slot < 0)
+            slot = i;
+    if(slot < 0)
+        return;
+    rx_waiters[slot] = envid;
+    e->env_status = ENV_NOT_RUNNABLE;
+}
+
+// Hand RX queue 'q' to 'e': map its descriptors and packed buffers
+// read-only at 'va', one after the other, and describe them in 'map'.
+// From then on 'e' reads frames straight out of the ring, gives
+// descriptors back with e1000_rx_doorbell, and is sent an IPC
+// (NIC_RX_NOTIFY) when frames arrive while it is blocked in ipc_recv.
+// The card only ever DMAs into buffers the kernel chose, so there is
+// nothing for 'e' to get wrong.  A queue gets its share of TCP flows
+// once it and every queue before it have an owner (see rss_update).
+//
+// Returns -E_NOT_SUPP if RX slots have a page each instead of packed
+// buffers, -E_INVAL for a bad 'va' or 'q', or if another env owns
+// queue 'q' or 'e' owns another queue.
+int e1000_rx_attach(struct Env* e, uint32_t q, void* va, struct nic_rx_map* map) {
+    size_t ringsz = ROUNDUP(e1000_nrx * RD_SIZE, PGSIZE);
+    size_t bufsz = ROUNDUP(e1000_nrx * E1000_RXBUF_SIZE, PGSIZE);
+    uintptr_t base = (uintptr_t)va;
+    struct e1000_rxq* rq = &rxqs[q];
+    size_t off;
+    int i;
+
+    if(E1000_RX_PAGESLOTS)
+        return -E_NOT_SUPP;
+    if(PGOFF(base) || base >= UTOP || base + ringsz + bufsz > UTOP)
+        return -E_INVAL;
+    if(q >= e1000_nqueues)
+        return -E_INVAL;
+    if(rx_owned(q) && rq->owner != e->env_id)
+        return -E_INVAL;
+    for(i = 0; i < e1000_nqueues; i++)
+        if(i != q && rxqs[i].owner == e->env_id)
+            return -E_INVAL;
+
+    for(off = 0; off < ringsz + bufsz; off += PGSIZE) {
+        physaddr_t pa = off < ringsz ? rq->ring_pa + off : rq->bufs_pa + off - ringsz;
+        if(page_insert(e->env_pml4e, pa2page(pa), (void*)(base + off), PTE_P|PTE_U) < 0)
+            return -E_NO_MEM;
+    }
+    rq->owner = e->env_id;
+    rq->owner_pending = false;
+    rss_update();
+
+    map->nm_ring = (volatile void*)base;
+    map->nm_bufs = (const char*)(base + ringsz);
+    map->nm_count = e1000_nrx;
+    map->nm_bufsize = E1000_RXBUF_SIZE;
+    map->nm_next = (E1000_REG(rq->rdt) + 1) % e1000_nrx;
+    map->nm_queue = q;
+    map->nm_nqueues = e1000_nqueues;
+    map->nm_ext = rq->ext;
+    return 0;
+}
+
+// The owner of RX queue 'q' is done with every descriptor up to and
+// including 'tail': hand them back to the card.  They must all have
+// been filled.
+// Returns -E_INVAL if 'e' doesn't own the queue or 'tail' is out of range.
+int e1000_rx_doorbell(struct Env* e, uint32_t q, uint32_t tail) {
+    struct e1000_rxq* rq;
+    uint32_t rdt, i;
+    struct rx_desc rd;
+
+    if(q >= e1000_nqueues)
+        return -E_INVAL;
+    rq = &rxqs[q];
+    if(!rx_owned(q) || rq->owner != e->env_id || tail >= e1000_nrx)
+        return -E_INVAL;
+    rdt = E1000_REG(rq->rdt);
+    for(i = rdt; i != tail; ) {
+        i = (i + 1) % e1000_nrx;
+        nic_rx_desc_read(rq->ring, rq->ext, i, &rd);
+        if(!(rd.status & E1000_RXD_STAT_DD))
+            return -E_INVAL;
+    }
+    for(i = rdt; i != tail; ) {
+        i = (i + 1) % e1000_nrx;
+        rx_rearm(rq, i);
+    }
+    E1000_REG(rq->rdt) = tail;
+    return 0;
+}
+
+// Called by sys_ipc_recv: if 'e' owns an RX queue and frames came in
+// since it last waited, deliver the NIC_RX_NOTIFY it missed right away
+// instead of letting it block.
+bool e1000_rx_notify_pending(struct Env* e) {
+    int q;
+    for(q = 0; q < e1000_nqueues; q++) {
+        if(!rxqs[q].owner_pending || rxqs[q].owner != e->env_id)
+            continue;
+        rxqs[q].owner_pending = false;
+        e->env_ipc_from = 0;
+        e->env_ipc_value = NIC_RX_NOTIFY;
+        e->env_ipc_perm = 0;
+        return true;
+    }
+    return false;
+}
+
+// Wake the owner of 'rq', or leave it a note if it's busy.
+static void rx_owner_notify(struct e1000_rxq* rq) {
+    struct Env* e;
+    if(envid2env(rq->owner, &e, 0) < 0) {
+        rq->owner = 0;
+        rss_update();
+        return;
+    }
+    if(e->env_status == ENV_NOT_RUNNABLE && e->env_ipc_recving) {
+        e->env_ipc_recving = 0;
+        e->env_ipc_from = 0;
+        e->env_ipc_value = NIC_RX_NOTIFY;
+        e->env_ipc_perm = 0;
+        e->env_status = ENV_RUNNABLE;
+    } else {
+        rq->owner_pending = true;
+    }
+}
+
+// Interrupt handler for the card's IRQ line.
+// Reading ICR acknowledges every pending cause at once; the ITR throttle
+// already coalesces bursts so one wakeup may cover many frames.  There
+// is one legacy line for all queues, so every queue's owner is woken.
+void e1000_intr(void) {
+    struct Env* e;
+    uint32_t icr = E1000_REG(E1000_ICR);
+    int q;
+
+    if(!(icr & (E1000_ICR_RXT0 | E1000_ICR_RXO | E1000_ICR_RXDMT0 | E1000_ICR_RXSEQ)))
+        return;
+    for(q = 0; q < e1000_nqueues; q++)
+        if(rxqs[q].owner != 0)
+            rx_owner_notify(&rxqs[q]);
+    for(q = 0; q < RX_MAXWAITERS; q++) {
+        if(rx_waiters[q] == 0)
+            continue;
+        if(envid2env(rx_waiters[q], &e, 0) == 0 && e->env_status == ENV_NOT_RUNNABLE)
+            e->env_status = ENV_RUNNABLE;
+        rx_waiters[q] = 0;
+    }
+}
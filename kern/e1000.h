@@ -1,5 +1,7 @@
 #include <kern/pci.h>
 #include <inc/assert.h>
+#include <inc/env.h>
+#include <inc/nic.h>
 
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
@@ -30,14 +32,55 @@
 #define E1000_RADV     0x0282C  /* RX Interrupt Absolute Delay Timer - RW */
 #define E1000_RSRPD    0x02C00  /* RX Small Packet Detect - RW */
 
+/* The 82574 repeats the ring registers for queue n at n * 0x100 past
+ * queue 0's, e.g. E1000_QREG(E1000_RDT, 1) is queue 1's RDT. */
+#define E1000_QREG(reg, n) ((reg) + (n) * 0x100)
+#define E1000_MAX_QUEUES 2      /* Queues the 82574 has of each kind */
+
 #define E1000_MTA      0x05200  /* Multicast Table Array - RW Array */
 #define E1000_RA       0x05400  /* Receive Address - RW Array */
-/* TX Descriptor Misc */
-#define TD_MAX         16       /* Maximum number of TX Descriptor */
+/* Descriptor Ring Misc */
 #define TD_SIZE        16       /* Each TD has 16 bytes */
-// Yeah Hacking here. Sorry. The problem is that the head register isn't moving. IDK why. Double Checked everything.
-#define RD_MAX         128      /* Maximum number of TX Descriptor */
-#define RD_SIZE        16       /* Each TD has 16 bytes */
+#define RD_SIZE        16       /* Each RD has 16 bytes */
+#define E1000_MIN_DESC 8        /* TDLEN/RDLEN must be a multiple of 128 bytes */
+#define E1000_MAX_DESC 4096     /* Largest ring the hardware takes */
+
+/* Ring sizes are fixed when the kernel boots; override them with
+ * 'make E1000_TXRING=n E1000_RXRING=n'.  Out-of-range values are clamped
+ * to [E1000_MIN_DESC, E1000_MAX_DESC] and rounded down to a multiple of 8. */
+#ifndef E1000_TXRING
+#define E1000_TXRING   256
+#endif
+#ifndef E1000_RXRING
+#define E1000_RXRING   256
+#endif
+
+/* Packet buffers are packed two per page, out of one contiguous run of
+ * pages per ring.  2048 is the card's smallest RCTL buffer size that
+ * still holds a full 1522-byte frame. */
+#define E1000_TXBUF_SIZE 2048
+#define E1000_RXBUF_SIZE 2048
+
+/* With E1000_RX_PAGESLOTS set, every RX slot gets a page of its own
+ * instead, which sys_receive_packet_map needs to swap pages out. */
+#ifndef E1000_RX_PAGESLOTS
+#define E1000_RX_PAGESLOTS 0
+#endif
+
+/* TX Descriptor Command/Status Bits */
+#define E1000_TXD_CMD_EOP  0x01    /* End of Packet */
+#define E1000_TXD_CMD_RS   0x08    /* Report Status */
+#define E1000_TXD_STAT_DD  0x01    /* Descriptor Done */
+#define E1000_TXD_CMD_TSE  0x04    /* TCP Segmentation Enable */
+#define E1000_TXD_CMD_DEXT 0x20    /* Descriptor extension (non-legacy) */
+
+/* Extended descriptor types and options, for checksum offload and TSO */
+#define E1000_TXD_DTYP_C      0x0   /* Context descriptor */
+#define E1000_TXD_DTYP_D      0x1   /* Data descriptor */
+#define E1000_TXD_TUCMD_TCP   0x01  /* Context: TCP (vs UDP) */
+#define E1000_TXD_TUCMD_IP    0x02  /* Context: IPv4 (vs IPv6) */
+#define E1000_TXD_POPTS_IXSM  0x01  /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM  0x02  /* Insert TCP/UDP checksum */
 
 /* Transmit Control Registers Address */
 #define E1000_TCTL     0x00400  /* TX Control - RW */
@@ -45,6 +88,11 @@
 #define E1000_TIPG     0x00410  /* TX Inter-packet gap -RW */
 
 #define E1000_RCTL     0x00100  /* RX Control - RW */
+#define E1000_RXCSUM   0x05000  /* RX Checksum Control - RW */
+#define E1000_RFCTL    0x05008  /* Receive Filter Control - RW */
+#define E1000_MRQC     0x05818  /* Multiple Receive Queues Command - RW */
+#define E1000_RETA     0x05C00  /* Redirection Table, 32 registers - RW */
+#define E1000_RSSRK    0x05C80  /* RSS Random Key, 10 registers - RW */
 
 /* Transmit Control BITS*/
 #define E1000_TCTL_RST    0x00000001    /* software reset */
@@ -64,11 +112,30 @@
 #define E1000_RCTL_BAM            0x00008000    /* broadcast enable */
 #define E1000_RCTL_BSEX           0x02000000    /* Buffer size extension */
 #define E1000_RCTL_SZ_4096        0x00030000    /* rx buffer size 4096 */
+#define E1000_RCTL_SZ_MASK        0x00030000    /* rx buffer size; 0 = 2048 */
 #define E1000_RAH_AV              0x80000000        /* Receive descriptor valid */
 #define E1000_RCTL_SECRC          0x04000000    /* Strip Ethernet CRC */
 
-/* IMS Control Register*/
+#define E1000_RXCSUM_IPOFL        0x00000100    /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL        0x00000200    /* TCP / UDP checksum offload */
+#define E1000_RXCSUM_PCSD         0x00002000    /* RSS hash instead of checksum */
+
+#define E1000_RFCTL_EXTEN         0x00008000    /* Extended RX descriptors */
+#define E1000_MRQC_RSS            0x00000001    /* Spread frames by RSS hash */
+#define E1000_MRQC_TCPIPV4        0x00010000    /* Hash TCP/IPv4 4-tuples */
+#define E1000_RETA_QUEUE1         0x80          /* RETA entry: to queue 1 */
+
+/* Receive descriptor bits are in inc/nic.h, with struct rx_desc. */
+
+/* Interrupt Registers */
+#define E1000_ICR      0x000C0  /* Interrupt Cause Read - R/clr */
+#define E1000_ITR      0x000C4  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS      0x000D0  /* Interrupt Mask Set - RW */
+#define E1000_IMC      0x000D8  /* Interrupt Mask Clear - WO */
+
+/* Interrupt moderation: minimum gap between interrupts, in 256ns units.
+ * 488 * 256ns ~= 125us, i.e. at most ~8000 interrupts per second under load. */
+#define E1000_ITR_INTERVAL 488
 
 /* IMS Control Bits */
     /* Interrupt Cause Read */
@@ -94,11 +161,10 @@
 
 
 
-/* E1000 Virtual Memory Mapping */
-#define E1000_TDBASE_TRANSMIT  0x9000000000
-#define E1000_TDBASE_RECEIVE   0x9000001000
-#define E1000_PACKET           0x9000002000
-#define E1000_PACKET_RECEIVE   (0x9000002000 + TD_MAX * PGSIZE)
+/* In E1000_RX_PAGESLOTS mode RX frames are DMA'd this far into their
+ * page, leaving room for the jp_len word of a struct jif_pkt so the page
+ * can go to ns as-is. */
+#define E1000_RXBUF_OFFSET     4
 
 struct tx_desc
 {
@@ -111,17 +177,51 @@ struct tx_desc
 	uint16_t special;
 };
 
-struct rx_desc
+/* Extended TX data descriptor; same size and DD position as tx_desc. */
+struct tx_data_desc
 {
 	uint64_t addr;
 	uint16_t length;
-	uint16_t checksum;
+	uint8_t dtyp;		/* DTYP << 4; low bits extend length */
+	uint8_t dcmd;
 	uint8_t status;
-	uint8_t errors;
+	uint8_t popts;
 	uint16_t special;
 };
 
+/* TX context descriptor: where the checksums go and how to segment.
+ * The card keeps the last one it saw and applies it to every extended
+ * data descriptor that follows. */
+struct tx_ctx_desc
+{
+	uint8_t ipcss;		/* IP checksum start */
+	uint8_t ipcso;		/* IP checksum offset */
+	uint16_t ipcse;		/* IP checksum end, inclusive */
+	uint8_t tucss;		/* TCP/UDP checksum start */
+	uint8_t tucso;		/* TCP/UDP checksum offset */
+	uint16_t tucse;		/* TCP/UDP checksum end; 0 = end of frame */
+	uint32_t cmd_len;	/* TSO payload length | DTYP << 20 | TUCMD << 24 */
+	uint8_t status;
+	uint8_t hdrlen;		/* TSO header length */
+	uint16_t mss;		/* TSO segment size */
+};
+
 int transmit_packet(void* buffer, int length);
+int transmit_packet_map(struct Env* e, const struct pkt_frag* frags, int nfrags, int flags);
 int receive_packet(void* buffer);
+int receive_packet_map(struct Env* e, void* dstva);
+int transmit_packets(struct pkt_batch* b, int skip);
+int receive_packets(struct pkt_batch* b);
+physaddr_t e1000_tx_init(int q);
+physaddr_t e1000_rx_init(int q, bool ext);
+void e1000_rx_sleep(envid_t envid);
+int e1000_rx_attach(struct Env* e, uint32_t q, void* va, struct nic_rx_map* map);
+int e1000_rx_doorbell(struct Env* e, uint32_t q, uint32_t tail);
+bool e1000_rx_notify_pending(struct Env* e);
+void e1000_intr(void);
+
+extern uint8_t e1000_irq;
+extern uint32_t e1000_ntx, e1000_nrx;
+extern int e1000_nqueues;
 
 #endif	// JOS_KERN_E1000_H
@@ -0,0 +1,213 @@
+// Bus-master DMA for the primary channel of a PIIX IDE controller,
+// where the file system server's disks are.  The fs env drives the
+// drives itself with port I/O (fs/ide.c), but only the kernel knows
+// where its pages are in physical memory, so it comes here to have a
+// transfer done by DMA (see kern/disk.h): ide_dma_submit programs the
+// PRD table and the drive and returns at once, IRQ_IDE says the
+// transfer is over, and ide_dma_reap hands the result back, sleeping
+// the env until then.  The channel does one command at a time, so
+// there is one tag, 0.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/ide.h>
+#include <kern/disk.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define SECTSIZE	512
+
+// Primary channel task file and control ports
+#define ATA_BASE	0x1F0
+#define ATA_CTL		0x3F6
+#define ATA_STATUS	(ATA_BASE + 7)
+#define ATA_BSY		0x80
+#define ATA_DRDY	0x40
+#define ATA_DF		0x20
+#define ATA_ERR		0x01
+#define ATA_CMD_READ_DMA	0xC8
+#define ATA_CMD_WRITE_DMA	0xCA
+
+// Bus master registers for the primary channel, from BAR 4
+#define BM_CMD		0
+#define BM_CMD_START	0x01
+#define BM_CMD_TOMEM	0x08	// Transfer from the drive into memory
+#define BM_STATUS	2
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04
+#define BM_PRDT		4
+
+// A physical region descriptor: one piece of a transfer.
+struct prd {
+	uint32_t addr;
+	uint16_t len;
+	uint16_t flags;
+} __attribute__((packed));
+
+#define PRD_EOT		0x8000	// Last descriptor in the table
+
+// A 28-bit ATA command moves at most 256 sectors, and every page of a
+// transfer gets a descriptor of its own.
+#define DMA_MAXSECS	DISK_MAXSECS
+#define DMA_MAXPAGES	(DMA_MAXSECS * SECTSIZE / PGSIZE)
+
+static uint16_t bmiba;
+// The table mustn't cross a 64K boundary.
+static struct prd prdt[DMA_MAXPAGES] __attribute__((aligned(DMA_MAXPAGES * sizeof(struct prd))));
+
+static struct {
+	bool busy;		// A transfer hasn't been reaped yet
+	bool done;		// It's over, with 'result'
+	int result;
+	envid_t owner;		// Who submitted it
+	envid_t waiter;		// Asleep in ide_dma_reap, or 0
+	int npages;
+	struct PageInfo *pages[DMA_MAXPAGES];	// Held until it's over
+} dma;
+
+static int ide_dma_submit(struct Env *e, int diskno, uint32_t secno,
+			  void *va, size_t nsecs, bool write);
+static int ide_dma_reap(struct Env *e, int tag);
+
+static struct disk_driver ide_driver = {
+	{ DISK_IDE, 1, 0 }, ide_dma_submit, ide_dma_reap
+};
+
+int
+pci_ide_attach(struct pci_func *pcif)
+{
+	if (!IDE_DMA)
+		return 0;
+	pci_func_enable(pcif);
+	// Compatibility mode channels keep their legacy ports and IRQs;
+	// only the bus master registers come from the BAR.
+	bmiba = pcif->reg_base[4];
+	if (!bmiba)
+		return 0;
+	outb(ATA_CTL, 0);	// Let the drives interrupt
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_IDE));
+	cprintf("ide: bus master DMA at port 0x%x\n", bmiba);
+	disk_register(&ide_driver);
+	return 1;
+}
+
+static void
+dma_release(void)
+{
+	int i;
+
+	for (i = 0; i < dma.npages; i++)
+		page_decref(dma.pages[i]);
+	dma.npages = 0;
+}
+
+// Start moving 'nsecs' sectors from 'secno' on disk 'diskno' into
+// (or, if 'write', out of) e's whole pages at 'va'.  The pages stay
+// allocated until the transfer is over, whatever e does to them.
+// Returns the tag to reap it with, or < 0 on error.  Errors are:
+//	-E_NOT_SUPP if there is no bus master controller.
+//	-E_AGAIN if the last transfer hasn't been reaped yet.
+//	-E_INVAL for a bad size or an unaligned 'va'.
+//	-E_FAULT if a page isn't mapped, or isn't writable for a read.
+static int
+ide_dma_submit(struct Env *e, int diskno, uint32_t secno, void *va,
+	       size_t nsecs, bool write)
+{
+	pte_t *pte;
+	struct PageInfo *pp;
+	struct Env *owner;
+	int i, n;
+
+	if (!bmiba)
+		return -E_NOT_SUPP;
+	// An unreaped transfer of an env that's gone can be taken over.
+	if (dma.busy && (!dma.done || envid2env(dma.owner, &owner, 0) == 0))
+		return -E_AGAIN;
+	if (nsecs == 0 || nsecs > DMA_MAXSECS || nsecs % (PGSIZE / SECTSIZE)
+	    || (uintptr_t) va % PGSIZE || (uintptr_t) va + nsecs * SECTSIZE > UTOP)
+		return -E_INVAL;
+
+	n = nsecs / (PGSIZE / SECTSIZE);
+	dma.npages = 0;
+	for (i = 0; i < n; i++) {
+		pp = page_lookup(e->env_pml4e, va + i * PGSIZE, &pte);
+		if (!pp || !(*pte & PTE_U) || (!write && !(*pte & PTE_W))) {
+			dma_release();
+			return -E_FAULT;
+		}
+		pp->pp_ref++;
+		dma.pages[dma.npages++] = pp;
+		prdt[i].addr = page2pa(pp);
+		prdt[i].len = PGSIZE;
+		prdt[i].flags = 0;
+	}
+	prdt[n - 1].flags = PRD_EOT;
+
+	while ((inb(ATA_STATUS) & (ATA_BSY | ATA_DRDY)) != ATA_DRDY)
+		/* do nothing */;
+	outb(bmiba + BM_CMD, 0);
+	outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_INTR);
+	outl(bmiba + BM_PRDT, PADDR(prdt));
+
+	outb(ATA_BASE + 2, nsecs);
+	outb(ATA_BASE + 3, secno & 0xFF);
+	outb(ATA_BASE + 4, (secno >> 8) & 0xFF);
+	outb(ATA_BASE + 5, (secno >> 16) & 0xFF);
+	outb(ATA_BASE + 6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+	outb(ATA_STATUS, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+	outb(bmiba + BM_CMD, (write ? 0 : BM_CMD_TOMEM) | BM_CMD_START);
+
+	dma.busy = true;
+	dma.done = false;
+	dma.owner = e->env_id;
+	dma.waiter = 0;
+	return 0;
+}
+
+// Return the result of e's transfer 'tag': 0, or -E_UNSPECIFIED if the
+// drive or the controller reported an error.  If it isn't over yet,
+// put e to sleep until it is and return -E_AGAIN; e should then retry.
+static int
+ide_dma_reap(struct Env *e, int tag)
+{
+	if (tag != 0 || !dma.busy || dma.owner != e->env_id)
+		return -E_INVAL;
+	if (!dma.done) {
+		dma.waiter = e->env_id;
+		e->env_status = ENV_NOT_RUNNABLE;
+		return -E_AGAIN;
+	}
+	dma.busy = false;
+	return dma.result;
+}
+
+// Interrupt handler for IRQ_IDE.  PIO commands from the fs env raise
+// it too; those it leaves alone.
+void
+ide_intr(void)
+{
+	struct Env *e;
+	uint8_t bms, st;
+
+	if (!bmiba || !dma.busy || dma.done)
+		return;
+	bms = inb(bmiba + BM_STATUS);
+	if (!(bms & BM_STATUS_INTR))
+		return;
+	outb(bmiba + BM_CMD, 0);
+	st = inb(ATA_STATUS);	// Acknowledges the drive's interrupt
+	outb(bmiba + BM_STATUS, bms | BM_STATUS_ERR | BM_STATUS_INTR);
+
+	dma.result = ((bms & BM_STATUS_ERR) || (st & (ATA_DF | ATA_ERR)))
+		? -E_UNSPECIFIED : 0;
+	dma_release();
+	dma.done = true;
+	if (dma.waiter && envid2env(dma.waiter, &e, 0) == 0
+	    && e->env_status == ENV_NOT_RUNNABLE)
+		e->env_status = ENV_RUNNABLE;
+	dma.waiter = 0;
+}
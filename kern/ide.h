@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+
+#include <inc/types.h>
+#include <kern/pci.h>
+
+// Bus-master DMA can be turned off at build time ('make IDE_DMA=0'),
+// leaving the file system server on PIO.  The file system tests should
+// pass either way: 'make grade' and 'make IDE_DMA=0 grade'.
+#ifndef IDE_DMA
+#define IDE_DMA		1
+#endif
+
+int	pci_ide_attach(struct pci_func *pcif);
+void	ide_intr(void);
+
+#endif	// !JOS_KERN_IDE_H
@@ -93,6 +93,8 @@ i386_init(void)
 	// Touch all you want.
 
 	ENV_CREATE(user_testtime, ENV_TYPE_USER);
+	// Has fs write back its dirty blocks now and then.
+	ENV_CREATE(user_fsflush, ENV_TYPE_USER);
 #endif // TEST*
 
 	// Should not be necessary - drains keyboard because interrupt has given up.
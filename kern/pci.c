@@ -5,6 +5,11 @@
 #include <kern/pcireg.h>
 #include <kern/pmap.h>
 #include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/ahci.h>
+#include <kern/virtio_blk.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 0;
@@ -17,11 +22,10 @@ static uint32_t pci_conf1_data_ioport = 0x0cfc;
 // Forward declarations
 static int pci_bridge_attach(struct pci_func *pcif);
 static int pci_e1000_attach(struct pci_func *pcif);
+static int pci_e1000e_attach(struct pci_func *pcif);
 
 //
 volatile uint32_t*  e1000_viraddr;
-volatile physaddr_t ring_buffers[TD_MAX];
-volatile physaddr_t ring_buffers_receive[RD_MAX];
 
 // PCI driver table
 struct pci_driver {
@@ -32,11 +36,15 @@ struct pci_driver {
 // pci_attach_class matches the class and subclass of a PCI device
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &pci_ide_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_SATA, &pci_ahci_attach },
 	{ 0, 0, 0 },
 };
 
 // pci_attach_vendor matches the vendor ID and device ID of a PCI device
 struct pci_driver pci_attach_vendor[] = { {0x8086, 0x100E, &pci_e1000_attach},
+	{ 0x8086, 0x10D3, &pci_e1000e_attach },
+	{ VIRTIO_VENDOR, VIRTIO_DEV_BLK, &pci_virtio_blk_attach },
 	{ 0, 0, 0 },
 };
 
@@ -192,35 +200,26 @@ pci_bridge_attach(struct pci_func *pcif)
 	return 1;
 }
 
-static int
-pci_e1000_attach(struct pci_func *pcif)
+// Bring up the card's first 'nqueues' TX and RX queues.  With more than
+// one, frames are spread over them by RSS, which needs the extended RX
+// descriptors.  Every queue is an e1000_nrx/e1000_ntx ring of its own.
+static void
+e1000_setup(struct pci_func *pcif, int nqueues)
 {
-	// Enables the device; set pcif->reg_base[0], pcif->reg_size[0] physical address. 
-	pci_func_enable(pcif);
-	// Memory Map the physical address into MMIO
-	e1000_viraddr = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
-	// testing device status register
-	if(*(volatile int*)((int64_t)e1000_viraddr + 0x8) != 0x80080783) {
-		panic("mmio error, something got fucked\n");
-	}
+	bool ext = nqueues > 1;
+	int q;
+
 	// Transmit Initialization, see 14.5 in Intel's manual
-	// Allocate Memory; its reference count is not updated.
-	// If more than one page, MAKE SURE THEY ARE CONTIGUOUS!
-	struct PageInfo* tdring_page = page_alloc(1);
-	physaddr_t phyaddr = page2pa(tdring_page);
-	page_insert(boot_pml4e, tdring_page, (void*) E1000_TDBASE_TRANSMIT, PTE_P|PTE_W); // Only kernel should have access
-	// Map into virtual Address
-	for(int i = 0; i < TD_MAX; i++){
-		struct PageInfo* new_packet_page = page_alloc(1);
-		ring_buffers[i] = page2pa(new_packet_page);
-		page_insert(boot_pml4e, new_packet_page, (void*) (E1000_PACKET + i*4096), PTE_P|PTE_W); // Only kernel should have access
+	// Ring and buffers come from contiguous runs of pages; see e1000.c.
+	e1000_nqueues = nqueues;
+	for (q = 0; q < nqueues; q++) {
+		physaddr_t phyaddr = e1000_tx_init(q);
+		// PACKET TRANSMISSION INITIALIZATION
+		*(volatile int64_t*)((int64_t)e1000_viraddr + E1000_QREG(E1000_TDBAL, q)) = phyaddr;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_TDLEN, q)) = e1000_ntx * TD_SIZE;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_TDH, q)) = 0;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_TDT, q)) = 0;
 	}
-	// PACKET TRANSMISSION INITIALIZATION
-	// We support a maximum of 64 Transmit Descriptors as required by Auto Grader.
-	*(volatile int64_t*)((int64_t)e1000_viraddr + E1000_TDBAL) = phyaddr;
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_TDLEN) = TD_MAX * TD_SIZE;
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_TDH) = 0;
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_TDT) = 0;
 	// Set up TCTL; TCTL register is at 0x400 from Base
 	*(volatile int*)((int64_t)e1000_viraddr + E1000_TCTL) = 
 		*(volatile int*)((int64_t)e1000_viraddr + E1000_TCTL) 
@@ -236,17 +235,6 @@ pci_e1000_attach(struct pci_func *pcif)
 
 
 	// PACKET RECEIVE INITIALIZATION
-	struct PageInfo* tdring_page_receive = page_alloc(1);
-	physaddr_t phyaddr_receive = page2pa(tdring_page_receive);
-	page_insert(boot_pml4e, tdring_page_receive, (void*) E1000_TDBASE_RECEIVE, PTE_P|PTE_W); // Only kernel should have access
-	struct rx_desc* rds = (struct rx_desc*) E1000_TDBASE_RECEIVE;
-
-	for(int i = 0; i < RD_MAX; i++){
-		struct PageInfo* new_receive_page = page_alloc(1);
-		rds[i].addr = page2pa(new_receive_page);
-		page_insert(boot_pml4e, new_receive_page, (void*) (E1000_PACKET_RECEIVE + i*4096), PTE_P|PTE_W); // Only kernel should have access
-	}
-
 	*(volatile int64_t*)((int64_t)e1000_viraddr + E1000_RA) = 
 	(0x52ll) 
 	| (0x54ll << 8)
@@ -255,34 +243,89 @@ pci_e1000_attach(struct pci_func *pcif)
 	| (0x34ll << 32)
 	| (0x56ll << 40)
 	| ((int64_t)E1000_RAH_AV << 32);
-	*(volatile int64_t*)((int64_t)e1000_viraddr + E1000_RDBAL) = phyaddr_receive;
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_RDLEN) = RD_MAX * RD_SIZE;
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_RDH) = 5;
-	// If H == T, the whole thing just shut down.
-	*(volatile int*)((int64_t)e1000_viraddr + E1000_RDT) = 4;
+	for (q = 0; q < nqueues; q++) {
+		physaddr_t phyaddr_receive = e1000_rx_init(q, ext);
+		*(volatile int64_t*)((int64_t)e1000_viraddr + E1000_QREG(E1000_RDBAL, q)) = phyaddr_receive;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_RDLEN, q)) = e1000_nrx * RD_SIZE;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_RDH, q)) = 0;
+		// If H == T, the whole thing just shut down: hand the card every
+		// descriptor but the one at RDT.
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_QREG(E1000_RDT, q)) = e1000_nrx - 1;
+	}
 	*(volatile int*)((int64_t)e1000_viraddr + E1000_MTA) = 0;
-	// *(volatile int*)((int64_t)e1000_viraddr + E1000_IMS) = 
-	// 	*(volatile int*)((int64_t)e1000_viraddr + E1000_IMS) 
-	// 	| E1000_IMS_RXT0 
-	// 	| E1000_IMS_RXO 
-	// 	| E1000_IMS_RXDMT0  
-	// 	| E1000_IMS_RXSEQ 
-	// 	| E1000_IMS_LSC;    
+	// Receive interrupts, throttled by ITR so a flood of small frames
+	// can't turn into a flood of traps.
+	*(volatile int*)((int64_t)e1000_viraddr + E1000_RDTR) = 0;
+	*(volatile int*)((int64_t)e1000_viraddr + E1000_ITR) = E1000_ITR_INTERVAL;
+	*(volatile int*)((int64_t)e1000_viraddr + E1000_IMC) = 0xFFFFFFFF;
+	(void)*(volatile int*)((int64_t)e1000_viraddr + E1000_ICR);
+	*(volatile int*)((int64_t)e1000_viraddr + E1000_IMS) = 
+		E1000_IMS_RXT0 
+		| E1000_IMS_RXO 
+		| E1000_IMS_RXDMT0  
+		| E1000_IMS_RXSEQ;
+	// No IOAPIC here; the card's legacy INTx line goes through the 8259A.
+	e1000_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+
+	// Have the card check IP and TCP/UDP checksums; receive_packets
+	// passes its verdict on to ns.
+	*(volatile int*)((int64_t)e1000_viraddr + E1000_RXCSUM) = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL
+		| (ext ? E1000_RXCSUM_PCSD : 0);
+
+	// RSS: hash TCP/IPv4 flows under NIC_RSS_KEY.  The redirection table
+	// starts out all queue 0 and fans out as queues get owners (see
+	// rss_update in e1000.c).
+	if (ext) {
+		static const uint8_t key[NIC_RSS_KEYLEN] = NIC_RSS_KEY;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_RFCTL) |= E1000_RFCTL_EXTEN;
+		for (q = 0; q < NIC_RSS_KEYLEN / 4; q++)
+			*(volatile uint32_t*)((int64_t)e1000_viraddr + E1000_RSSRK + q * 4) =
+				*(const uint32_t*)&key[q * 4];
+		for (q = 0; q < 32; q++)
+			*(volatile int*)((int64_t)e1000_viraddr + E1000_RETA + q * 4) = 0;
+		*(volatile int*)((int64_t)e1000_viraddr + E1000_MRQC) = E1000_MRQC_RSS | E1000_MRQC_TCPIPV4;
+	}
 
 	// Put this to last, can only be enabled after receive ring is initialized and ready
 	*(volatile int*)((int64_t)e1000_viraddr + E1000_RCTL) = 
 		(*(volatile int*)((int64_t)e1000_viraddr + E1000_RCTL) 
 		| E1000_RCTL_EN    // set bit to 1 according to manual
 		| E1000_RCTL_BAM    // allow broadcast
-		| E1000_RCTL_BSEX
-		| E1000_RCTL_SZ_4096
+		| (E1000_RX_PAGESLOTS ? (E1000_RCTL_BSEX | E1000_RCTL_SZ_4096) : 0)
 		| E1000_RCTL_SECRC) 
+		& (E1000_RX_PAGESLOTS ? ~0 : ~(E1000_RCTL_BSEX | E1000_RCTL_SZ_MASK)) // 2048-byte buffers
 		& (~0x00000C00)
 		& (~E1000_RCTL_LPE);
 	// cprintf("%llx %llx", E1000_RCTL, *(volatile int*)((int64_t)e1000_viraddr + E1000_RCTL));
 	// panic("");
+}
 
-	
+static int
+pci_e1000_attach(struct pci_func *pcif)
+{
+	// Enables the device; set pcif->reg_base[0], pcif->reg_size[0] physical address. 
+	pci_func_enable(pcif);
+	// Memory Map the physical address into MMIO
+	e1000_viraddr = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+	// testing device status register
+	if(*(volatile int*)((int64_t)e1000_viraddr + 0x8) != 0x80080783) {
+		panic("mmio error, something got fucked\n");
+	}
+	e1000_setup(pcif, 1);
+	return 1;
+}
+
+// The 82574 (QEMU's -device e1000e) has the same registers plus a second
+// queue pair and RSS, so one ns instance can run per queue; there is no
+// point in more queues than CPUs.  Page-slot RX
+// buffers need legacy descriptors, so they keep it to one queue.
+static int
+pci_e1000e_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+	e1000_viraddr = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+	e1000_setup(pcif, E1000_RX_PAGESLOTS ? 1 : MIN(E1000_MAX_QUEUES, ncpu));
 	return 1;
 }
 
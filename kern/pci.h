@@ -32,6 +32,4 @@ void pci_func_enable(struct pci_func *f);
 
 // With Love, personal variable definitions
 extern volatile uint32_t * e1000_viraddr;
-extern volatile physaddr_t ring_buffers[TD_MAX];
-extern volatile physaddr_t ring_buffers_receive[RD_MAX];
 #endif
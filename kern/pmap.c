@@ -491,6 +491,50 @@ page_alloc(int alloc_flags)
     return alloc_page;
 }
 
+//
+// Allocates 'n' physically contiguous pages, for devices that DMA into
+// buffers larger than a page.  Returns the first page of the run (the
+// others follow it in 'pages'), or NULL if there is no such run.
+//
+// page_init builds the free list in address order, so early on a run
+// of neighbouring list entries is a run of contiguous pages; that is
+// all this looks for.  Call it at boot, before the list gets shuffled.
+// As with page_alloc, reference counts are left at zero.
+struct PageInfo *
+page_alloc_npages(int alloc_flags, int n)
+{
+	struct PageInfo *prev = NULL, *start_prev = NULL;
+	struct PageInfo *start = page_free_list, *pp;
+	int run = 0, i;
+
+	if (n <= 0)
+		return NULL;
+	for (pp = page_free_list; pp != NULL; prev = pp, pp = pp->pp_link) {
+		if (run > 0 && pp == start + run) {
+			run++;
+		} else {
+			start = pp;
+			start_prev = prev;
+			run = 1;
+		}
+		if (run == n)
+			break;
+	}
+	if (run < n)
+		return NULL;
+
+	if (start_prev)
+		start_prev->pp_link = start[n - 1].pp_link;
+	else
+		page_free_list = start[n - 1].pp_link;
+	for (i = 0; i < n; i++) {
+		start[i].pp_link = NULL;
+		if (alloc_flags & ALLOC_ZERO)
+			memset(page2kva(&start[i]), '\0', PGSIZE);
+	}
+	return start;
+}
+
 //
 // Initialize a Page structure.
 // The result has null links and 0 refcount.
@@ -54,6 +54,7 @@ void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
+struct PageInfo * page_alloc_npages(int alloc_flags, int n);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
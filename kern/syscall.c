@@ -18,6 +18,7 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/disk.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -442,6 +443,9 @@ sys_ipc_recv(void *dstva)
 	if((int64_t)dstva%PGSIZE != 0 && (int64_t)dstva < UTOP){
 		return -E_INVAL;
 	}
+	// An RX notification the caller missed counts as a message.
+	if(e1000_rx_notify_pending(curenv))
+		return 0;
 	curenv->env_ipc_dstva = dstva;
 	curenv->env_status = 4;
 	curenv->env_ipc_recving = 1;
@@ -477,6 +481,21 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Sleep for at least msec milliseconds; the timer interrupt wakes the
+// caller (see time_tick).
+static int
+sys_sleep(unsigned int msec)
+{
+	return time_sleep(curenv, msec);
+}
+
+// Return the number of CPUs, for sizing worker pools.
+static int
+sys_ncpu(void)
+{
+	return ncpu;
+}
+
 
 
 static int sys_child_mmap(envid_t srcenvid, envid_t dstenvid){
@@ -530,15 +549,145 @@ static int sys_send_packet(void* buffer, int length) {
 	return transmit_packet(buffer, length);
 }
 
+// Queue one frame, given as 'nfrags' fragments in the caller's address
+// space, without copying it (see transmit_packet_map).  'flags' holds
+// PKT_TX_* offload requests.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the fragment list or any fragment is bad.
+//	-E_TX_FULL if the ring is full; nothing was queued, try again later.
+static int sys_send_packet_map(struct pkt_frag* frags, int nfrags, int flags) {
+	struct pkt_frag kfrags[PKT_MAXFRAGS];
+
+	if(nfrags <= 0 || nfrags > PKT_MAXFRAGS)
+		return -E_INVAL;
+	user_mem_assert(curenv, frags, nfrags * sizeof(struct pkt_frag), PTE_U);
+	// Take the list once: the env could change it between our checks
+	// and our use of it.
+	memcpy(kfrags, frags, nfrags * sizeof(struct pkt_frag));
+	return transmit_packet_map(curenv, kfrags, nfrags, flags);
+}
+
+// Batched send: queue the frames of 'batch' after the first 'skip' ones,
+// touching the tail register once.  Returns how many were queued; fewer
+// than asked means the ring filled up and the caller should retry the
+// rest later.  Returns -E_INVAL for a malformed batch.
+static int sys_send_packets(struct pkt_batch* batch, int skip) {
+	user_mem_assert(curenv, batch, PGSIZE, PTE_U);
+	return transmit_packets(batch, skip);
+}
+
+// Batched receive: fill the page at 'batch' with as many frames as are
+// ready and fit.  Returns the number of frames, or -E_RX_EMPTY after
+// putting the caller to sleep until the next RX interrupt.
+static int sys_receive_packets(struct pkt_batch* batch) {
+	user_mem_assert(curenv, batch, PGSIZE, PTE_U|PTE_W);
+	int r = receive_packets(batch);
+	if(r == -E_RX_EMPTY)
+		e1000_rx_sleep(curenv->env_id);
+	return r;
+}
+
+// Take over e1000 RX queue 'queue': map it and its buffers read-only at
+// 'va' and fill in '*map' (see e1000_rx_attach).  Once queue 0 is taken,
+// other envs can no longer receive through the kernel until its owner
+// exits.
+static int sys_net_attach(uint32_t queue, void* va, struct nic_rx_map* map) {
+	user_mem_assert(curenv, map, sizeof(*map), PTE_U|PTE_W);
+	return e1000_rx_attach(curenv, queue, va, map);
+}
+
+// Give descriptors of RX queue 'queue' up to and including 'tail' back
+// to the card.
+static int sys_net_rx_doorbell(uint32_t queue, uint32_t tail) {
+	return e1000_rx_doorbell(curenv, queue, tail);
+}
+
+// The disk driver sys_disk_* use.  A controller with a disk of its own
+// takes over from IDE DMA, which only helps out with the fs env's PIO.
+struct disk_driver *disk_driver;
+
+void
+disk_register(struct disk_driver *d)
+{
+	if (!disk_driver || disk_driver->info.di_type == DISK_IDE)
+		disk_driver = d;
+}
+
+// Describe the disk driver in *info; di_type is DISK_NONE if there is
+// none.  Only the file system server may ask.
+static int
+sys_disk_info(struct diskinfo *info)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	user_mem_assert(curenv, info, sizeof(*info), PTE_U | PTE_W);
+	if (disk_driver)
+		*info = disk_driver->info;
+	else
+		memset(info, 0, sizeof(*info));
+	return 0;
+}
+
+// Start a DMA transfer of 'nsecs' sectors between 'secno' on disk
+// 'diskno' and the caller's pages at 'va', reading from the disk unless
+// 'write'.  Only the file system server may.
+//
+// Returns a tag for sys_disk_reap, or < 0 on error.  -E_NOT_SUPP means
+// there's no disk driver; -E_AGAIN, that all its slots are taken.
+static int
+sys_disk_submit(int diskno, uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	if (!disk_driver)
+		return -E_NOT_SUPP;
+	return disk_driver->submit(curenv, diskno, secno, va, nsecs, write);
+}
+
+// Return the result of transfer 'tag'.  If it isn't over, the caller
+// sleeps until it is, sees -E_AGAIN, and should retry.
+static int
+sys_disk_reap(int tag)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	if (!disk_driver)
+		return -E_INVAL;
+	return disk_driver->reap(curenv, tag);
+}
+
 static int sys_receive_packet(void* buffer) {
 	// if((int64_t)buffer %4096!=0){
 	// 	return -E_INVAL;
 	// } else if((int64_t)buffer > UTOP) {
 	// 	return -E_INVAL;
 	// }
-	return receive_packet(buffer);
+	int r = receive_packet(buffer);
+	// Nothing to hand out: sleep until the RX interrupt fires.  The
+	// caller sees -E_RX_EMPTY when it runs again and simply retries.
+	if(r == -E_RX_EMPTY)
+		e1000_rx_sleep(curenv->env_id);
+	return r;
 }
 
+// Like sys_receive_packet, but instead of copying the frame into 'dstva'
+// the RX buffer page itself is mapped there (see receive_packet_map).
+// Any page already mapped at 'dstva' is unmapped.
+//
+// Returns the frame length, or < 0 on error.  Errors are:
+//	-E_INVAL if dstva >= UTOP or dstva is not page-aligned.
+//	-E_NO_MEM if a replacement ring page can't be allocated.
+//	-E_RX_EMPTY if the ring is empty; the caller sleeps until the next
+//		RX interrupt and should then retry.
+static int sys_receive_packet_map(void* dstva) {
+	if((int64_t)dstva >= UTOP || ((int64_t)dstva % PGSIZE) != 0)
+		return -E_INVAL;
+	int r = receive_packet_map(curenv, dstva);
+	if(r == -E_RX_EMPTY)
+		e1000_rx_sleep(curenv->env_id);
+	return r;
+}
 
 // Dispatches to the correct kernel function, passing the arguments.
 int64_t
@@ -585,12 +734,34 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 			return sys_env_set_trapframe(a1, (void*)a2);
 		case SYS_time_msec:
 			return sys_time_msec();
+		case SYS_sleep:
+			return sys_sleep(a1);
 		case SYS_send_packet:
 			user_mem_assert((struct Env*)curenv, (void*)a1, a2, PTE_U);
 			return sys_send_packet((void*) a1, a2);
 		case SYS_receive_packet:
 			// user_mem_assert((struct Env*)curenv, (void*)a1, a2, PTE_U);
 			return sys_receive_packet((void*) a1);
+		case SYS_send_packets:
+			return sys_send_packets((struct pkt_batch*) a1, a2);
+		case SYS_receive_packets:
+			return sys_receive_packets((struct pkt_batch*) a1);
+		case SYS_send_packet_map:
+			return sys_send_packet_map((struct pkt_frag*) a1, a2, a3);
+		case SYS_receive_packet_map:
+			return sys_receive_packet_map((void*) a1);
+		case SYS_net_attach:
+			return sys_net_attach(a1, (void*) a2, (struct nic_rx_map*) a3);
+		case SYS_net_rx_doorbell:
+			return sys_net_rx_doorbell(a1, a2);
+		case SYS_ncpu:
+			return sys_ncpu();
+		case SYS_disk_submit:
+			return sys_disk_submit(a1, a2, (void *) a3, a4, a5);
+		case SYS_disk_reap:
+			return sys_disk_reap(a1);
+		case SYS_disk_info:
+			return sys_disk_info((struct diskinfo *) a1);
 		default:
 			return -E_INVAL;
 		}
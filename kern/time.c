@@ -1,8 +1,18 @@
 #include <kern/time.h>
+#include <kern/env.h>
 #include <inc/assert.h>
+#include <inc/error.h>
+
+#define MAXSLEEPERS 32
 
 static unsigned int ticks;
 
+// Envs in sys_sleep, and when each is to wake.
+static struct {
+	envid_t envid;		// 0 if the slot is free
+	unsigned int wake;
+} sleepers[MAXSLEEPERS];
+
 void
 time_init(void)
 {
@@ -14,9 +24,38 @@ time_init(void)
 void
 time_tick(void)
 {
+	struct Env *e;
+	int i;
+
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+	for (i = 0; i < MAXSLEEPERS; i++) {
+		if (sleepers[i].envid == 0
+		    || (int) (time_msec() - sleepers[i].wake) < 0)
+			continue;
+		if (envid2env(sleepers[i].envid, &e, 0) == 0
+		    && e->env_status == ENV_NOT_RUNNABLE)
+			e->env_status = ENV_RUNNABLE;
+		sleepers[i].envid = 0;
+	}
+}
+
+// Put e to sleep for at least msec milliseconds.  Returns -E_NO_MEM if
+// too many envs are asleep already.
+int
+time_sleep(struct Env *e, unsigned int msec)
+{
+	int i;
+
+	for (i = 0; i < MAXSLEEPERS; i++)
+		if (sleepers[i].envid == 0 || sleepers[i].envid == e->env_id) {
+			sleepers[i].envid = e->env_id;
+			sleepers[i].wake = time_msec() + msec;
+			e->env_status = ENV_NOT_RUNNABLE;
+			return 0;
+		}
+	return -E_NO_MEM;
 }
 
 unsigned int
@@ -4,8 +4,11 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
+int time_sleep(struct Env *e, unsigned int msec);
 
 #endif /* JOS_KERN_TIME_H */
@@ -14,6 +14,10 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/ahci.h>
+#include <kern/virtio_blk.h>
 
 extern uintptr_t gdtdesc_64;
 struct Taskstate ts;
@@ -223,6 +227,27 @@ trap_dispatch(struct Trapframe *tf)
 	}
 	
 
+	// The e1000 and the disk controllers may share a line, so each
+	// checks whether the interrupt is its own.
+	if ((e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq)
+	    || (ahci_irq && tf->tf_trapno == IRQ_OFFSET + ahci_irq)
+	    || (virtio_blk_irq && tf->tf_trapno == IRQ_OFFSET + virtio_blk_irq)) {
+		if (e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq)
+			e1000_intr();
+		if (ahci_irq && tf->tf_trapno == IRQ_OFFSET + ahci_irq)
+			ahci_intr();
+		if (virtio_blk_irq && tf->tf_trapno == IRQ_OFFSET + virtio_blk_irq)
+			virtio_blk_intr();
+		irq_eoi();
+		return;
+	}
+
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_IDE) {
+		ide_intr();
+		irq_eoi();
+		return;
+	}
+
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
 	// IRQ line or other reasons. We don't care.
@@ -0,0 +1,286 @@
+// virtio-blk driver for the file system server's disk, through the
+// legacy PCI interface QEMU offers with 'if=virtio'.  Like AHCI it sits
+// behind sys_disk_* (see kern/disk.h), with a tag per transfer, but a
+// transfer costs QEMU a ring entry and at most one I/O port write
+// rather than a trap per register.
+//
+// There is one virtqueue.  Each slot owns the descriptors its
+// transfers use: an indirect table of its own if the device takes
+// them, so that a whole transfer is one ring entry, or else a fixed
+// stretch of the ring.  A submit makes its chain visible with one
+// store to avail->idx and rings the doorbell only if the device hasn't
+// said it's still busy reading the ring.  Interrupts are asked for
+// only while an env is asleep in virtio_blk_reap; otherwise
+// completions are picked up from the used ring whenever we look.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/virtio_blk.h>
+#include <kern/disk.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define SECTSIZE	512
+#define NSLOTS		32
+#define MAXPAGES	(DISK_MAXSECS * SECTSIZE / PGSIZE)
+// A transfer's chain: the header, a descriptor per page, the status.
+#define CHAINLEN	(MAXPAGES + 2)
+
+// Largest ring we have room for, and the room: the descriptors and
+// the available ring, then the used ring on a page of its own.
+#define QMAX		256
+#define PGALIGN(x)	(((x) + PGSIZE - 1) / PGSIZE * PGSIZE)
+#define VRING_BYTES(n)	(PGALIGN(16 * (n) + 6 + 2 * (n)) + PGALIGN(6 + 8 * (n)))
+
+uint8_t virtio_blk_irq;
+
+static uint32_t iobase;
+static uint16_t qsize;
+static bool indirect;
+
+static uint8_t vring[VRING_BYTES(QMAX)] __attribute__((aligned(PGSIZE)));
+static volatile struct vring_desc *desc;
+static volatile struct vring_avail *avail;
+static volatile struct vring_used *used;
+static uint16_t used_idx;		// How far we've read the used ring
+
+static struct vring_desc itable[NSLOTS][CHAINLEN] __attribute__((aligned(16)));
+static struct virtio_blk_hdr hdr[NSLOTS];
+static volatile uint8_t status[NSLOTS];
+
+static struct slot {
+	bool busy;		// Holds a transfer not yet reaped
+	bool done;		// which is over, with 'result'
+	int result;
+	envid_t owner;
+	envid_t waiter;		// Asleep in virtio_blk_reap, or 0
+	int npages;
+	struct PageInfo *pages[MAXPAGES];	// Held until it's over
+} slots[NSLOTS];
+static int nwaiting;		// Slots with a waiter
+
+static int virtio_blk_submit(struct Env *e, int diskno, uint32_t secno,
+			     void *va, size_t nsecs, bool write);
+static int virtio_blk_reap(struct Env *e, int tag);
+
+static struct disk_driver virtio_blk_driver = {
+	{ DISK_VIRTIO, 1, 0 }, virtio_blk_submit, virtio_blk_reap
+};
+
+int
+pci_virtio_blk_attach(struct pci_func *pcif)
+{
+	uint32_t features;
+
+	pci_func_enable(pcif);
+	iobase = pcif->reg_base[0];
+	outb(iobase + VIRTIO_PCI_STATUS, 0);	// Reset
+	outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	features = inl(iobase + VIRTIO_PCI_HOST_FEATURES);
+	indirect = (features & VIRTIO_RING_F_INDIRECT_DESC) != 0;
+	outl(iobase + VIRTIO_PCI_GUEST_FEATURES,
+	     indirect ? VIRTIO_RING_F_INDIRECT_DESC : 0);
+
+	outw(iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+	qsize = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+	virtio_blk_driver.info.di_slots =
+		MIN(NSLOTS, indirect ? qsize : qsize / CHAINLEN);
+	if (qsize > QMAX || virtio_blk_driver.info.di_slots == 0) {
+		cprintf("virtio-blk: can't use a ring of %d\n", qsize);
+		outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+		iobase = 0;
+		return 0;
+	}
+	memset(vring, 0, sizeof(vring));
+	desc = (struct vring_desc *) vring;
+	avail = (struct vring_avail *) (vring + 16 * qsize);
+	used = (struct vring_used *) (vring + PGALIGN(16 * qsize + 6 + 2 * qsize));
+	avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	outl(iobase + VIRTIO_PCI_QUEUE_PFN, PADDR(vring) >> PGSHIFT);
+
+	virtio_blk_driver.info.di_nsecs =
+		inl(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY)
+		| ((uint64_t) inl(iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+	outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+	     | VIRTIO_STATUS_DRIVER_OK);
+
+	// No IOAPIC here; INTx goes through the 8259A, as for the e1000.
+	virtio_blk_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << virtio_blk_irq));
+
+	cprintf("virtio-blk: %llu sectors, ring of %d, %d slots%s\n",
+		(unsigned long long) virtio_blk_driver.info.di_nsecs, qsize,
+		virtio_blk_driver.info.di_slots, indirect ? ", indirect" : "");
+	disk_register(&virtio_blk_driver);
+	return 1;
+}
+
+static void
+slot_release(struct slot *s)
+{
+	int i;
+
+	for (i = 0; i < s->npages; i++)
+		page_decref(s->pages[i]);
+	s->npages = 0;
+}
+
+static void
+slot_done(struct slot *s, int result)
+{
+	struct Env *e;
+
+	slot_release(s);
+	s->result = result;
+	s->done = true;
+	if (s->waiter) {
+		nwaiting--;
+		if (envid2env(s->waiter, &e, 0) == 0
+		    && e->env_status == ENV_NOT_RUNNABLE)
+			e->env_status = ENV_RUNNABLE;
+	}
+	s->waiter = 0;
+}
+
+// Finish every transfer the device has put on the used ring since we
+// last looked, and stop asking for interrupts if no one's waiting.
+static void
+harvest(void)
+{
+	int tag;
+
+	while (used_idx != used->idx) {
+		__sync_synchronize();
+		tag = used->ring[used_idx % qsize].id / (indirect ? 1 : CHAINLEN);
+		used_idx++;
+		slot_done(&slots[tag], status[tag] == VIRTIO_BLK_S_OK ? 0 : -E_UNSPECIFIED);
+	}
+	if (nwaiting == 0)
+		avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+// Start a transfer in a free slot and return the slot as its tag.
+// 'diskno' means nothing here: there's one disk.  Errors are as for
+// ide_dma_submit.
+static int
+virtio_blk_submit(struct Env *e, int diskno, uint32_t secno, void *va,
+		  size_t nsecs, bool write)
+{
+	struct slot *s = NULL;
+	struct vring_desc *chain;
+	struct Env *owner;
+	struct PageInfo *pp;
+	pte_t *pte;
+	uint16_t base, head;
+	int i, n, tag;
+
+	if (nsecs == 0 || nsecs > DISK_MAXSECS || nsecs % (PGSIZE / SECTSIZE)
+	    || (uintptr_t) va % PGSIZE || (uintptr_t) va + nsecs * SECTSIZE > UTOP)
+		return -E_INVAL;
+	// Done transfers may be on the used ring still; taking them in
+	// frees their slots.
+	harvest();
+	// A finished transfer whose env is gone won't be reaped.
+	for (tag = 0; tag < virtio_blk_driver.info.di_slots; tag++) {
+		s = &slots[tag];
+		if (!s->busy || (s->done && envid2env(s->owner, &owner, 0) < 0))
+			break;
+	}
+	if (tag == virtio_blk_driver.info.di_slots)
+		return -E_AGAIN;
+
+	// With indirect descriptors the chain is in the slot's own table
+	// and links within it; otherwise it's the slot's part of the ring.
+	chain = indirect ? itable[tag] : (struct vring_desc *) &desc[tag * CHAINLEN];
+	base = indirect ? 0 : tag * CHAINLEN;
+
+	n = nsecs / (PGSIZE / SECTSIZE);
+	s->npages = 0;
+	for (i = 0; i < n; i++) {
+		pp = page_lookup(e->env_pml4e, va + i * PGSIZE, &pte);
+		if (!pp || !(*pte & PTE_U) || (!write && !(*pte & PTE_W))) {
+			slot_release(s);
+			return -E_FAULT;
+		}
+		pp->pp_ref++;
+		s->pages[s->npages++] = pp;
+		chain[1 + i].addr = page2pa(pp);
+		chain[1 + i].len = PGSIZE;
+		chain[1 + i].flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+		chain[1 + i].next = base + 2 + i;
+	}
+	hdr[tag].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	hdr[tag].reserved = 0;
+	hdr[tag].sector = secno;
+	status[tag] = 0xFF;
+	chain[0].addr = PADDR(&hdr[tag]);
+	chain[0].len = sizeof(hdr[tag]);
+	chain[0].flags = VRING_DESC_F_NEXT;
+	chain[0].next = base + 1;
+	chain[n + 1].addr = PADDR((void *) &status[tag]);
+	chain[n + 1].len = 1;
+	chain[n + 1].flags = VRING_DESC_F_WRITE;
+	chain[n + 1].next = 0;
+	if (indirect) {
+		desc[tag].addr = PADDR(itable[tag]);
+		desc[tag].len = (n + 2) * sizeof(struct vring_desc);
+		desc[tag].flags = VRING_DESC_F_INDIRECT;
+		desc[tag].next = 0;
+		head = tag;
+	} else
+		head = base;
+
+	s->busy = true;
+	s->done = false;
+	s->owner = e->env_id;
+	s->waiter = 0;
+
+	avail->ring[avail->idx % qsize] = head;
+	__sync_synchronize();
+	avail->idx++;
+	__sync_synchronize();
+	if (!(used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	return tag;
+}
+
+static int
+virtio_blk_reap(struct Env *e, int tag)
+{
+	struct slot *s;
+
+	if (tag < 0 || tag >= NSLOTS)
+		return -E_INVAL;
+	s = &slots[tag];
+	if (!s->busy || s->owner != e->env_id)
+		return -E_INVAL;
+	if (!s->done)
+		harvest();
+	if (!s->done) {
+		s->waiter = e->env_id;
+		nwaiting++;
+		avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+		// It may have finished before the device saw the flag go.
+		__sync_synchronize();
+		harvest();
+	}
+	if (!s->done) {
+		e->env_status = ENV_NOT_RUNNABLE;
+		return -E_AGAIN;
+	}
+	s->busy = false;
+	return s->result;
+}
+
+// Interrupt handler for virtio_blk_irq, which other devices may share.
+void
+virtio_blk_intr(void)
+{
+	if (!iobase || !(inb(iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE))
+		return;
+	harvest();
+}
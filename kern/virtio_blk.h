@@ -0,0 +1,81 @@
+#ifndef JOS_KERN_VIRTIO_BLK_H
+#define JOS_KERN_VIRTIO_BLK_H
+
+#include <inc/types.h>
+#include <kern/pci.h>
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_DEV_BLK		0x1001	/* Transitional virtio-blk */
+
+/* Legacy virtio registers, in I/O space at BAR 0 */
+#define VIRTIO_PCI_HOST_FEATURES	0x00
+#define VIRTIO_PCI_GUEST_FEATURES	0x04
+#define VIRTIO_PCI_QUEUE_PFN		0x08	/* Ring address >> 12 */
+#define VIRTIO_PCI_QUEUE_NUM		0x0C	/* Ring size, set by the device */
+#define VIRTIO_PCI_QUEUE_SEL		0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10
+#define VIRTIO_PCI_STATUS		0x12
+#define VIRTIO_PCI_ISR			0x13	/* Reading it clears it */
+#define VIRTIO_PCI_CONFIG		0x14	/* Device config, MSI-X off */
+
+#define VIRTIO_STATUS_ACK		0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VIRTIO_ISR_QUEUE		0x01
+
+#define VIRTIO_RING_F_INDIRECT_DESC	(1u << 28)
+
+/* Ring pieces; the used ring starts on the page after the rest */
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+#define VRING_DESC_F_NEXT	0x1
+#define VRING_DESC_F_WRITE	0x2	/* The device writes this buffer */
+#define VRING_DESC_F_INDIRECT	0x4	/* The buffer is a table of descriptors */
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+#define VRING_AVAIL_F_NO_INTERRUPT	0x1
+
+struct vring_used_elem {
+	uint32_t id;		/* Head of the chain */
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+#define VRING_USED_F_NO_NOTIFY		0x1
+
+/* A request starts with this header and ends with a status byte */
+struct virtio_blk_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+/* virtio-blk config: the size in sectors, 64 bits */
+#define VIRTIO_BLK_CFG_CAPACITY	0x00
+
+int	pci_virtio_blk_attach(struct pci_func *pcif);
+void	virtio_blk_intr(void);
+extern uint8_t virtio_blk_irq;
+
+#endif	// !JOS_KERN_VIRTIO_BLK_H
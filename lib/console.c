@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*, int);
 
 struct Dev devcons =
 {
@@ -46,9 +47,14 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
+// A character devcons_poll took off the console to see if there was
+// one; the next devcons_read returns it.
+static int peeked;
+
 int
 iscons(int fdnum)
 {
@@ -83,8 +89,11 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	if ((c = peeked) != 0)
+		peeked = 0;
+	else
+		while ((c = sys_cgetc()) == 0)
+			sys_yield();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -119,6 +128,14 @@ devcons_close(struct Fd *fd)
 	return 0;
 }
 
+static int
+devcons_poll(struct Fd *fd, int events)
+{
+	if (peeked == 0 && (events & POLLIN))
+		peeked = sys_cgetc();
+	return events & ((peeked != 0 ? POLLIN : 0) | POLLOUT);
+}
+
 static int
 devcons_stat(struct Fd *fd, struct Stat *stat)
 {
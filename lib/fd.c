@@ -3,7 +3,7 @@
 #define debug		1
 
 // Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
+#define MAXFD		256
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -308,6 +308,27 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// Only F_GETFL and F_SETFL, and the only flag F_SETFL changes is
+// O_NONBLOCK.
+int
+fcntl(int fdnum, int cmd, int arg)
+{
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	switch (cmd) {
+	case F_GETFL:
+		return fd->fd_omode;
+	case F_SETFL:
+		fd->fd_omode = (fd->fd_omode & ~O_NONBLOCK) | (arg & O_NONBLOCK);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
 int
 stat(const char *path, struct Stat *stat)
 {
@@ -160,7 +160,11 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	}
 	memcpy(fsipcbuf.write.req_buf, buf, write_size);
 	// We cannot map it to uh like UTEMP, because on server, pg seems to always be NULLu unless type is 1 (see server function)
-	int32_t ret = fsipc(FSREQ_WRITE, NULL);
+	// -E_AGAIN: the server grew the file as far as one request may
+	// before it can write; ask again.
+	int32_t ret;
+	while ((ret = fsipc(FSREQ_WRITE, NULL)) == -E_AGAIN)
+		;
 	if(ret < 0) {
 		return ret;
 	}
@@ -186,9 +190,14 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
+	int r;
+
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	// Growing a file can take more than one request (see ext_grow).
+	while ((r = fsipc(FSREQ_SET_SIZE, NULL)) == -E_AGAIN)
+		;
+	return r;
 }
 
 // Delete a file
@@ -211,6 +220,71 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Fetch the file server's block cache counters.
+int
+fs_bcstats(struct Fsret_bcstats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_BCSTATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.bcstatsRet;
+	return 0;
+}
+
+// Map the block of file 'fdnum' holding byte 'offset' read-only at
+// 'dstva'.  This is the file server's cached copy of the block, not a
+// snapshot: later writes to the file show through.  Returns the number
+// of file bytes on the page from 'offset' on (0 at end of file), or
+// < 0 on error.
+int
+fmap(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, dstva);
+}
+
+// Where sendfile maps each block on its way through.
+#define SENDFILEVA	0x0fffe000
+
+// Write 'count' bytes of file 'infd' from 'offset' on to 'outfd'
+// straight from the file server's block cache, without reading them
+// into a buffer first.  A socket passes whole blocks on to ns the same
+// way (see nsipc_send), so the data is never copied before lwIP has
+// it.  Returns the number of bytes written, short at end of file or
+// on a short write, or < 0 if nothing could be.
+ssize_t
+sendfile(int outfd, int infd, off_t offset, size_t count)
+{
+	size_t tot;
+	int m, r = 0;
+
+	for (tot = 0; tot < count; tot += r) {
+		m = fmap(infd, offset + tot, (void *) SENDFILEVA);
+		if (m <= 0) {
+			r = m;
+			break;
+		}
+		m = MIN(m, count - tot);
+		r = write(outfd, (char *) SENDFILEVA + (offset + tot) % BLKSIZE, m);
+		sys_page_unmap(0, (void *) SENDFILEVA);
+		if (r < m) {
+			if (r > 0)
+				tot += r;
+			break;
+		}
+	}
+	return tot ? tot : r;
+}
+
 //Copy a file from src to dest
 int
 copy(char *src, char *dest)
@@ -169,6 +169,41 @@ fork(void)
     }
 }
 
+//
+// Make our page at 'va' copy-on-write, as fork does for the pages it
+// shares, so that another env can be handed a read-only mapping of it
+// without seeing our later writes.  The page must be mapped.
+//
+int
+page_cow(void *va)
+{
+	int permission = (uvpt[((int64_t)va >> PGSHIFT)] & PTE_USER);
+
+	set_pgfault_handler(pgfault);
+	if (!(permission & PTE_W))
+		return 0;
+	return sys_page_map(0, va, 0, va, PTE_P|PTE_U|PTE_COW);
+}
+
+// Fork 'n' - 1 copies of ourselves, for a server whose workers share
+// what it has set up so far, such as a listening socket.  Returns which
+// worker the caller is, 0 in the original env, or < 0 if a fork failed
+// (the workers already forked keep running).
+int
+prefork(int n)
+{
+	envid_t who;
+	int i;
+
+	for (i = 1; i < n; i++) {
+		if ((who = fork()) < 0)
+			return who;
+		if (who == 0)
+			return i;
+	}
+	return 0;
+}
+
 // Challenge!
 int
 sfork(void)
@@ -8,115 +8,408 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
-// The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
+// The network server's shards (see net/serv.c), found on first use.
+// That may be in the middle of a request, so the query has a page of
+// its own rather than clobber nsipcbuf.
+static envid_t nsenvs[NS_MAXSHARDS];
+static int nshards;
+static union Nsipc shardsbuf __attribute__((aligned(PGSIZE)));
+
+static void
+nsipc_init(void)
+{
+	int r;
+
+	nsenvs[0] = ipc_find_env(ENV_TYPE_NS);
+	nshards = 1;
+	ipc_send(nsenvs[0], NSREQ_SHARDS, &shardsbuf, PTE_P|PTE_W|PTE_U);
+	if ((r = ipc_recv(NULL, NULL, NULL)) > 1) {
+		nshards = MIN(r, NS_MAXSHARDS);
+		memmove(nsenvs, shardsbuf.shardsRet.ret_envids, nshards * sizeof(envid_t));
+	}
+}
+
+// Send an IP request to network server shard 'shard', and wait for a
+// reply.  The request body should be in nsipcbuf, and parts of the
+// response may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc(int shard, unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
+	if (nshards == 0)
+		nsipc_init();
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
+		cprintf("[%08x] nsipc %d to shard %d\n", thisenv->env_id, type, shard);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsenvs[shard], type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
+// Number of network server shards.
 int
-nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+nsipc_nshards(void)
+{
+	if (nshards == 0)
+		nsipc_init();
+	return nshards;
+}
+
+// Poll n sockets, all on shard 'shard', waiting up to 'timeout' ms
+// (< 0: no limit) for one of them to be ready.  Fills in the revents
+// and returns how many are ready.
+int
+nsipc_poll(int shard, struct Nspollfd *fds, int n, int timeout)
+{
+	int r;
+
+	assert(n <= NSPOLL_MAX);
+	nsipcbuf.poll.req_n = n;
+	nsipcbuf.poll.req_timeout = timeout;
+	memmove(nsipcbuf.poll.req_fds, fds, n * sizeof(*fds));
+	if ((r = nsipc(shard, NSREQ_POLL)) >= 0)
+		memmove(fds, nsipcbuf.poll.req_fds, n * sizeof(*fds));
+	return r;
+}
+
+// Read shard 'shard's request page pool counters into *st.
+int
+nsipc_stats(int shard, struct Nsret_stats *st)
+{
+	int r;
+
+	if ((r = nsipc(shard, NSREQ_STATS)) >= 0)
+		memmove(st, &nsipcbuf.statsRet, sizeof(*st));
+	return r;
+}
+
+static int
+nsipc_accept_flags(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
 {
 	int r;
 
-	nsipcbuf.accept.req_s = s;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0) {
+	nsipcbuf.accept.req_s = NS_SOCKID_LOCAL(s);
+	nsipcbuf.accept.req_flags = flags;
+	if ((r = nsipc(NS_SOCKID_SHARD(s), NSREQ_ACCEPT)) >= 0) {
 		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
+		r = NS_SOCKID(NS_SOCKID_SHARD(s), r);
 	}
 	return r;
 }
 
+int
+nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return nsipc_accept_flags(s, addr, addrlen, 0);
+}
+
+// Like nsipc_accept, but returns -E_AGAIN if no connection is waiting.
+int
+nsipc_try_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return nsipc_accept_flags(s, addr, addrlen, MSG_DONTWAIT);
+}
+
 int
 nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.bind.req_s = s;
+	nsipcbuf.bind.req_s = NS_SOCKID_LOCAL(s);
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_BIND);
 }
 
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
+	nsipcbuf.shutdown.req_s = NS_SOCKID_LOCAL(s);
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_SHUTDOWN);
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	nsipcbuf.close.req_s = NS_SOCKID_LOCAL(s);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_CLOSE);
 }
 
 int
 nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.connect.req_s = s;
+	nsipcbuf.connect.req_s = NS_SOCKID_LOCAL(s);
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_CONNECT);
 }
 
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
+	nsipcbuf.listen.req_s = NS_SOCKID_LOCAL(s);
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_LISTEN);
 }
 
-int
-nsipc_recv(int s, void *mem, int len, unsigned int flags)
+// Whether our page at 'va' is mapped and not PTE_SHARE, so that it can
+// be lent to ns or have ns's page mapped over it.
+static bool
+page_private(const void *va)
 {
-	int r;
+	uintptr_t a = (uintptr_t) va;
+
+	return (uvpml4e[VPML4E(a)] & PTE_P) && (uvpde[VPDPE(a)] & PTE_P)
+		&& (uvpd[VPD(a)] & PTE_P) && (uvpt[PGNUM(a)] & PTE_P)
+		&& !(uvpt[PGNUM(a)] & PTE_SHARE);
+}
+
+// One recv request: up to a page.  For a whole page-aligned page of
+// buffer, ask ns to send a full page of data back as a page and map it
+// right over the buffer.
+static int
+nsipc_recv1(int s, void *mem, int len, unsigned int flags)
+{
+	int r, perm = 0;
 
-	nsipcbuf.recv.req_s = s;
+	nsipcbuf.recv.req_s = NS_SOCKID_LOCAL(s);
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+	if (len >= PGSIZE && (uintptr_t) mem % PGSIZE == 0 && page_private(mem)) {
+		if (nshards == 0)
+			nsipc_init();
+		ipc_send(nsenvs[NS_SOCKID_SHARD(s)], NSREQ_RECV_PAGE, &nsipcbuf,
+			 PTE_P|PTE_W|PTE_U);
+		r = ipc_recv(NULL, mem, &perm);
+		if (perm & PTE_P) {
+			assert(r == PGSIZE);
+			return r;
+		}
+	} else
+		r = nsipc(NS_SOCKID_SHARD(s), NSREQ_RECV);
+
+	if (r >= 0) {
+		assert(r <= PGSIZE && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
-
 	return r;
 }
 
+// Receive up to 'len' bytes, a page per request.  Only the first
+// request waits for data; the rest take whatever is already there.
 int
-nsipc_send(int s, const void *buf, int size, unsigned int flags)
+nsipc_recv(int s, void *mem, int len, unsigned int flags)
+{
+	int r, n, got = 0;
+
+	while (got < len) {
+		n = MIN(len - got, PGSIZE);
+		r = nsipc_recv1(s, (char *) mem + got, n,
+				got ? flags | MSG_DONTWAIT : flags);
+		if (r <= 0)
+			return got ? got : r;
+		got += r;
+		if (r < n)
+			break;
+	}
+	return got;
+}
+
+// Lend ns the page at 'pg' to send from.  It's made copy-on-write
+// first: ns keeps the page until the data is acknowledged, and our own
+// writes meanwhile must go to a copy.
+static int
+nsipc_sendpage(int s, const void *pg)
 {
-	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
+	int r;
+
+	if (nshards == 0)
+		nsipc_init();
+	if ((r = page_cow((void *) pg)) < 0)
+		return r;
+	if (debug)
+		cprintf("[%08x] nsipc sendpage to shard %d\n", thisenv->env_id,
+			NS_SOCKID_SHARD(s));
+	ipc_send(nsenvs[NS_SOCKID_SHARD(s)],
+		 NSREQ_SENDPAGE_BIT | NS_SOCKID_LOCAL(s), (void *) pg, PTE_P|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+static int
+nsipc_send1(int s, const void *buf, int size, unsigned int flags)
+{
+	nsipcbuf.send.req_s = NS_SOCKID_LOCAL(s);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_SEND);
 }
 
+// Send 'size' bytes.  Whole, page-aligned pages of a blocking send are
+// lent to ns rather than copied (see nsipc_sendpage); the rest is
+// copied, at most a request page at a time, and only up to the next
+// page boundary when that lets the following pages be lent.
 int
-nsipc_socket(int domain, int type, int protocol)
+nsipc_send(int s, const void *buf, int size, unsigned int flags)
+{
+	const char *p = buf;
+	int r, n, off, sent = 0;
+
+	while (sent < size) {
+		n = size - sent;
+		off = (uintptr_t) (p + sent) % PGSIZE;
+		if (n >= PGSIZE && off == 0 && !(flags & MSG_DONTWAIT)
+		    && page_private(p + sent)) {
+			n = PGSIZE;
+			r = nsipc_sendpage(s, p + sent);
+		} else {
+			n = MIN(n, PGSIZE - sizeof(struct Nsreq_send));
+			if (off && size - sent - (PGSIZE - off) >= PGSIZE)
+				n = MIN(n, PGSIZE - off);
+			r = nsipc_send1(s, p + sent, n, flags);
+		}
+		if (r <= 0)
+			return sent ? sent : r;
+		sent += r;
+		if (r < n)
+			break;
+	}
+	return sent;
+}
+
+// Send one datagram of 'size' bytes to 'to'.
+int
+nsipc_sendto(int s, const void *buf, int size, unsigned int flags,
+	     const struct sockaddr *to, socklen_t tolen)
+{
+	if (size > PGSIZE - sizeof(struct Nsreq_sendto)
+	    || tolen > sizeof(nsipcbuf.sendto.req_to))
+		return -E_INVAL;
+	nsipcbuf.sendto.req_s = NS_SOCKID_LOCAL(s);
+	nsipcbuf.sendto.req_size = size;
+	nsipcbuf.sendto.req_flags = flags;
+	memmove(&nsipcbuf.sendto.req_to, to, tolen);
+	nsipcbuf.sendto.req_tolen = tolen;
+	memmove(nsipcbuf.sendto.req_buf, buf, size);
+	return nsipc(NS_SOCKID_SHARD(s), NSREQ_SENDTO);
+}
+
+// Receive one datagram, up to 'len' bytes of it, and who sent it.
+int
+nsipc_recvfrom(int s, void *mem, int len, unsigned int flags,
+	       struct sockaddr *from, socklen_t *fromlen)
+{
+	struct Nsret_recvfrom *ret = &nsipcbuf.recvfromRet;
+	int r;
+
+	nsipcbuf.recv.req_s = NS_SOCKID_LOCAL(s);
+	nsipcbuf.recv.req_len = MIN(len, PGSIZE - sizeof(*ret));
+	nsipcbuf.recv.req_flags = flags;
+	if ((r = nsipc(NS_SOCKID_SHARD(s), NSREQ_RECVFROM)) < 0)
+		return r;
+	memmove(mem, ret->ret_buf, r);
+	if (from) {
+		*fromlen = MIN(*fromlen, ret->ret_fromlen);
+		memmove(from, &ret->ret_from, *fromlen);
+	}
+	return r;
+}
+
+// Send the datagrams msgs[0..n-1], as many to a request page as fit.
+// Returns how many were sent.
+int
+nsipc_sendmmsg(int s, struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Nsreq_mmsg *m = &nsipcbuf.mmsg;
+	struct Nsdgram *d;
+	int r, sent = 0;
+
+	while (sent < n) {
+		m->req_s = NS_SOCKID_LOCAL(s);
+		m->req_flags = flags;
+		m->req_count = 0;
+		m->req_used = 0;
+		for (d = NSMMSG_FIRST(m); sent + m->req_count < n; d = NSMMSG_NEXT(d)) {
+			struct mmsg *mp = &msgs[sent + m->req_count];
+			if (!NSMMSG_FITS(m, mp->msg_len))
+				break;
+			d->nd_addr = mp->msg_addr.sin_addr.s_addr;
+			d->nd_port = mp->msg_addr.sin_port;
+			d->nd_len = mp->msg_len;
+			memmove(d->nd_data, mp->msg_buf, mp->msg_len);
+			m->req_used += NSDGRAM_SIZE(d->nd_len);
+			m->req_count++;
+		}
+		if (m->req_count == 0)
+			return sent ? sent : -E_INVAL;
+		if ((r = nsipc(NS_SOCKID_SHARD(s), NSREQ_SENDMMSG)) <= 0)
+			return sent ? sent : r;
+		sent += r;
+		if (r < m->req_count)
+			break;
+	}
+	return sent;
+}
+
+// Receive up to n datagrams into msgs, all in one request: whatever is
+// there once there is something.  Each msg_len goes in as the size of
+// msg_buf and comes out as the bytes received.  Returns how many
+// datagrams were received.
+int
+nsipc_recvmmsg(int s, struct mmsg *msgs, int n, unsigned int flags)
+{
+	struct Nsreq_mmsg *m = &nsipcbuf.mmsg;
+	struct Nsdgram *d;
+	int i, r, maxlen = 0;
+
+	for (i = 0; i < n; i++)
+		maxlen = MAX(maxlen, (int) msgs[i].msg_len);
+	m->req_s = NS_SOCKID_LOCAL(s);
+	m->req_flags = flags;
+	m->req_count = n;
+	m->req_maxlen = maxlen;
+	if ((r = nsipc(NS_SOCKID_SHARD(s), NSREQ_RECVMMSG)) <= 0)
+		return r;
+	for (i = 0, d = NSMMSG_FIRST(m); i < r; i++, d = NSMMSG_NEXT(d)) {
+		struct mmsg *mp = &msgs[i];
+		mp->msg_len = MIN(mp->msg_len, d->nd_len);
+		memmove(mp->msg_buf, d->nd_data, mp->msg_len);
+		memset(&mp->msg_addr, 0, sizeof(mp->msg_addr));
+		mp->msg_addr.sin_len = sizeof(mp->msg_addr);
+		mp->msg_addr.sin_family = AF_INET;
+		mp->msg_addr.sin_port = d->nd_port;
+		mp->msg_addr.sin_addr.s_addr = d->nd_addr;
+	}
+	return r;
+}
+
+// Create a socket on shard 'shard'.
+int
+nsipc_socket_on(int shard, int domain, int type, int protocol)
 {
+	int r;
+
 	nsipcbuf.socket.req_domain = domain;
 	nsipcbuf.socket.req_type = type;
 	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	if ((r = nsipc(shard, NSREQ_SOCKET)) >= 0)
+		r = NS_SOCKID(shard, r);
+	return r;
+}
+
+// TCP sockets are spread over the shards by environment.  Everything
+// else lives on shard 0, which is where the card puts non-TCP frames.
+int
+nsipc_socket(int domain, int type, int protocol)
+{
+	int shard = 0;
+
+	if (type == SOCK_STREAM)
+		shard = ENVX(thisenv->env_id) % nsipc_nshards();
+	return nsipc_socket_on(shard, domain, type, protocol);
 }
@@ -6,6 +6,7 @@ static ssize_t devpipe_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devpipe_write(struct Fd *fd, const void *buf, size_t n);
 static int devpipe_stat(struct Fd *fd, struct Stat *stat);
 static int devpipe_close(struct Fd *fd);
+static int devpipe_poll(struct Fd *fd, int events);
 
 struct Dev devpipe =
 {
@@ -15,6 +16,7 @@ struct Dev devpipe =
 	.dev_write =	devpipe_write,
 	.dev_close =	devpipe_close,
 	.dev_stat =	devpipe_stat,
+	.dev_poll =	devpipe_poll,
 };
 
 #define PIPEBUFSIZ 32		// small to provoke races
@@ -171,6 +173,24 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 	return i;
 }
 
+// Reading an empty pipe or writing a full one would block, unless the
+// other end is gone, in which case it returns 0 right away.
+static int
+devpipe_poll(struct Fd *fd, int events)
+{
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	int r = 0;
+
+	if (p->p_rpos != p->p_wpos)
+		r |= POLLIN;
+	if (p->p_wpos < p->p_rpos + sizeof(p->p_buf))
+		r |= POLLOUT;
+	r &= events;
+	if (_pipeisclosed(fd, p))
+		r |= POLLHUP | (events & (POLLIN | POLLOUT));
+	return r;
+}
+
 static int
 devpipe_stat(struct Fd *fd, struct Stat *stat)
 {
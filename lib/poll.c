@@ -0,0 +1,106 @@
+#include <inc/lib.h>
+
+// The sockets of a poll() set go to ns in one NSREQ_POLL per shard,
+// which answers for all of them at once.  ns can wait for them itself
+// when they're all it has to watch; otherwise we check every source
+// in turn and yield between rounds.
+
+struct shardpoll {
+	int n;
+	struct Nspollfd fds[NSPOLL_MAX];
+	int idx[NSPOLL_MAX];	// Which pollfd each socket is for
+};
+
+static struct shardpoll shards[NS_MAXSHARDS];
+
+// Add socket 'id' to its shard's batch, for fds[i].
+static int
+poll_addsock(int id, int i, short events)
+{
+	struct shardpoll *sp = &shards[NS_SOCKID_SHARD(id)];
+
+	if (sp->n == NSPOLL_MAX)
+		return -E_NO_MEM;
+	sp->fds[sp->n].s = NS_SOCKID_LOCAL(id);
+	sp->fds[sp->n].events = events;
+	sp->fds[sp->n].revents = 0;
+	sp->idx[sp->n++] = i;
+	return 0;
+}
+
+// Check every fd once, asking ns to wait up to 'timeout' ms if it can.
+// Returns the number of fds with something in revents.
+static int
+poll_once(struct pollfd *fds, int nfds, int timeout)
+{
+	struct Fd *fd;
+	struct Dev *dev;
+	int i, j, k, r, nready = 0, nshards = 0, nother = 0;
+
+	for (k = 0; k < NS_MAXSHARDS; k++)
+		shards[k].n = 0;
+	for (i = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+			continue;
+		if (fd_lookup(fds[i].fd, &fd) < 0
+		    || dev_lookup(fd->fd_dev_id, &dev) < 0)
+			fds[i].revents = POLLNVAL;
+		else if (dev == &devsock) {
+			// A replicated listener is ready if any replica is.
+			if ((r = poll_addsock(fd->fd_sock.sockid, i, fds[i].events)) < 0)
+				return r;
+			for (j = 0; j < fd->fd_sock.npeers; j++)
+				if ((r = poll_addsock(fd->fd_sock.peers[j], i, fds[i].events)) < 0)
+					return r;
+			continue;
+		} else if (dev->dev_poll) {
+			fds[i].revents = dev->dev_poll(fd, fds[i].events);
+			nother++;
+		} else
+			fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+		if (fds[i].revents)
+			nready++;
+	}
+
+	for (k = 0; k < NS_MAXSHARDS; k++)
+		nshards += shards[k].n > 0;
+	if (nready || nother || nshards > 1)
+		timeout = 0;
+	for (k = 0; k < NS_MAXSHARDS; k++) {
+		struct shardpoll *sp = &shards[k];
+		if (sp->n == 0)
+			continue;
+		if ((r = nsipc_poll(k, sp->fds, sp->n, timeout)) < 0)
+			return r;
+		for (j = 0; j < sp->n; j++) {
+			i = sp->idx[j];
+			if (sp->fds[j].revents && !fds[i].revents)
+				nready++;
+			fds[i].revents |= sp->fds[j].revents;
+		}
+	}
+	return nready;
+}
+
+// Wait until one of fds is ready for its events, or 'timeout' ms
+// (< 0: no limit) have gone by.  Returns the number of ready fds, each
+// with its revents set, or < 0 on error.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	unsigned start = sys_time_msec();
+	int r, left;
+
+	while (1) {
+		left = timeout;
+		if (timeout > 0) {
+			left = timeout - (int) (sys_time_msec() - start);
+			if (left < 0)
+				left = 0;
+		}
+		if ((r = poll_once(fds, nfds, left)) != 0 || left == 0)
+			return r;
+		sys_yield();
+	}
+}
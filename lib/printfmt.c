@@ -35,6 +35,10 @@ static const char * const error_string[MAXERROR] =
 	[E_FILE_EXISTS]	= "file already exists",
 	[E_NOT_EXEC]	= "file is not a valid executable",
 	[E_NOT_SUPP]	= "operation not supported",
+	[E_RX_EMPTY]	= "no packet received",
+	[E_TX_FULL]	= "transmit ring full",
+	[E_AGAIN]	= "operation would block",
+	[E_CONN]	= "connection refused or reset",
 };
 
 /*
@@ -16,16 +16,26 @@ struct Dev devsock =
 	.dev_stat =	devsock_stat,
 };
 
+static int
+fd2sock(int fd, struct Fd **sfd)
+{
+	int r;
+
+	if ((r = fd_lookup(fd, sfd)) < 0)
+		return r;
+	if ((*sfd)->fd_dev_id != devsock.dev_id)
+		return -E_NOT_SUPP;
+	return 0;
+}
+
 static int
 fd2sockid(int fd)
 {
 	struct Fd *sfd;
 	int r;
 
-	if ((r = fd_lookup(fd, &sfd)) < 0)
+	if ((r = fd2sock(fd, &sfd)) < 0)
 		return r;
-	if (sfd->fd_dev_id != devsock.dev_id)
-		return -E_NOT_SUPP;
 	return sfd->fd_sock.sockid;
 }
 
@@ -47,13 +57,39 @@ alloc_sockfd(int sockid)
 	return fd2num(sfd);
 }
 
+// A replicated listening socket takes connections on whichever shard
+// the card sent them to, so try every replica in turn, starting after
+// the one that last had a connection.
+static int
+accept_any(struct Fd *sfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	static int next;
+	int i, id, r = -E_AGAIN;
+
+	for (i = 0; i <= sfd->fd_sock.npeers && r == -E_AGAIN; i++) {
+		next = (next + 1) % (sfd->fd_sock.npeers + 1);
+		id = next == 0 ? sfd->fd_sock.sockid : sfd->fd_sock.peers[next - 1];
+		r = nsipc_try_accept(id, addr, addrlen);
+	}
+	return r;
+}
+
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+	struct Fd *sfd;
 	int r;
-	if ((r = fd2sockid(s)) < 0)
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
+	if (sfd->fd_omode & O_NONBLOCK)
+		r = accept_any(sfd, addr, addrlen);
+	else if (sfd->fd_sock.npeers == 0)
+		r = nsipc_accept(sfd->fd_sock.sockid, addr, addrlen);
+	else
+		while ((r = accept_any(sfd, addr, addrlen)) == -E_AGAIN)
+			sys_yield();
+	if (r < 0)
 		return r;
 	return alloc_sockfd(r);
 }
@@ -61,10 +97,18 @@ accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 int
 bind(int s, struct sockaddr *name, socklen_t namelen)
 {
+	struct Fd *sfd;
 	int r;
-	if ((r = fd2sockid(s)) < 0)
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	return nsipc_bind(r, name, namelen);
+	if ((r = nsipc_bind(sfd->fd_sock.sockid, name, namelen)) < 0)
+		return r;
+	if (namelen <= sizeof(sfd->fd_sock.name)) {
+		memmove(sfd->fd_sock.name, name, namelen);
+		sfd->fd_sock.namelen = namelen;
+	}
+	return r;
 }
 
 int
@@ -79,10 +123,13 @@ shutdown(int s, int how)
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
-		return nsipc_close(fd->fd_sock.sockid);
-	else
+	int i;
+
+	if (pageref(fd) != 1)
 		return 0;
+	for (i = 0; i < fd->fd_sock.npeers; i++)
+		nsipc_close(fd->fd_sock.peers[i]);
+	return nsipc_close(fd->fd_sock.sockid);
 }
 
 int
@@ -94,25 +141,50 @@ connect(int s, const struct sockaddr *name, socklen_t namelen)
 	return nsipc_connect(r, name, namelen);
 }
 
+// With a sharded network server, the card may send a new connection to
+// any shard, so a bound TCP socket listens on every one of them.
 int
 listen(int s, int backlog)
 {
-	int r;
-	if ((r = fd2sockid(s)) < 0)
+	struct Fd *sfd;
+	int k, r, id;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
 		return r;
-	return nsipc_listen(r, backlog);
+	if ((r = nsipc_listen(sfd->fd_sock.sockid, backlog)) < 0)
+		return r;
+	if (sfd->fd_sock.namelen == 0 || sfd->fd_sock.npeers > 0)
+		return r;
+	for (k = 0; k < MIN(nsipc_nshards(), FDSOCK_MAXPEERS + 1); k++) {
+		if (k == NS_SOCKID_SHARD(sfd->fd_sock.sockid))
+			continue;
+		if ((id = nsipc_socket_on(k, PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+			return id;
+		sfd->fd_sock.peers[sfd->fd_sock.npeers++] = id;
+		if ((r = nsipc_bind(id, (struct sockaddr *)sfd->fd_sock.name,
+				    sfd->fd_sock.namelen)) < 0
+		    || (r = nsipc_listen(id, backlog)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int
+devsock_flags(struct Fd *fd)
+{
+	return (fd->fd_omode & O_NONBLOCK) ? MSG_DONTWAIT : 0;
 }
 
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_recv(fd->fd_sock.sockid, buf, n, devsock_flags(fd));
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_send(fd->fd_sock.sockid, buf, n, devsock_flags(fd));
 }
 
 static int
@@ -130,3 +202,59 @@ socket(int domain, int type, int protocol)
 		return r;
 	return alloc_sockfd(r);
 }
+
+// With a NULL 'to', a plain send on a connected socket.
+ssize_t
+sendto(int s, const void *buf, size_t len, int flags,
+       const struct sockaddr *to, socklen_t tolen)
+{
+	struct Fd *sfd;
+	int r;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
+		return r;
+	flags |= devsock_flags(sfd);
+	if (to == NULL)
+		return nsipc_send(sfd->fd_sock.sockid, buf, len, flags);
+	return nsipc_sendto(sfd->fd_sock.sockid, buf, len, flags, to, tolen);
+}
+
+// With a NULL 'from', a plain recv.
+ssize_t
+recvfrom(int s, void *buf, size_t len, int flags,
+	 struct sockaddr *from, socklen_t *fromlen)
+{
+	struct Fd *sfd;
+	int r;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
+		return r;
+	flags |= devsock_flags(sfd);
+	if (from == NULL)
+		return nsipc_recv(sfd->fd_sock.sockid, buf, len, flags);
+	return nsipc_recvfrom(sfd->fd_sock.sockid, buf, len, flags, from, fromlen);
+}
+
+int
+sendmmsg(int s, struct mmsg *msgs, int n, int flags)
+{
+	struct Fd *sfd;
+	int r;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
+		return r;
+	return nsipc_sendmmsg(sfd->fd_sock.sockid, msgs, n,
+			      flags | devsock_flags(sfd));
+}
+
+int
+recvmmsg(int s, struct mmsg *msgs, int n, int flags)
+{
+	struct Fd *sfd;
+	int r;
+
+	if ((r = fd2sock(s, &sfd)) < 0)
+		return r;
+	return nsipc_recvmmsg(sfd->fd_sock.sockid, msgs, n,
+			      flags | devsock_flags(sfd));
+}
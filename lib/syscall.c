@@ -132,6 +132,12 @@ sys_time_msec(void)
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_sleep(unsigned int msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
 int
 sys_send_packet(void* buffer, int length)
 {
@@ -142,4 +148,64 @@ int
 sys_receive_packet(void* buffer)
 {
 	return (int) syscall(SYS_receive_packet, 0, (int64_t) buffer, 0, 0, 0, 0);
-}
\ No newline at end of file
+}
+
+int
+sys_send_packet_map(struct pkt_frag* frags, int nfrags, int flags)
+{
+	return (int) syscall(SYS_send_packet_map, 0, (int64_t) frags, nfrags, flags, 0, 0);
+}
+
+int
+sys_send_packets(struct pkt_batch* batch, int skip)
+{
+	return (int) syscall(SYS_send_packets, 0, (int64_t) batch, skip, 0, 0, 0);
+}
+
+int
+sys_receive_packets(struct pkt_batch* batch)
+{
+	return (int) syscall(SYS_receive_packets, 0, (int64_t) batch, 0, 0, 0, 0);
+}
+
+int
+sys_receive_packet_map(void* dstva)
+{
+	return (int) syscall(SYS_receive_packet_map, 0, (int64_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_net_attach(uint32_t queue, void* va, struct nic_rx_map* map)
+{
+	return (int) syscall(SYS_net_attach, 0, queue, (int64_t) va, (int64_t) map, 0, 0);
+}
+
+int
+sys_net_rx_doorbell(uint32_t queue, uint32_t tail)
+{
+	return (int) syscall(SYS_net_rx_doorbell, 0, queue, tail, 0, 0, 0);
+}
+
+int
+sys_ncpu(void)
+{
+	return (int) syscall(SYS_ncpu, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_disk_submit(int diskno, uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	return (int) syscall(SYS_disk_submit, 0, diskno, secno, (int64_t) va, nsecs, write);
+}
+
+int
+sys_disk_reap(int tag)
+{
+	return (int) syscall(SYS_disk_reap, 0, tag, 0, 0, 0, 0);
+}
+
+int
+sys_disk_info(struct diskinfo *info)
+{
+	return (int) syscall(SYS_disk_info, 0, (int64_t) info, 0, 0, 0, 0);
+}
@@ -17,18 +17,45 @@ input(envid_t ns_envid)
     // must use nsipc here
     // Also union type doing weird shit
     int r;
+#if NS_RX_BATCH
+    // One trap drains whatever the ring holds into a page, and one IPC
+    // hands the whole page to ns.  ns reads it for a while, so each batch
+    // gets a fresh page.
+    while(true) {
+        sys_page_alloc(0, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+        while((r = sys_receive_packets(&nsipcbuf.batch)) == -E_RX_EMPTY)
+            ;
+        if(r < 0)
+            panic("sys_receive_packets: %e", r);
+
+        ipc_send(ns_envid, NSREQ_INPUT_BATCH, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+        sys_page_unmap(0, &nsipcbuf);
+    }
+#elif NS_RX_ZEROCOPY
+    // The kernel maps the RX buffer page itself at nsipcbuf, already laid
+    // out as a jif_pkt.  We pass it on and drop our mapping; once ns has
+    // unmapped it too the page is free to become a ring buffer again.
+    // Kernels with packed 2 KiB RX buffers can't do this; copy instead.
+    while(true) {
+        while((r = sys_receive_packet_map(&nsipcbuf)) == -E_RX_EMPTY)
+            ;
+        if(r == -E_NOT_SUPP)
+            break;
+        if(r < 0)
+            panic("sys_receive_packet_map: %e", r);
+
+        ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+        sys_page_unmap(0, &nsipcbuf);
+    }
+#endif
     sys_page_alloc(thisenv->env_id, (void*)(0x408000), PTE_P|PTE_W|PTE_U);
     while(true) {
-        while(true) {
-            r = sys_receive_packet((void*)(0x408000));
-            if(r == -99){
-                continue;
-            } else if(r >= 0) {
-                break;
-            } else {
-                panic("");
-            }      
-        }
+        // An empty ring puts us to sleep in the kernel until the next
+        // RX interrupt, so this loop only turns over once per wakeup.
+        while((r = sys_receive_packet((void*)(0x408000))) == -E_RX_EMPTY)
+            ;
+        if(r < 0)
+            panic("sys_receive_packet: %e", r);
         sys_page_alloc(thisenv->env_id, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 
         memmove(nsipcbuf.pkt.jp_data, (void*)(0x408000), r);
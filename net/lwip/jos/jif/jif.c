@@ -41,10 +41,39 @@
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
 #include <lwip/stats.h>
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
+#include "lwip/inet_chksum.h"
 
 #include <netif/etharp.h>
 
 #define PKTMAP		0x10000000
+// Where jif_attach() maps the e1000 RX ring and its buffers.
+#define RXRING		0x11000000
+// Where ARP replies are copied to be passed on (see jif_arp_mirror).
+#define ARPPKT		0x10001000
+
+// Transmit straight out of the pbuf chain: the kernel points one TX
+// descriptor at each pbuf's payload instead of us copying the chain into
+// a page for the output env.  Off: lwIP frees or reuses a pbuf as soon as
+// low_level_output returns, and rewrites TCP segments in place when it
+// retransmits, while the card may not have read the frame yet.  The
+// kernel's page pin keeps the page but not its contents.  This needs a
+// pbuf_ref held until the descriptor's DD bit, with the kernel telling
+// ns when that is, before it can be turned on.
+#define JIF_TX_ZEROCOPY 0
+
+// Pending batch of copied frames for the output env (see jif_flush).
+static struct pkt_batch *txbatch = (struct pkt_batch *)PKTMAP;
+static int txbatch_mapped;
+
+// The RX ring, once jif_attach() has taken it over from the kernel.
+static struct nic_rx_map rxmap;
+
+// Sibling network servers that get a copy of every ARP reply we see.
+static envid_t arp_mirrors[NS_MAXSHARDS];
+static int narp_mirrors;
 
 struct jif {
     struct eth_addr *ethaddr;
@@ -69,6 +98,123 @@ low_level_init(struct netif *netif)
     netif->hwaddr[5] = 0x56;
 }
 
+#if JIF_CSUM_OFFLOAD
+/*
+ * One's complement sum of the TCP/UDP pseudo header, folded but not
+ * inverted.  The card adds the segment to whatever is in the checksum
+ * field, so this is what it has to find there.
+ */
+static u16_t
+jif_pseudo_sum(struct ip_hdr *iphdr, u8_t proto, u16_t len)
+{
+    u32_t acc = 0;
+
+    acc += (iphdr->src.addr & 0xffff) + (iphdr->src.addr >> 16);
+    acc += (iphdr->dest.addr & 0xffff) + (iphdr->dest.addr >> 16);
+    acc += htons(proto) + htons(len);
+    while (acc >> 16)
+	acc = (acc & 0xffff) + (acc >> 16);
+    return acc;
+}
+
+/*
+ * jif_tx_offload():
+ *
+ * Decide which of the checksums lwIP left out the card should fill in
+ * for frame p, and prepare the headers for it.  A TCP frame too big for
+ * the wire is handed over for segmentation (TSO).  lwIP always builds
+ * the headers in the first pbuf.  Returns the PKT_TX_* flags.
+ *
+ */
+static int
+jif_tx_offload(struct netif *netif, struct pbuf *p)
+{
+    struct eth_hdr *ethhdr = p->payload;
+    struct ip_hdr *iphdr;
+    u16_t hlen, len;
+    u8_t proto;
+    int flags = 0;
+
+    if (p->len < sizeof(struct eth_hdr) + IP_HLEN || ethhdr->type != htons(ETHTYPE_IP))
+	return 0;
+    iphdr = (struct ip_hdr *)((u8_t *)p->payload + sizeof(struct eth_hdr));
+    hlen = IPH_HL(iphdr) * 4;
+    len = ntohs(IPH_LEN(iphdr)) - hlen;
+    proto = IPH_PROTO(iphdr);
+
+    // ip_frag.c still checksums fragments itself, and the card would
+    // fold a checksum that's already there into its own.
+    if (IPH_CHKSUM(iphdr) == 0)
+	flags |= PKT_TX_IPCSUM;
+    if (ntohs(IPH_OFFSET(iphdr)) & (IP_MF | IP_OFFMASK))
+	return flags;
+
+    if (proto == IP_PROTO_TCP && p->len >= sizeof(struct eth_hdr) + hlen + TCP_HLEN) {
+	struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t *)iphdr + hlen);
+	if (p->tot_len > sizeof(struct eth_hdr) + netif->mtu) {
+	    // The card rewrites the length and checksums of every segment.
+	    u16_t mss = netif->mtu - hlen - TCPH_HDRLEN(tcphdr) * 4;
+	    IPH_LEN_SET(iphdr, 0);
+	    IPH_CHKSUM_SET(iphdr, 0);
+	    tcphdr->chksum = jif_pseudo_sum(iphdr, proto, 0);
+	    return PKT_TX_IPCSUM | PKT_TX_L4CSUM | PKT_TX_TSO | PKT_TX_MSS(mss);
+	}
+	tcphdr->chksum = jif_pseudo_sum(iphdr, proto, len);
+	flags |= PKT_TX_L4CSUM;
+    } else if (proto == IP_PROTO_UDP && p->len >= sizeof(struct eth_hdr) + hlen + UDP_HLEN) {
+	struct udp_hdr *udphdr = (struct udp_hdr *)((u8_t *)iphdr + hlen);
+	udphdr->chksum = jif_pseudo_sum(iphdr, proto, len);
+	flags |= PKT_TX_L4CSUM;
+    }
+    return flags;
+}
+
+/*
+ * jif_rx_csum_ok():
+ *
+ * Check in software whichever checksums of IP datagram p (Ethernet
+ * header already stripped) the card didn't verify, as told by flags.
+ * Returns 1 if p is good.  Fragments only have their IP header checked:
+ * like the card, we can't see a whole TCP/UDP segment in one of them.
+ *
+ */
+static int
+jif_rx_csum_ok(struct pbuf *p, int flags)
+{
+    struct ip_hdr *iphdr = p->payload;
+    u16_t hlen, len;
+    u8_t proto;
+    int ok;
+
+    if (p->len < IP_HLEN)
+	return 0;
+    hlen = IPH_HL(iphdr) * 4;
+    len = ntohs(IPH_LEN(iphdr));
+    proto = IPH_PROTO(iphdr);
+    if (hlen < IP_HLEN || hlen > p->len || len < hlen || len > p->tot_len)
+	return 0;
+
+    if (!(flags & PKT_RX_IPCSUM_OK) && inet_chksum(iphdr, hlen) != 0)
+	return 0;
+    if ((flags & PKT_RX_L4CSUM_OK) || (ntohs(IPH_OFFSET(iphdr)) & (IP_MF | IP_OFFMASK)))
+	return 1;
+    if (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP)
+	return 1;
+
+    // Drop any Ethernet padding so the sum covers just the datagram.
+    pbuf_realloc(p, len);
+    if (proto == IP_PROTO_UDP && p->len >= hlen + UDP_HLEN
+	&& ((struct udp_hdr *)((u8_t *)iphdr + hlen))->chksum == 0)
+	return 1;		// the sender didn't checksum it
+    pbuf_header(p, -(s16_t)hlen);
+    ok = inet_chksum_pseudo(p, (struct ip_addr *)&iphdr->src,
+			    (struct ip_addr *)&iphdr->dest,
+			    proto, p->tot_len) == 0;
+    pbuf_header(p, hlen);
+    return ok;
+}
+#endif
+
 /*
  * low_level_output():
  *
@@ -80,15 +226,52 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
+    int r, flags = 0;
+
+#if JIF_CSUM_OFFLOAD
+    flags = jif_tx_offload(netif, p);
+#endif
+
+#if JIF_TX_ZEROCOPY
+    struct pkt_frag frags[PKT_MAXFRAGS];
+    int nfrags = 0;
+    struct pbuf *f;
+    for (f = p; f != NULL && nfrags < PKT_MAXFRAGS; f = f->next) {
+	if (f->len == 0)
+	    continue;
+	frags[nfrags].pf_va = f->payload;
+	frags[nfrags].pf_len = f->len;
+	nfrags++;
+    }
+    // Chains longer than PKT_MAXFRAGS fall back to the copying path.
+    if (f == NULL) {
+	while ((r = sys_send_packet_map(frags, nfrags, flags)) == -E_TX_FULL)
+	    sys_yield();
+	if (r < 0)
+	    panic("jif: sys_send_packet_map: %e", r);
+	return ERR_OK;
+    }
+#endif
 
     struct jif *jif;
     jif = netif->state;
 
-    char *txbuf = pkt->jp_data;
+    // Frames are copied into a batch page that goes to the output env in
+    // one IPC, either when it fills up or when ns calls jif_flush()
+    // before it blocks for the next request.
+    if (txbatch_mapped && !PKT_BATCH_FITS(txbatch, p->tot_len))
+	jif_flush(netif);
+    if (!txbatch_mapped) {
+	r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
+	if (r < 0)
+	    panic("jif: could not allocate page of memory");
+	txbatch->pb_count = 0;
+	txbatch->pb_used = 0;
+	txbatch_mapped = 1;
+    }
+    struct pkt_rec *rec = (struct pkt_rec *)(txbatch->pb_data + txbatch->pb_used);
+
+    char *txbuf = rec->pr_data;
     int txsize = 0;
     struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
@@ -102,14 +285,131 @@ low_level_output(struct netif *netif, struct pbuf *p)
 	txsize += q->len;
     }
 
-    pkt->jp_len = txsize;
-
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    rec->pr_len = txsize;
+    rec->pr_flags = flags;
+    txbatch->pb_used += PKT_REC_SIZE(txsize);
+    txbatch->pb_count++;
 
     return ERR_OK;
 }
 
+/*
+ * jif_flush():
+ *
+ * Hand any frames batched up by low_level_output() to the output
+ * environment.
+ *
+ */
+void
+jif_flush(struct netif *netif)
+{
+    struct jif *jif = netif->state;
+
+    if (!txbatch_mapped)
+	return;
+    if (txbatch->pb_count > 0 && jif->envid == 0) {
+	// No output env (see jif_attach); queue the frames ourselves.
+	int sent = 0, r;
+	while (sent < txbatch->pb_count) {
+	    if ((r = sys_send_packets(txbatch, sent)) < 0)
+		panic("jif: sys_send_packets: %e", r);
+	    if (r == 0)
+		sys_yield();
+	    sent += r;
+	}
+    } else if (txbatch->pb_count > 0)
+	ipc_send(jif->envid, NSREQ_OUTPUT_BATCH, (void *)txbatch, PTE_P|PTE_W|PTE_U);
+    sys_page_unmap(0, (void *)txbatch);
+    txbatch_mapped = 0;
+}
+
+/*
+ * jif_attach():
+ *
+ * Take e1000 RX queue 'queue' over from the kernel, so that jif_poll()
+ * reads frames straight out of it instead of an input environment
+ * passing them along.  Call it before jif_init(), which should then be
+ * given 0 for the output environment: the transmit side goes straight
+ * to the kernel too.  If 'nqueues' isn't NULL, it is set to the number
+ * of queues the card has.
+ *
+ */
+int
+jif_attach(uint32_t queue, uint32_t *nqueues)
+{
+    int r;
+
+    if ((r = sys_net_attach(queue, (void *)RXRING, &rxmap)) < 0)
+	return r;
+    if (nqueues)
+	*nqueues = rxmap.nm_nqueues;
+    return 0;
+}
+
+/*
+ * jif_arp_mirror():
+ *
+ * Pass a copy of every ARP reply that comes in on to each of the 'n'
+ * network servers in 'envs', as an NSREQ_INPUT.  With RSS, ARP only
+ * ever arrives on queue 0, but every stack sharing the MAC address has
+ * to learn its neighbours.  Replies are enough: requests for our
+ * address are answered here.
+ *
+ */
+void
+jif_arp_mirror(const envid_t *envs, int n)
+{
+    narp_mirrors = MIN(n, NS_MAXSHARDS);
+    memmove(arp_mirrors, envs, narp_mirrors * sizeof(envid_t));
+}
+
+static void
+jif_arp_forward(const void *data, int len)
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)ARPPKT;
+    int i;
+
+    if (sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W) < 0)
+	return;
+    pkt->jp_len = len;
+    memmove(pkt->jp_data, data, len);
+    for (i = 0; i < narp_mirrors; i++)
+	ipc_send(arp_mirrors[i], NSREQ_INPUT, pkt, PTE_P|PTE_U);
+    sys_page_unmap(0, pkt);
+}
+
+/*
+ * jif_poll():
+ *
+ * Feed lwIP every frame waiting in the RX ring taken over by
+ * jif_attach(), then give all their descriptors back to the card in one
+ * system call.  Does nothing if the ring hasn't been taken over.
+ *
+ */
+void
+jif_poll(struct netif *netif)
+{
+    uint32_t i = rxmap.nm_next, n;
+    int r, flags;
+    struct rx_desc rd;
+
+    for (n = 0; n < rxmap.nm_count; n++) {
+	nic_rx_desc_read(rxmap.nm_ring, rxmap.nm_ext, i, &rd);
+	if (!(rd.status & E1000_RXD_STAT_DD))
+	    break;
+	// Frames with a checksum the card found bad are dropped here.
+	if ((flags = nic_rx_csum_flags(&rd)) >= 0)
+	    jif_input_frame(netif, (void *)(rxmap.nm_bufs + i * rxmap.nm_bufsize),
+			    rd.length, flags);
+	i = (i + 1) % rxmap.nm_count;
+    }
+    if (n == 0)
+	return;
+    if ((r = sys_net_rx_doorbell(rxmap.nm_queue, (i + rxmap.nm_count - 1) % rxmap.nm_count)) < 0)
+	panic("jif: sys_net_rx_doorbell: %e", r);
+    rxmap.nm_next = i;
+}
+
 /*
  * low_level_input():
  *
@@ -118,18 +418,15 @@ low_level_output(struct netif *netif, struct pbuf *p)
  *
  */
 static struct pbuf *
-low_level_input(void *va)
+low_level_input(void *data, s16_t len)
 {
-    struct jif_pkt *pkt = (struct jif_pkt *)va;
-    s16_t len = pkt->jp_len;
-
     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (p == 0)
 	return 0;
 
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
-    void *rxbuf = (void *) pkt->jp_data;
+    void *rxbuf = data;
     int copied = 0;
     struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
@@ -174,6 +471,22 @@ jif_output(struct netif *netif, struct pbuf *p,
 
 void
 jif_input(struct netif *netif, void *va)
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)va;
+
+    jif_input_frame(netif, pkt->jp_data, pkt->jp_len, 0);
+}
+
+/*
+ * jif_input_frame():
+ *
+ * Like jif_input(), for a frame of len bytes at data.  flags holds the
+ * PKT_RX_* checksums the card has already verified.
+ *
+ */
+
+void
+jif_input_frame(struct netif *netif, void *data, int len, int flags)
 {
     struct jif *jif;
     struct eth_hdr *ethhdr;
@@ -182,7 +495,7 @@ jif_input(struct netif *netif, void *va)
     jif = netif->state;
   
     /* move received packet into a new pbuf */
-    p = low_level_input(va);
+    p = low_level_input(data, len);
 
     /* no packet could be read, silently ignore this */
     if (p == NULL) return;
@@ -195,11 +508,20 @@ jif_input(struct netif *netif, void *va)
 	etharp_ip_input(netif, p);
 	/* skip Ethernet header */
 	pbuf_header(p, -(int)sizeof(struct eth_hdr));
+#if JIF_CSUM_OFFLOAD
+	if (!jif_rx_csum_ok(p, flags)) {
+	    pbuf_free(p);
+	    break;
+	}
+#endif
 	/* pass to network layer */
 	netif->input(p, netif);
 	break;
       
     case ETHTYPE_ARP:
+	if (narp_mirrors > 0 && len >= sizeof(struct eth_hdr) + 8
+	    && ((u8_t *)data)[sizeof(struct eth_hdr) + 7] == 2)
+	    jif_arp_forward(data, len);
 	/* pass p to ARP module  */
 	etharp_arp_input(netif, jif->ethaddr, p);
 	break;
@@ -1,4 +1,9 @@
 #include <lwip/netif.h>
 
 void	jif_input(struct netif *netif, void *va);
+void	jif_input_frame(struct netif *netif, void *data, int len, int flags);
+void	jif_flush(struct netif *netif);
+int	jif_attach(uint32_t queue, uint32_t *nqueues);
+void	jif_arp_mirror(const envid_t *envs, int n);
+void	jif_poll(struct netif *netif);
 err_t	jif_init(struct netif *netif);
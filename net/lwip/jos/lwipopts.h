@@ -15,24 +15,33 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define LWIP_DHCP		1
 #define LWIP_COMPAT_SOCKETS	0
 //#define SYS_LIGHTWEIGHT_PROT	1
+// ns calls into lwIP from one loop and no other thread, so the heap
+// needs no semaphore.
+#define LWIP_ALLOW_MEM_FREE_FROM_OTHER_CONTEXT	1
 #define LWIP_PROVIDE_ERRNO      1
 
+// Packets for our own address (a client and a server in the same guest)
+// go on a queue that ns drains with netif_poll, rather than out the wire.
+#define LWIP_NETIF_LOOPBACK			1
+#define LWIP_NETIF_LOOPBACK_MULTITHREADING	0
+
 // Various tuning knobs, see:
 // http://lists.gnu.org/archive/html/lwip-users/2006-11/msg00007.html
 
 #define MEM_ALIGNMENT		4
 
-#define MEMP_NUM_PBUF		64
+// Room for a few hundred connections, as a poll()ing server keeps open.
+#define MEMP_NUM_PBUF		256
 #define MEMP_NUM_UDP_PCB	8
-#define MEMP_NUM_TCP_PCB	32
+#define MEMP_NUM_TCP_PCB	256
 #define MEMP_NUM_TCP_PCB_LISTEN	16
-#define MEMP_NUM_TCP_SEG	TCP_SND_QUEUELEN// at least as big as TCP_SND_QUEUELEN
+#define MEMP_NUM_TCP_SEG	(8 * TCP_SND_QUEUELEN)	// shared by all connections
 #define MEMP_NUM_NETBUF		128
 #define MEMP_NUM_NETCONN	32
 #define MEMP_NUM_SYS_TIMEOUT    6
 
 #define PER_TCP_PCB_BUFFER	(16 * 4096)
-#define MEM_SIZE		(PER_TCP_PCB_BUFFER*MEMP_NUM_TCP_SEG + 4096*MEMP_NUM_TCP_SEG)
+#define MEM_SIZE		(PER_TCP_PCB_BUFFER*TCP_SND_QUEUELEN + 4096*TCP_SND_QUEUELEN)
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
@@ -45,6 +54,17 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
 //#define TCP_SND_QUEUELEN	16
 
+// The e1000 fills in outgoing IP, TCP and UDP checksums and verifies
+// incoming ones, so lwIP skips them.  jif.c hands the work to the card
+// and checks in software whatever the card couldn't.
+#define JIF_CSUM_OFFLOAD	1
+#define CHECKSUM_GEN_IP		(!JIF_CSUM_OFFLOAD)
+#define CHECKSUM_GEN_UDP	(!JIF_CSUM_OFFLOAD)
+#define CHECKSUM_GEN_TCP	(!JIF_CSUM_OFFLOAD)
+#define CHECKSUM_CHECK_IP	(!JIF_CSUM_OFFLOAD)
+#define CHECKSUM_CHECK_UDP	(!JIF_CSUM_OFFLOAD)
+#define CHECKSUM_CHECK_TCP	(!JIF_CSUM_OFFLOAD)
+
 // Print error messages when we run out of memory
 #define LWIP_DEBUG	1
 //#define TCP_DEBUG	LWIP_DBG_ON
@@ -7,9 +7,36 @@
 
 #define TIMER_INTERVAL 250
 
-// Virtual address at which to receive page mappings containing client requests.
-#define QUEUE_SIZE	20
+// Receive by page-swapping RX ring buffers into the input env instead
+// of copying each frame out of the kernel.  Off unless built with `make
+// NS_RX_ZEROCOPY=1', which also gives the kernel the page-per-slot RX
+// ring this needs (E1000_RX_PAGESLOTS); elsewhere the input env falls
+// back to copying.
+#ifndef NS_RX_ZEROCOPY
+#define NS_RX_ZEROCOPY 0
+#endif
+
+// Receive with sys_receive_packets and pass ns a whole page of frames per
+// IPC.  On unless zero-copy receive is, which moves one frame per page.
+#define NS_RX_BATCH (!NS_RX_ZEROCOPY)
+
+// Map the e1000 RX ring into ns and transmit straight from ns, leaving
+// the input and output envs out of the data path.  They're still forked
+// if the kernel won't hand the ring over.
+#define NS_FASTPATH 1
+
+// Virtual address at which to receive page mappings containing client
+// requests, and how many such pages ns can hold at once: one per request
+// in flight, including those waiting on a socket.  Set with `make
+// NS_QUEUE_SIZE=n'.
+#ifndef NS_QUEUE_SIZE
+#define NS_QUEUE_SIZE	128
+#endif
+#define QUEUE_SIZE	NS_QUEUE_SIZE
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+// Where a page of received data is put together before going back to
+// the client (NSREQ_RECV_PAGE).
+#define RECVPG		0x0ffff000
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
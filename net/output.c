@@ -14,9 +14,26 @@ output(envid_t ns_envid)
         sys_ipc_recv(&nsipcbuf);
         // cprintf("%llx\n", thisenv->env_ipc_value);
         // cprintf("%llx\n", NSREQ_OUTPUT);
+        if(thisenv->env_ipc_value == NSREQ_OUTPUT_BATCH) {
+            // Whole batch in as few traps as the ring allows; back off
+            // only while the ring is full.
+            int sent = 0, r;
+            while(sent < nsipcbuf.batch.pb_count) {
+                r = sys_send_packets(&nsipcbuf.batch, sent);
+                if(r < 0)
+                    panic("sys_send_packets: %e", r);
+                if(r == 0)
+                    sys_yield();
+                sent += r;
+            }
+            continue;
+        }
         if(thisenv->env_ipc_value != NSREQ_OUTPUT)
             continue;
-        sys_send_packet((void*)nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len);
+        // The kernel doesn't wait for the card; back off while the ring
+        // is full and try again.
+        while(sys_send_packet((void*)nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len) == -E_TX_FULL)
+            sys_yield();
     }
     
 }
@@ -9,18 +9,13 @@
 #include <inc/ns.h>
 #include <inc/lib.h>
 
-#include <arch/perror.h>
-#include <arch/thread.h>
+#include <lwip/init.h>
 #include <lwip/sockets.h>
 #include <lwip/netif.h>
-#include <lwip/stats.h>
-#include <lwip/sys.h>
+#include <lwip/pbuf.h>
+#include <lwip/ip_frag.h>
 #include <lwip/tcp.h>
 #include <lwip/udp.h>
-#include <lwip/dhcp.h>
-#include <lwip/tcpip.h>
-#include <lwip/stats.h>
-#include <lwip/netbuf.h>
 #include <netif/etharp.h>
 #include <jif/jif.h>
 
@@ -31,122 +26,1137 @@ int errno;
 
 struct netif nif;
 
-#define debug 1
+#define debug 0
 
-struct timer_thread {
+// lwIP's periodic work, run from the serve loop whenever the timer env
+// checks in (every TIMER_INTERVAL ms).
+struct ns_timer {
     uint32_t msec;
     void (*func)(void);
-    const char *name;
+    uint32_t next;
 };
 
-static struct timer_thread t_arp;
-static struct timer_thread t_tcpf;
-static struct timer_thread t_tcps;
+static struct ns_timer timers[] = {
+    { TCP_FAST_INTERVAL, tcp_fasttmr },
+    { TCP_SLOW_INTERVAL, tcp_slowtmr },
+    { ARP_TMR_INTERVAL, etharp_tmr },
+    { IP_TMR_INTERVAL, ip_reass_tmr },
+};
+#define NTIMERS (sizeof(timers) / sizeof(timers[0]))
 
 static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
 
-static bool buse[QUEUE_SIZE];
-static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
-static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
+// Which shard this is, and (in shard 0, which clients find first) every
+// shard's envid.  See umain.
+static int shard;
+static int nshards = 1;
+static envid_t shard_envids[NS_MAXSHARDS];
+
+// Request pages: a stack of free slots, so the page just released (and
+// still in the TLB) is the next one handed out.
+static int freebufs[QUEUE_SIZE];
+static int nfree;
+static struct Nsret_stats bufstats;
+
+static void
+buffer_init(void) {
+    int i;
+
+    for (i = 0; i < QUEUE_SIZE; i++)
+        freebufs[i] = QUEUE_SIZE - 1 - i;
+    nfree = QUEUE_SIZE;
+    bufstats.ret_bufs = QUEUE_SIZE;
+}
 
+// Returns NULL if every page holds a request in flight.
 static void *
 get_buffer(void) {
-    void *va;
+    if (nfree == 0)
+        return NULL;
 
-    int64_t i;
-    for (i = 0; i < QUEUE_SIZE; i++)
-        if (!buse[i]) break;
+    bufstats.ret_allocs++;
+    if (++bufstats.ret_inuse > bufstats.ret_hiwat)
+        bufstats.ret_hiwat = bufstats.ret_inuse;
+    return (void *)(uintptr_t)(REQVA + freebufs[--nfree] * PGSIZE);
+}
 
-    if (i == QUEUE_SIZE) {
-        panic("NS: buffer overflow");
+static void
+put_buffer(void *va) {
+    freebufs[nfree++] = ((uint64_t)va - REQVA) / PGSIZE;
+    bufstats.ret_inuse--;
+}
+
+/*
+ * Sockets.
+ *
+ * ns drives lwIP's raw API directly from one loop: no tcpip thread, no
+ * thread per request, no mailboxes.  A client request that can't be
+ * answered yet (accept with nothing to accept, recv with nothing
+ * received, send with a full send buffer, connect in progress) keeps
+ * its request page and waits on its socket; lwIP's callbacks mark the
+ * socket, and the serve loop retries whatever waits on marked sockets.
+ */
+
+#define NSOCK   (MEMP_NUM_TCP_PCB + MEMP_NUM_TCP_PCB_LISTEN + MEMP_NUM_UDP_PCB)
+#define ACCEPTQ 16      // Connections a listening socket holds for accept
+#define DGRAMQ  32      // Datagrams a UDP socket holds for recv(mmsg)
+
+enum { SOCK_FREE, SOCK_NEW, SOCK_CONNECTING, SOCK_CONNECTED, SOCK_LISTEN, SOCK_CLOSED };
+
+struct ns_dgram {
+    struct pbuf *p;
+    struct ip_addr addr;
+    u16_t port;
+};
+
+struct ns_sock {
+    int state;
+    int type;                   // SOCK_STREAM or SOCK_DGRAM
+    struct tcp_pcb *tcp;
+    struct udp_pcb *udp;
+    err_t err;                  // Why the connection went away
+    bool eof;                   // Peer sent FIN
+    bool wake;                  // Something happened; retry waiters
+    struct pbuf *rxq;           // TCP: received, not yet read
+    struct ns_dgram dgrams[DGRAMQ];     // UDP: received datagrams
+    int dgh, ndgram;
+    int accq[ACCEPTQ];          // Listening: accepted sockets
+    int acch, nacc;
+    int granted;                // Listening: of those, promised to pollers
+    struct ip_addr remote_ip;   // Accepted: the peer
+    u16_t remote_port;
+    int waitq, waitq_tail;      // Requests waiting, by buffer slot
+    int pinq, pinq_tail;        // Lent pages lwIP still sends from
+    bool lingering;             // Closed, but tcp_close waits for pinq
+    bool orphan;                // Client closed it: free once it's done
+};
+
+// A request still being served, by the buffer slot its page is in.
+struct ns_req {
+    envid_t whom;
+    int32_t reqno;
+    int sock;
+    int done;                   // Progress so far (bytes sent, connect issued)
+    int next;                   // Next request waiting on (or pinned by) the same socket
+    u32_t pin_end;              // Sequence number just past the page's data
+    bool reply_pg;              // Reply with the page at RECVPG (NSREQ_RECV_PAGE)
+    u32_t deadline;             // When an NSREQ_POLL gives up
+};
+
+static struct ns_sock socks[NSOCK];
+static struct ns_req reqs[QUEUE_SIZE];
+static bool wake_pending;
+static int pollq = -1;          // Waiting NSREQ_POLLs, which watch any socket,
+static int pollq_tail = -1;     // oldest first
+static bool poll_due;           // Time to check their deadlines
+
+#define REQ_PAGE(i)     ((union Nsipc *)(uintptr_t)(REQVA + (i) * PGSIZE))
+
+static int
+ns_err(err_t err)
+{
+    switch (err) {
+    case ERR_OK:
         return 0;
+    case ERR_MEM:
+    case ERR_BUF:
+        return -E_NO_MEM;
+    case ERR_ABRT:
+    case ERR_RST:
+    case ERR_CLSD:
+    case ERR_CONN:
+        return -E_CONN;
+    default:
+        return -E_INVAL;
     }
+}
 
-    va = (void *)(REQVA + i * PGSIZE);
-    buse[i] = 1;
+static struct ns_sock *
+sock_get(int s)
+{
+    if (s < 0 || s >= NSOCK || socks[s].state == SOCK_FREE)
+        return NULL;
+    return &socks[s];
+}
 
-    return va;
+static void
+sock_wake(struct ns_sock *s)
+{
+    s->wake = true;
+    wake_pending = true;
 }
 
+static int
+sock_alloc(int type)
+{
+    int i;
+    for (i = 0; i < NSOCK; i++)
+        if (socks[i].state == SOCK_FREE) {
+            memset(&socks[i], 0, sizeof(socks[i]));
+            socks[i].state = SOCK_NEW;
+            socks[i].type = type;
+            socks[i].waitq = socks[i].waitq_tail = -1;
+            socks[i].pinq = socks[i].pinq_tail = -1;
+            return i;
+        }
+    return -E_NO_MEM;
+}
+
+static err_t ns_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+static err_t ns_tcp_sent(void *arg, struct tcp_pcb *pcb, u16_t len);
+static void ns_tcp_err(void *arg, err_t err);
+
 static void
-put_buffer(void *va) {
-    int64_t i = ((uint64_t)va - REQVA) / PGSIZE;
-    buse[i] = 0;
+sock_attach_tcp(struct ns_sock *s, struct tcp_pcb *pcb)
+{
+    s->tcp = pcb;
+    tcp_arg(pcb, s);
+    tcp_recv(pcb, ns_tcp_recv);
+    tcp_sent(pcb, ns_tcp_sent);
+    tcp_err(pcb, ns_tcp_err);
 }
 
-    static void
-lwip_init(struct netif *nif, void *if_state,
-        uint32_t init_addr, uint32_t init_mask, uint32_t init_gw)
+static void
+sock_close_tcp(struct ns_sock *s)
 {
-    struct ip_addr ipaddr, netmask, gateway;
-    ipaddr.addr  = init_addr;
-    netmask.addr = init_mask;
-    gateway.addr = init_gw;
+    tcp_arg(s->tcp, NULL);
+    tcp_recv(s->tcp, NULL);
+    tcp_sent(s->tcp, NULL);
+    tcp_err(s->tcp, NULL);
+    if (tcp_close(s->tcp) != ERR_OK)
+        tcp_abort(s->tcp);
+    s->tcp = NULL;
+}
 
-    if (0 == netif_add(nif, &ipaddr, &netmask, &gateway,
-                if_state,
-                jif_init,
-                ip_input))
-        panic("lwip_init: error in netif_add\n");
+// Give back the pages s lent lwIP (NSREQ_SENDPAGE) that no queued
+// segment refers to any more; all of them if the pcb is gone.  Pages
+// go back oldest first, each once every segment still in the queue
+// starts at or past its data.  (An acked byte isn't enough: lwIP may
+// have merged the next page's first bytes into the same segment.)
+static void
+sock_unpin(struct ns_sock *s)
+{
+    struct tcp_pcb *pcb = s->tcp;
+    u32_t oldest = 0;
+    int i;
 
-    netif_set_default(nif);
-    netif_set_up(nif);
+    if (pcb)
+        oldest = pcb->unacked ? ntohl(pcb->unacked->tcphdr->seqno)
+            : pcb->unsent ? ntohl(pcb->unsent->tcphdr->seqno)
+            : pcb->snd_lbb;
+    while ((i = s->pinq) >= 0 && (!pcb || TCP_SEQ_LEQ(reqs[i].pin_end, oldest))) {
+        s->pinq = reqs[i].next;
+        put_buffer(REQ_PAGE(i));
+        sys_page_unmap(0, REQ_PAGE(i));
+    }
+    if (s->pinq < 0 && s->lingering) {
+        // Everything the client sent went out; now close for real.
+        s->lingering = false;
+        if (s->tcp)
+            sock_close_tcp(s);
+        if (s->orphan)
+            s->state = SOCK_FREE;
+    }
 }
 
-    static void __attribute__((noreturn))
-net_timer(uint64_t arg)
+// Let go of s's pcb and whatever it has buffered; s stays allocated,
+// but can only be closed from now on.  If lwIP is still sending from
+// pages the client lent, the pcb stays until they're out.
+static void
+sock_release(struct ns_sock *s)
 {
-    struct timer_thread *t = (struct timer_thread *) arg;
+    if (s->tcp && s->state == SOCK_LISTEN) {
+        // A listen pcb has no recv/sent/err; closing it frees it.
+        tcp_close(s->tcp);
+        s->tcp = NULL;
+    }
+    if (s->tcp && s->pinq >= 0)
+        s->lingering = true;
+    else if (s->tcp)
+        sock_close_tcp(s);
+    if (s->udp) {
+        udp_remove(s->udp);
+        s->udp = NULL;
+    }
+    if (s->rxq) {
+        pbuf_free(s->rxq);
+        s->rxq = NULL;
+    }
+    for (; s->ndgram > 0; s->ndgram--, s->dgh = (s->dgh + 1) % DGRAMQ)
+        pbuf_free(s->dgrams[s->dgh].p);
+    // Connections nobody accepted go with the listener.
+    for (; s->nacc > 0; s->nacc--, s->acch = (s->acch + 1) % ACCEPTQ) {
+        sock_release(&socks[s->accq[s->acch]]);
+        socks[s->accq[s->acch]].state = SOCK_FREE;
+    }
+    s->state = SOCK_CLOSED;
+    s->eof = true;
+    sock_wake(s);
+}
 
-    for (;;) {
-        uint32_t cur = sys_time_msec();
+/* lwIP callbacks.  They only record what happened; see ns_wakeups. */
 
-        lwip_core_lock();
-        t->func();
-        lwip_core_unlock();
+static err_t
+ns_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    struct ns_sock *s = arg;
 
-        thread_wait(0, 0, cur + t->msec);
+    if (s == NULL || s->state == SOCK_CLOSED) {
+        if (p) {
+            tcp_recved(pcb, p->tot_len);
+            pbuf_free(p);
+        }
+        return ERR_OK;
     }
+    if (p == NULL)
+        s->eof = true;
+    else if (s->rxq == NULL)
+        s->rxq = p;
+    else
+        pbuf_cat(s->rxq, p);
+    sock_wake(s);
+    return ERR_OK;
 }
 
-    static void
-start_timer(struct timer_thread *t, void (*func)(void), const char *name, int msec)
+static err_t
+ns_tcp_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
 {
-    t->msec = msec;
-    t->func = func;
-    t->name = name;
-    int r = thread_create(0, name, &net_timer, (uint64_t)t);
-    if (r < 0)
-        panic("cannot create timer thread: %s", e2s(r));
+    struct ns_sock *s = arg;
+
+    if (s) {
+        sock_unpin(s);
+        sock_wake(s);
+    }
+    return ERR_OK;
 }
 
-    static void
-tcpip_init_done(void *arg)
+// The pcb is already gone when this is called.
+static void
+ns_tcp_err(void *arg, err_t err)
 {
-    uint32_t *done = arg;
-    *done = 1;
-    thread_wakeup(done);
+    struct ns_sock *s = arg;
+
+    if (s == NULL)
+        return;
+    s->tcp = NULL;
+    s->err = err;
+    s->eof = true;
+    if (s->state != SOCK_LISTEN)
+        s->state = SOCK_CLOSED;
+    sock_unpin(s);
+    sock_wake(s);
 }
 
-    void
-serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
+static err_t
+ns_tcp_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    struct ns_sock *s = arg;
+
+    if (s) {
+        s->state = SOCK_CONNECTED;
+        sock_wake(s);
+    }
+    return ERR_OK;
+}
+
+// Take the connection right away, so that nothing it sends before the
+// client gets around to accept() is lost; it waits in the listener's
+// queue until then.
+static err_t
+ns_tcp_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    struct ns_sock *l = arg, *s;
+    int i;
+
+    if (l == NULL || l->nacc == ACCEPTQ || (i = sock_alloc(SOCK_STREAM)) < 0)
+        return ERR_MEM;
+    s = &socks[i];
+    s->state = SOCK_CONNECTED;
+    s->remote_ip = pcb->remote_ip;
+    s->remote_port = pcb->remote_port;
+    sock_attach_tcp(s, pcb);
+    l->accq[(l->acch + l->nacc++) % ACCEPTQ] = i;
+    sock_wake(l);
+    return ERR_OK;
+}
+
+static void
+ns_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+            struct ip_addr *addr, u16_t port)
+{
+    struct ns_sock *s = arg;
+    struct ns_dgram *d;
+
+    if (s == NULL || s->ndgram == DGRAMQ) {
+        pbuf_free(p);
+        return;
+    }
+    d = &s->dgrams[(s->dgh + s->ndgram++) % DGRAMQ];
+    d->p = p;
+    d->addr = *addr;
+    d->port = port;
+    sock_wake(s);
+}
+
+static void
+sockaddr_to_ip(const struct sockaddr *name, struct ip_addr *ip, u16_t *port)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)name;
+    ip->addr = sin->sin_addr.s_addr;
+    *port = ntohs(sin->sin_port);
+}
+
+// Before an unbound TCP socket connects, bind it to a local port that
+// makes the card hash the connection's incoming frames onto our own RX
+// queue.  Otherwise replies would go to whichever shard RSS picks, which
+// has never heard of the connection.
+static int
+shard_bind_local(struct ns_sock *s, const struct sockaddr *name, socklen_t namelen)
+{
+    const struct sockaddr_in *to = (const struct sockaddr_in *)name;
+    static uint16_t next_port = 49152;
+    uint8_t tuple[12];
+    int i;
+
+    if (nshards < 2 || namelen < sizeof(*to) || to->sin_family != AF_INET)
+        return 0;
+    if (s->tcp->local_port != 0)
+        return 0;
+
+    // Source and destination as the card sees the reply.
+    memmove(&tuple[0], &to->sin_addr.s_addr, 4);
+    memmove(&tuple[4], &nif.ip_addr.addr, 4);
+    memmove(&tuple[8], &to->sin_port, 2);
+    for (i = 0; i < 16384; i++) {
+        uint16_t port = next_port;
+        uint16_t nport = htons(port);
+        next_port = next_port == 0xffff ? 49152 : next_port + 1;
+        memmove(&tuple[10], &nport, 2);
+        if (NIC_RSS_QUEUE(nic_rss_hash(tuple, sizeof(tuple)), nshards) != shard)
+            continue;
+        if (tcp_bind(s->tcp, IP_ADDR_ANY, port) == ERR_OK)
+            return 0;
+    }
+    return -E_NO_MEM;
+}
+
+static int
+serve_socket(struct Nsreq_socket *rq)
+{
+    struct ns_sock *s;
+    int i;
+
+    if (rq->req_domain != PF_INET
+        || (rq->req_type != SOCK_STREAM && rq->req_type != SOCK_DGRAM))
+        return -E_NOT_SUPP;
+    if ((i = sock_alloc(rq->req_type)) < 0)
+        return i;
+    s = &socks[i];
+    if (rq->req_type == SOCK_STREAM) {
+        struct tcp_pcb *pcb = tcp_new();
+        if (pcb)
+            sock_attach_tcp(s, pcb);
+    } else if ((s->udp = udp_new()) != NULL) {
+        udp_recv(s->udp, ns_udp_recv, s);
+    }
+    if (s->tcp == NULL && s->udp == NULL) {
+        s->state = SOCK_FREE;
+        return -E_NO_MEM;
+    }
+    return i;
+}
+
+static int
+serve_bind(struct ns_sock *s, struct Nsreq_bind *rq)
+{
+    struct ip_addr ip;
+    u16_t port;
+
+    sockaddr_to_ip(&rq->req_name, &ip, &port);
+    if (s->tcp && s->state == SOCK_NEW)
+        return ns_err(tcp_bind(s->tcp, &ip, port));
+    if (s->udp)
+        return ns_err(udp_bind(s->udp, &ip, port));
+    return -E_INVAL;
+}
+
+static int
+serve_listen(struct ns_sock *s)
+{
+    struct tcp_pcb *lpcb;
+
+    if (s->tcp == NULL || s->state != SOCK_NEW)
+        return -E_INVAL;
+    if ((lpcb = tcp_listen(s->tcp)) == NULL)
+        return -E_NO_MEM;
+    s->tcp = lpcb;
+    s->state = SOCK_LISTEN;
+    tcp_accept(lpcb, ns_tcp_accept);
+    return 0;
+}
+
+// Take the oldest datagram s has received: copy up to 'len' bytes of it
+// into 'buf', dropping the rest, and its sender into *ip and *port if
+// ip isn't NULL.  Returns the byte count, or -1 if there is none.
+static int
+dgram_take(struct ns_sock *s, void *buf, int len, struct ip_addr *ip, u16_t *port)
+{
+    struct ns_dgram *d = &s->dgrams[s->dgh];
+    int n;
+
+    if (s->ndgram == 0)
+        return -1;
+    n = pbuf_copy_partial(d->p, buf, MIN(len, d->p->tot_len), 0);
+    if (ip) {
+        *ip = d->addr;
+        *port = d->port;
+    }
+    pbuf_free(d->p);
+    s->dgh = (s->dgh + 1) % DGRAMQ;
+    s->ndgram--;
+    return n;
+}
+
+// Copy up to 'len' bytes of what s has received into 'buf'.
+// Returns the byte count, or 0 if there is nothing.
+static int
+sock_read(struct ns_sock *s, void *buf, int len)
+{
+    int n;
+
+    if (s->type == SOCK_DGRAM)
+        return MAX(dgram_take(s, buf, len, NULL, NULL), 0);
+
+    if (s->rxq == NULL)
+        return 0;
+    n = pbuf_copy_partial(s->rxq, buf, MIN(len, s->rxq->tot_len), 0);
+    for (len = n; len > 0 && len >= s->rxq->len; ) {
+        struct pbuf *p = s->rxq;
+        len -= p->len;
+        s->rxq = pbuf_dechain(p);
+        pbuf_free(p);
+    }
+    if (len > 0)
+        pbuf_header(s->rxq, -len);
+    if (s->tcp)
+        tcp_recved(s->tcp, n);
+    return n;
+}
+
+// Queue as much of the rest of a send request as s has room for.
+// Without TCP_WRITE_FLAG_COPY in 'flags', lwIP's segments refer to
+// 'buf' itself, which must then stay put until sock_unpin.
+// Returns the number of bytes queued, or < 0 on error.
+static int
+sock_write(struct ns_sock *s, const char *buf, int len, u8_t flags)
+{
+    int n, sent = 0;
+    err_t err;
+
+    while (sent < len && (n = MIN(len - sent, tcp_sndbuf(s->tcp))) > 0) {
+        if ((err = tcp_write(s->tcp, buf + sent, n, flags)) == ERR_MEM)
+            break;
+        if (err != ERR_OK)
+            return ns_err(err);
+        sent += n;
+    }
+    if (sent > 0)
+        tcp_output(s->tcp);
+    return sent;
+}
+
+// Send 'size' bytes from 'buf' as one datagram, to ip:port or, if ip is
+// NULL, to the address s is connected to.  Returns size or < 0.
+static int
+sock_sendto(struct ns_sock *s, const void *buf, int size, struct ip_addr *ip, u16_t port)
+{
+    struct pbuf *p;
+    err_t err;
+
+    if (s->udp == NULL)
+        return -E_INVAL;
+    if ((p = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM)) == NULL)
+        return -E_NO_MEM;
+    memmove(p->payload, buf, size);
+    err = ip ? udp_sendto(s->udp, p, ip, port) : udp_send(s->udp, p);
+    pbuf_free(p);
+    return err == ERR_OK ? size : ns_err(err);
+}
+
+// Which of 'events' s is ready for, plus POLLHUP/POLLERR/POLLNVAL.
+static int
+sock_poll(struct ns_sock *s, int events)
+{
+    int r = 0;
+
+    if (s == NULL)
+        return POLLNVAL;
+    if (s->state == SOCK_LISTEN) {
+        // Workers sharing a listener each see only the connections
+        // nobody has been told of yet, so each one wakes one poller;
+        // ns_retry_polls goes longest waiting first.
+        if (s->nacc > s->granted && (events & POLLIN)) {
+            s->granted++;
+            r |= POLLIN;
+        }
+    } else if (s->type == SOCK_DGRAM) {
+        if (s->ndgram > 0)
+            r |= POLLIN;
+        r |= POLLOUT;
+    } else {
+        if (s->rxq || s->eof)
+            r |= POLLIN;
+        if (s->tcp && s->state == SOCK_CONNECTED && tcp_sndbuf(s->tcp) > 0
+            && s->tcp->snd_queuelen < TCP_SND_QUEUELEN)
+            r |= POLLOUT;
+        if (s->state == SOCK_CLOSED)
+            r |= POLLHUP;
+        if (s->err && s->err != ERR_CLSD)
+            r |= POLLERR;
+    }
+    return r & (events | POLLHUP | POLLERR);
+}
+
+static bool
+serve_poll(struct ns_req *q, struct Nsreq_poll *rq, int *r)
+{
+    int i, n = 0;
+
+    if (rq->req_n < 0 || rq->req_n > NSPOLL_MAX) {
+        *r = -E_INVAL;
+        return true;
+    }
+    for (i = 0; i < rq->req_n; i++) {
+        struct Nspollfd *pf = &rq->req_fds[i];
+        pf->revents = sock_poll(sock_get(pf->s), pf->events);
+        n += pf->revents != 0;
+    }
+    if (n > 0 || rq->req_timeout == 0) {
+        *r = n;
+        return true;
+    }
+    if (rq->req_timeout > 0) {
+        if (!q->done) {
+            q->deadline = sys_time_msec() + rq->req_timeout;
+            q->done = 1;
+        } else if ((int32_t)(sys_time_msec() - q->deadline) >= 0) {
+            *r = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Carry out the request in buffer slot 'i', or as much of it as can be
+// done now.  Returns true and sets *r to the reply once it is done;
+// false means it has to wait for its socket.
+static bool
+serve_req(int i, int *r)
+{
+    struct ns_req *q = &reqs[i];
+    union Nsipc *req = REQ_PAGE(i);
+    struct ns_sock *s = NULL;
+    int sid = -1;
+
+    switch (q->reqno) {
+    case NSREQ_SOCKET:
+        *r = serve_socket(&req->socket);
+        return true;
+    case NSREQ_SHARDS:
+        memmove(req->shardsRet.ret_envids, shard_envids,
+                sizeof(req->shardsRet.ret_envids));
+        *r = nshards;
+        return true;
+    case NSREQ_STATS:
+        memmove(&req->statsRet, &bufstats, sizeof(bufstats));
+        *r = 0;
+        return true;
+    case NSREQ_POLL:
+        return serve_poll(q, &req->poll, r);
+    case NSREQ_INPUT:
+    case NSREQ_INPUT_BATCH:
+        // Frames come only from our input env, which the flags about
+        // verified checksums are taken on trust from, and are bounded
+        // by the page like a sendmmsg's datagrams.
+        *r = 0;
+        if (q->whom != input_envid) {
+            cprintf("ns: input from %08x, not the input env\n", q->whom);
+            return true;
+        }
+        if (q->reqno == NSREQ_INPUT) {
+            int len = req->pkt.jp_len;
+            if (len > 0 && len <= (int)(PGSIZE - sizeof(struct jif_pkt)))
+                jif_input_frame(&nif, req->pkt.jp_data, len, 0);
+            return true;
+        }
+        {
+            char *rec = req->batch.pb_data;
+            int count = req->batch.pb_count, j, off;
+            struct pkt_rec pr;
+
+            for (j = 0; j < count; j++, rec += PKT_REC_SIZE(pr.pr_len)) {
+                off = rec - req->batch.pb_data;
+                if (off + sizeof(pr) > PKT_BATCH_DATASZ)
+                    break;
+                memmove(&pr, rec, sizeof(pr));
+                if (pr.pr_len <= 0
+                    || pr.pr_len > (int)(PKT_BATCH_DATASZ - off - sizeof(pr)))
+                    break;
+                jif_input_frame(&nif, rec + sizeof(pr), pr.pr_len, pr.pr_flags);
+            }
+            return true;
+        }
+    // Every other request starts with the socket it's about.
+    case NSREQ_ACCEPT:
+    case NSREQ_BIND:
+    case NSREQ_SHUTDOWN:
+    case NSREQ_CLOSE:
+    case NSREQ_CONNECT:
+    case NSREQ_LISTEN:
+    case NSREQ_RECV:
+    case NSREQ_RECV_PAGE:
+    case NSREQ_SEND:
+    case NSREQ_SENDPAGE:
+    case NSREQ_SENDTO:
+    case NSREQ_RECVFROM:
+    case NSREQ_SENDMMSG:
+    case NSREQ_RECVMMSG:
+        // A lent page is all data; serve() took its socket from the
+        // IPC value.
+        sid = q->reqno == NSREQ_SENDPAGE ? q->sock : req->accept.req_s;
+        if ((s = sock_get(sid)) == NULL) {
+            *r = -E_INVAL;
+            return true;
+        }
+        q->sock = sid;
+        break;
+    default:
+        cprintf("Invalid request code %d from %08x\n", q->reqno, q->whom);
+        *r = -E_INVAL;
+        return true;
+    }
+
+    switch (q->reqno) {
+    case NSREQ_ACCEPT:
+        {
+            struct Nsret_accept ret;
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ret.ret_addr;
+            struct ns_sock *ns;
+            int n;
+
+            if (s->state != SOCK_LISTEN) {
+                *r = s->err ? ns_err(s->err) : -E_INVAL;
+                return true;
+            }
+            if (s->nacc == 0) {
+                if (!(req->accept.req_flags & MSG_DONTWAIT))
+                    return false;
+                *r = -E_AGAIN;
+                return true;
+            }
+            n = s->accq[s->acch];
+            s->acch = (s->acch + 1) % ACCEPTQ;
+            s->nacc--;
+            if (s->granted > 0)
+                s->granted--;
+            tcp_accepted(s->tcp);
+            ns = &socks[n];
+            memset(&ret, 0, sizeof(ret));
+            sin->sin_len = sizeof(*sin);
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(ns->remote_port);
+            sin->sin_addr.s_addr = ns->remote_ip.addr;
+            ret.ret_addrlen = sizeof(*sin);
+            memmove(req, &ret, sizeof ret);
+            *r = n;
+            return true;
+        }
+    case NSREQ_BIND:
+        *r = serve_bind(s, &req->bind);
+        return true;
+    case NSREQ_LISTEN:
+        *r = serve_listen(s);
+        return true;
+    case NSREQ_SHUTDOWN:
+        // Like lwip_shutdown before it, this closes both directions.
+        sock_release(s);
+        *r = 0;
+        return true;
+    case NSREQ_CLOSE:
+        sock_release(s);
+        s->orphan = true;
+        if (!s->lingering)
+            s->state = SOCK_FREE;
+        *r = 0;
+        return true;
+    case NSREQ_CONNECT:
+        {
+            struct ip_addr ip;
+            u16_t port;
+            int e;
+
+            if (s->udp) {
+                sockaddr_to_ip(&req->connect.req_name, &ip, &port);
+                *r = ns_err(udp_connect(s->udp, &ip, port));
+                return true;
+            }
+            if (q->done) {
+                // Waiting for the handshake to finish.
+                if (s->state == SOCK_CONNECTING)
+                    return false;
+                *r = s->state == SOCK_CONNECTED ? 0 : ns_err(s->err ? s->err : ERR_CONN);
+                return true;
+            }
+            if (s->tcp == NULL || s->state != SOCK_NEW) {
+                *r = -E_INVAL;
+                return true;
+            }
+            if ((e = shard_bind_local(s, &req->connect.req_name,
+                                      req->connect.req_namelen)) < 0) {
+                *r = e;
+                return true;
+            }
+            sockaddr_to_ip(&req->connect.req_name, &ip, &port);
+            if ((*r = ns_err(tcp_connect(s->tcp, &ip, port, ns_tcp_connected))) < 0)
+                return true;
+            s->state = SOCK_CONNECTING;
+            q->done = 1;
+            return false;
+        }
+    case NSREQ_RECV_PAGE:
+    case NSREQ_RECV:
+        {
+            int len = MIN(req->recv.req_len, PGSIZE);
+            int flags = req->recv.req_flags;
+            int n;
+
+            // A full page waiting goes back as a page of its own, to be
+            // mapped over the client's buffer: one copy, out of the
+            // pbufs, instead of two.
+            if (q->reqno == NSREQ_RECV_PAGE && len == PGSIZE && s->rxq
+                && s->rxq->tot_len >= PGSIZE
+                && sys_page_alloc(0, (void *)RECVPG, PTE_P|PTE_U|PTE_W) == 0) {
+                *r = sock_read(s, (void *)RECVPG, PGSIZE);
+                q->reply_pg = true;
+                return true;
+            }
+            n = sock_read(s, req->recvRet.ret_buf, len);
+
+            if (n > 0 || len == 0 || (s->eof && s->type == SOCK_STREAM)) {
+                *r = n > 0 || !s->err || s->err == ERR_CLSD ? n : ns_err(s->err);
+                return true;
+            }
+            if (s->state == SOCK_CLOSED || (s->tcp == NULL && s->udp == NULL)) {
+                *r = s->err ? ns_err(s->err) : 0;
+                return true;
+            }
+            if (flags & MSG_DONTWAIT) {
+                *r = -E_AGAIN;
+                return true;
+            }
+            return false;
+        }
+    case NSREQ_SENDTO:
+        {
+            struct ip_addr ip;
+            u16_t port;
+            int size = req->sendto.req_size;
+
+            if (size < 0 || size > PGSIZE - sizeof(struct Nsreq_sendto)) {
+                *r = -E_INVAL;
+                return true;
+            }
+            sockaddr_to_ip(&req->sendto.req_to, &ip, &port);
+            *r = sock_sendto(s, req->sendto.req_buf, size, &ip, port);
+            return true;
+        }
+    case NSREQ_RECVFROM:
+        {
+            struct Nsret_recvfrom *ret = &req->recvfromRet;
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ret->ret_from;
+            int len = MIN(req->recv.req_len, PGSIZE - sizeof(*ret));
+            int flags = req->recv.req_flags;
+            struct ip_addr ip;
+            u16_t port;
+            int n;
+
+            if (s->udp == NULL) {
+                *r = -E_INVAL;
+                return true;
+            }
+            if ((n = dgram_take(s, ret->ret_buf, len, &ip, &port)) < 0) {
+                if (flags & MSG_DONTWAIT) {
+                    *r = -E_AGAIN;
+                    return true;
+                }
+                return false;
+            }
+            memset(sin, 0, sizeof(*sin));
+            sin->sin_len = sizeof(*sin);
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sin->sin_addr.s_addr = ip.addr;
+            ret->ret_fromlen = sizeof(*sin);
+            *r = n;
+            return true;
+        }
+    case NSREQ_SENDMMSG:
+        {
+            struct Nsreq_mmsg *m = &req->mmsg;
+            struct Nsdgram *d = NSMMSG_FIRST(m);
+            struct ip_addr ip;
+            int j, off, e = 0;
+
+            if (m->req_used < 0 || m->req_used > NSMMSG_DATASZ) {
+                *r = -E_INVAL;
+                return true;
+            }
+            for (j = 0; j < m->req_count; j++, d = NSMMSG_NEXT(d)) {
+                off = (char *)d - m->req_data;
+                if (off + sizeof(*d) > m->req_used
+                    || off + NSDGRAM_SIZE(d->nd_len) > m->req_used) {
+                    e = -E_INVAL;
+                    break;
+                }
+                ip.addr = d->nd_addr;
+                if ((e = sock_sendto(s, d->nd_data, d->nd_len, &ip, ntohs(d->nd_port))) < 0)
+                    break;
+            }
+            *r = j > 0 ? j : e;
+            return true;
+        }
+    case NSREQ_RECVMMSG:
+        {
+            struct Nsreq_mmsg *m = &req->mmsg;
+            struct Nsdgram *d = NSMMSG_FIRST(m);
+            int maxlen = MIN(m->req_maxlen, NSMMSG_DATASZ - sizeof(*d));
+            struct ip_addr ip;
+            u16_t port;
+            int j;
+
+            if (s->udp == NULL || m->req_count < 0 || maxlen < 0) {
+                *r = -E_INVAL;
+                return true;
+            }
+            m->req_used = 0;
+            for (j = 0; j < m->req_count && s->ndgram > 0; j++) {
+                if (!NSMMSG_FITS(m, MIN(maxlen, s->dgrams[s->dgh].p->tot_len)))
+                    break;
+                d->nd_len = dgram_take(s, d->nd_data, maxlen, &ip, &port);
+                d->nd_addr = ip.addr;
+                d->nd_port = htons(port);
+                m->req_used += NSDGRAM_SIZE(d->nd_len);
+                d = NSMMSG_NEXT(d);
+            }
+            if (j == 0 && m->req_count > 0) {
+                if (!(m->req_flags & MSG_DONTWAIT))
+                    return false;
+                *r = -E_AGAIN;
+                return true;
+            }
+            *r = j;
+            return true;
+        }
+    case NSREQ_SENDPAGE:
+        {
+            int n;
+
+            if (s->tcp == NULL || s->state != SOCK_CONNECTED) {
+                *r = s->err ? ns_err(s->err) : -E_CONN;
+                return true;
+            }
+            if ((n = sock_write(s, (char *)req + q->done, PGSIZE - q->done, 0)) < 0) {
+                *r = n;
+                return true;
+            }
+            q->done += n;
+            if (q->done < PGSIZE)
+                return false;
+            *r = PGSIZE;
+            return true;
+        }
+    case NSREQ_SEND:
+        {
+            int size = req->send.req_size, n;
+
+            if (size < 0 || size > PGSIZE - sizeof(struct Nsreq_send)) {
+                *r = -E_INVAL;
+                return true;
+            }
+            if (s->udp) {
+                *r = sock_sendto(s, req->send.req_buf, size, NULL, 0);
+                return true;
+            }
+            if (s->tcp == NULL || s->state != SOCK_CONNECTED) {
+                *r = s->err ? ns_err(s->err) : -E_CONN;
+                return true;
+            }
+            if ((n = sock_write(s, req->send.req_buf + q->done, size - q->done,
+                                TCP_WRITE_FLAG_COPY)) < 0) {
+                *r = n;
+                return true;
+            }
+            q->done += n;
+            // Like the blocking lwip_send, reply only once it's all queued.
+            if (q->done == size) {
+                *r = size;
+                return true;
+            }
+            if (req->send.req_flags & MSG_DONTWAIT) {
+                *r = q->done > 0 ? q->done : -E_AGAIN;
+                return true;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+static void
+req_finish(int i, int r)
 {
-    int r;
-    lwip_core_lock();
+    struct ns_req *q = &reqs[i];
+    struct ns_sock *s;
 
-    uint32_t done = 0;
-    tcpip_init(&tcpip_init_done, &done);
-    lwip_core_unlock();
-    thread_wait(&done, 0, (uint32_t)~0);
-    lwip_core_lock();
+    if (q->reply_pg) {
+        ipc_send(q->whom, r, (void *)RECVPG, PTE_P|PTE_U|PTE_W);
+        sys_page_unmap(0, (void *)RECVPG);
+    } else if (q->reqno != NSREQ_INPUT && q->reqno != NSREQ_INPUT_BATCH)
+        ipc_send(q->whom, r, 0, 0);
 
-    lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+    // Whatever lwIP queued from a lent page stays until it's sent.
+    if (q->reqno == NSREQ_SENDPAGE && q->done > 0
+        && (s = &socks[q->sock])->tcp != NULL) {
+        q->pin_end = s->tcp->snd_lbb;
+        q->next = -1;
+        if (s->pinq < 0)
+            s->pinq = i;
+        else
+            reqs[s->pinq_tail].next = i;
+        s->pinq_tail = i;
+        sock_unpin(s);
+        return;
+    }
+    put_buffer(REQ_PAGE(i));
+    sys_page_unmap(0, REQ_PAGE(i));
+}
+
+// Queue the request in slot 'i' behind whatever else waits on its
+// socket.  A poll waits on all sockets at once, on pollq.
+static void
+req_park(int i)
+{
+    struct ns_sock *s = &socks[reqs[i].sock];
 
-    start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
-    start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
-    start_timer(&t_tcps, &tcp_slowtmr, "tcp s timer", TCP_SLOW_INTERVAL);
+    if (reqs[i].reqno == NSREQ_POLL) {
+        reqs[i].next = -1;
+        if (pollq < 0)
+            pollq = i;
+        else
+            reqs[pollq_tail].next = i;
+        pollq_tail = i;
+        return;
+    }
+    reqs[i].next = -1;
+    if (s->waitq < 0)
+        s->waitq = i;
+    else
+        reqs[s->waitq_tail].next = i;
+    s->waitq_tail = i;
+}
+
+// Retry the waiting polls: all of them answer in one go whatever
+// became ready, rather than one notification per socket.
+static void
+ns_retry_polls(void)
+{
+    int i, r, next, *pp;
+
+    poll_due = false;
+    pollq_tail = -1;
+    for (pp = &pollq; (i = *pp) >= 0; i = next) {
+        next = reqs[i].next;
+        if (!serve_req(i, &r)) {
+            pp = &reqs[i].next;
+            pollq_tail = i;
+            continue;
+        }
+        *pp = next;
+        req_finish(i, r);
+    }
+}
+
+// Retry, in order, every request waiting on a socket something has
+// happened to since the last time, then the polls if anything did.
+// Requests on a socket that has been closed fail.
+static void
+ns_wakeups(void)
+{
+    int k, i, prev, next, r;
+
+    if (wake_pending)
+        poll_due = true;
+    while (wake_pending) {
+        wake_pending = false;
+        for (k = 0; k < NSOCK; k++) {
+            struct ns_sock *s = &socks[k];
+            if (!s->wake)
+                continue;
+            s->wake = false;
+            for (prev = -1, i = s->waitq; i >= 0; i = next) {
+                next = reqs[i].next;
+                if (s->state == SOCK_FREE)
+                    r = -E_INVAL;
+                else if (!serve_req(i, &r)) {
+                    prev = i;
+                    continue;
+                }
+                if (prev < 0)
+                    s->waitq = next;
+                else
+                    reqs[prev].next = next;
+                if (s->waitq_tail == i)
+                    s->waitq_tail = prev;
+                req_finish(i, r);
+            }
+        }
+    }
+    if (poll_due)
+        ns_retry_polls();
+}
+
+static void
+ns_netif_init(struct netif *nif, void *if_state,
+        uint32_t init_addr, uint32_t init_mask, uint32_t init_gw)
+{
+    struct ip_addr ipaddr, netmask, gateway;
+    ipaddr.addr  = init_addr;
+    netmask.addr = init_mask;
+    gateway.addr = init_gw;
+
+    if (0 == netif_add(nif, &ipaddr, &netmask, &gateway,
+                if_state,
+                jif_init,
+                ip_input))
+        panic("lwip_init: error in netif_add\n");
+
+    netif_set_default(nif);
+    netif_set_up(nif);
+}
+
+    void
+serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
+{
+    uint32_t now = sys_time_msec();
+    int i;
+
+    buffer_init();
+    lwip_init();
+    ns_netif_init(&nif, &output_envid, ipaddr, netmask, gw);
+    for (i = 0; i < NTIMERS; i++)
+        timers[i].next = now + timers[i].msec;
 
     struct in_addr ia = {ipaddr};
     cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
@@ -155,14 +1165,27 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
             nif.hwaddr[3], nif.hwaddr[4], nif.hwaddr[5],
             inet_ntoa(ia));
 
-    lwip_core_unlock();
+    cprintf("NS: TCP/IP initialized, %d sockets in %d bytes.\n",
+            NSOCK, (int)(sizeof(socks) + sizeof(reqs)));
+}
 
-    cprintf("NS: TCP/IP initialized.\n");
+// Run whichever lwIP timers are due.
+static void
+run_timers(uint32_t now) {
+    int i;
+
+    for (i = 0; i < NTIMERS; i++)
+        if ((int32_t)(now - timers[i].next) >= 0) {
+            timers[i].func();
+            timers[i].next = now + timers[i].msec;
+        }
 }
 
+// Run the lwIP timers, and tell the timer env when to check in next.
 static void
 process_timer(envid_t envid) {
-    uint32_t start, now, to;
+    uint32_t start, now;
+    int i;
 
     if (envid != timer_envid) {
         cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
@@ -170,110 +1193,77 @@ process_timer(envid_t envid) {
     }
 
     start = sys_time_msec();
-    thread_yield();
+    run_timers(start);
+    // Polls with a deadline give up on the next ns_wakeups, and
+    // connections promised to a poller that hasn't taken them since are
+    // offered again.
+    poll_due = true;
+    for (i = 0; i < NSOCK; i++)
+        socks[i].granted = 0;
     now = sys_time_msec();
 
-    to = TIMER_INTERVAL - (now - start);
-    ipc_send(envid, to, 0, 0);
+    ipc_send(envid, TIMER_INTERVAL - MIN(now - start, TIMER_INTERVAL), 0, 0);
 }
 
-struct st_args {
-    int32_t reqno;
-    uint32_t whom;
-    union Nsipc *req;
-};
-
+// Take in the frames in the RX ring and the packets lwIP looped back
+// to itself, and answer the requests that unblocks.  Answering can loop
+// more packets back (a send to a socket in this same ns), so go until
+// there are none.
 static void
-serve_thread(uint64_t a) {
-    struct st_args *args = (struct st_args *)a;
-    union Nsipc *req = args->req;
-    int r;
-
-    switch (args->reqno) {
-        case NSREQ_ACCEPT:
-            {
-                struct Nsret_accept ret;
-                r = lwip_accept(req->accept.req_s, &ret.ret_addr,
-                        &ret.ret_addrlen);
-                memmove(req, &ret, sizeof ret);
-                break;
-            }
-        case NSREQ_BIND:
-            r = lwip_bind(req->bind.req_s, &req->bind.req_name,
-                    req->bind.req_namelen);
-            break;
-        case NSREQ_SHUTDOWN:
-            r = lwip_shutdown(req->shutdown.req_s, req->shutdown.req_how);
-            break;
-        case NSREQ_CLOSE:
-            r = lwip_close(req->close.req_s);
-            break;
-        case NSREQ_CONNECT:
-            r = lwip_connect(req->connect.req_s, &req->connect.req_name,
-                    req->connect.req_namelen);
-            break;
-        case NSREQ_LISTEN:
-            r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
-            break;
-        case NSREQ_RECV:
-            // Note that we read the request fields before we
-            // overwrite it with the response data.
-            r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-                    req->recv.req_len, req->recv.req_flags);
-            break;
-        case NSREQ_SEND:
-            r = lwip_send(req->send.req_s, &req->send.req_buf,
-                    req->send.req_size, req->send.req_flags);
-            break;
-        case NSREQ_SOCKET:
-            r = lwip_socket(req->socket.req_domain, req->socket.req_type,
-                    req->socket.req_protocol);
-            break;
-        case NSREQ_INPUT:
-            jif_input(&nif, (void *)&req->pkt);
-            r = 0;
-            break;
-        default:
-            cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
-            r = -E_INVAL;
-            break;
-    }
+ns_input(void) {
+    do {
+        jif_poll(&nif);
+        netif_poll(&nif);
+        ns_wakeups();
+    } while (nif.loop_first != NULL);
+}
 
-    if (r == -1) {
-        char buf[100];
-        snprintf(buf, sizeof buf, "ns req type %d", args->reqno);
-        perror(buf);
+// Every request page is taken.  Stop receiving, which leaves clients
+// (and the timer env) retrying their ipc_send, and keep the network
+// moving ourselves until some request finishes.
+static void
+wait_for_buffer(void) {
+    bufstats.ret_waits++;
+    while (nfree == 0) {
+        run_timers(sys_time_msec());
+        ns_input();
+        jif_flush(&nif);
+        if (nfree == 0)
+            sys_yield();
     }
-
-    if (args->reqno != NSREQ_INPUT)
-        ipc_send(args->whom, r, 0, 0);
-
-    put_buffer(args->req);
-    sys_page_unmap(0, (void*) args->req);
-    free(args);
 }
 
 void
 serve(void) {
     int32_t reqno;
     uint32_t whom;
-    int i, perm;
+    int i, perm, r;
     void *va;
 
     while (1) {
-        // ipc_recv will block the entire process, so we flush
-        // all pending work from other threads.  We limit the
-        // number of yields in case there's a rogue thread.
-        for (i = 0; thread_wakeups_pending() && i < 32; ++i)
-            thread_yield();
+        // Take in whatever is in the RX ring, if we own it, answer the
+        // requests that unblocks, and push out whatever lwIP queued for
+        // transmission meanwhile.
+        ns_input();
+        jif_flush(&nif);
 
+        if ((va = get_buffer()) == NULL) {
+            wait_for_buffer();
+            continue;
+        }
         perm = 0;
-        va = get_buffer();
         reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
         if (debug) {
             cprintf("ns req %d from %08x\n", reqno, whom);
         }
 
+        // The kernel's nudge that frames are waiting in the RX ring;
+        // jif_poll picks them up at the top of the loop.
+        if (whom == 0 && reqno == NIC_RX_NOTIFY) {
+            put_buffer(va);
+            continue;
+        }
+
         // first take care of requests that do not contain an argument page
         if (reqno == NSREQ_TIMER) {
             process_timer(whom);
@@ -284,39 +1274,75 @@ serve(void) {
         // All remaining requests must contain an argument page
         if (!(perm & PTE_P)) {
             cprintf("Invalid request from %08x: no argument page\n", whom);
+            put_buffer(va);
             continue; // just leave it hanging...
         }
 
-        // Since some lwIP socket calls will block, create a thread and
-        // process the rest of the request in the thread.
-        struct st_args *args = malloc(sizeof(struct st_args));
-        if (!args)
-            panic("could not allocate thread args structure");
-
-        args->reqno = reqno;
-        args->whom = whom;
-        args->req = va;
-
-        thread_create(0, "serve_thread", serve_thread, (uint64_t)args);
-        thread_yield(); // let the thread created run
+        i = ((uintptr_t)va - REQVA) / PGSIZE;
+        reqs[i].whom = whom;
+        reqs[i].reqno = reqno;
+        reqs[i].done = 0;
+        reqs[i].reply_pg = false;
+        if ((uint32_t)reqno & NSREQ_SENDPAGE_BIT) {
+            reqs[i].reqno = NSREQ_SENDPAGE;
+            reqs[i].sock = (uint32_t)reqno & ~NSREQ_SENDPAGE_BIT;
+        }
+        if (serve_req(i, &r))
+            req_finish(i, r);
+        else
+            req_park(i);
+        // Before anything can reuse a socket this request closed.
+        ns_wakeups();
     }
 }
 
-static void
-tmain(uint64_t arg) {
-    serve_init(inet_addr(IP),
-            inet_addr(MASK),
-            inet_addr(DEFAULT));
-    serve();
+// Take RX queue 0 and fork one more shard for each further queue the
+// card has.  Each shard owns its queue (and the TX queue paired with
+// it), runs its own lwIP and timer env, and serves the clients whose
+// sockets live there; lib/nsipc.c does the routing.  Only shard 0 has
+// ENV_TYPE_NS, so clients find it and learn of the rest with
+// NSREQ_SHARDS.  Returns < 0 if the kernel won't hand over queue 0.
+static int
+shard_start(void)
+{
+    uint32_t nq;
+    envid_t id;
+    int q, r;
+
+    if ((r = jif_attach(0, &nq)) < 0)
+        return r;
+    shard_envids[0] = sys_getenvid();
+    nshards = MIN(nq, NS_MAXSHARDS);
+    for (q = 1; q < nshards; q++) {
+        if ((id = fork()) < 0)
+            panic("error forking shard: %e", id);
+        if (id == 0) {
+            shard = q;
+            if ((r = jif_attach(q, NULL)) < 0)
+                panic("ns shard %d: jif_attach: %e", q, r);
+            return 0;
+        }
+        shard_envids[q] = id;
+    }
+    jif_arp_mirror(&shard_envids[1], nshards - 1);
+    if (nshards > 1)
+        cprintf("ns: %d shards\n", nshards);
+    return 0;
 }
 
     void
 umain(int argc, char **argv)
 {
-    envid_t ns_envid = sys_getenvid();
+    envid_t ns_envid;
+    int r = 0;
 
     binaryname = "ns";
 
+    // Shard first, so that each shard forks its own timer.
+    if (NS_FASTPATH)
+        r = shard_start();
+    ns_envid = sys_getenvid();
+
     // fork off the timer thread which will send us periodic messages
     timer_envid = fork();
     if (timer_envid < 0)
@@ -326,6 +1352,14 @@ umain(int argc, char **argv)
         return;
     }
 
+    // With the RX ring mapped, the serve loop polls it itself and lwIP
+    // transmits straight to the driver: input_envid and output_envid
+    // stay 0.
+    if (NS_FASTPATH && r == 0)
+        goto start;
+    if (NS_FASTPATH)
+        cprintf("ns: no fast path (%e), using input/output envs\n", r);
+
     // fork off the input thread which will poll the NIC driver for input
     // packets
     input_envid = fork();
@@ -346,10 +1380,9 @@ umain(int argc, char **argv)
         return;
     }
 
-    // lwIP requires a user threading library; start the library and jump
-    // into a thread to continue initialization.
-    thread_init();
-    thread_create(0, "main", tmain, 0);
-    thread_yield();
-    // never coming here!
+start:
+    serve_init(inet_addr(IP),
+            inet_addr(MASK),
+            inet_addr(DEFAULT));
+    serve();
 }
@@ -0,0 +1,253 @@
+// Request/response benchmark for UDP, shaped like DNS: small queries,
+// each answered by a slightly larger response.  Forks two servers at
+// our own address (ns loops the traffic back), one answering with a
+// recvfrom/sendto per datagram and one with recvmmsg/sendmmsg per
+// batch, then runs the same load against each and reports queries and
+// datagrams per second.
+//
+//	make run-dnsbench-nox
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define IPADDR		"10.0.2.15"
+#define PORT_SINGLE	5353
+#define PORT_BATCH	5354
+
+#define NQUERIES	20000
+#define WINDOW		16	// Queries in flight at once
+#define QLEN		33	// Header and question of "www.example.jos A"
+#define ALEN		16	// The answer record the server adds
+#define TIMEOUT		1000	// ms to wait for a lost response
+
+static void
+die(char *m)
+{
+	cprintf("%s\n", m);
+	exit();
+}
+
+static int
+udp_socket(int port)
+{
+	struct sockaddr_in addr;
+	int s;
+
+	if ((s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+		die("Failed to create socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		die("Failed to bind");
+	return s;
+}
+
+// Turn a query into its response in place: set the QR bit and the
+// answer count, and append an A record.
+static int
+answer(char *buf, int len)
+{
+	static const unsigned char rr[ALEN] = {
+		0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0x0e, 0x10, 0, 4, 10, 0, 2, 15
+	};
+
+	if (len < 12 || len > QLEN)
+		return -1;
+	buf[2] |= 0x80;
+	buf[7] = 1;
+	memmove(buf + len, rr, ALEN);
+	return len + ALEN;
+}
+
+static void
+serve_single(int s)
+{
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	char buf[QLEN + ALEN];
+	int n;
+
+	while (1) {
+		fromlen = sizeof(from);
+		if ((n = recvfrom(s, buf, QLEN, 0, (struct sockaddr *) &from,
+				  &fromlen)) < 0)
+			die("Server failed to receive");
+		if ((n = answer(buf, n)) > 0)
+			sendto(s, buf, n, 0, (struct sockaddr *) &from, fromlen);
+	}
+}
+
+static void
+serve_batch(int s)
+{
+	static char bufs[WINDOW][QLEN + ALEN];
+	struct mmsg msgs[WINDOW];
+	int i, j, n;
+
+	while (1) {
+		for (i = 0; i < WINDOW; i++) {
+			msgs[i].msg_buf = bufs[i];
+			msgs[i].msg_len = QLEN;
+		}
+		if ((n = recvmmsg(s, msgs, WINDOW, 0)) < 0)
+			die("Server failed to receive");
+		for (i = j = 0; i < n; i++) {
+			int len = answer(msgs[i].msg_buf, msgs[i].msg_len);
+			if (len < 0)
+				continue;
+			msgs[i].msg_len = len;
+			msgs[j++] = msgs[i];
+		}
+		sendmmsg(s, msgs, j, 0);
+	}
+}
+
+static void
+make_query(char *q, uint16_t id)
+{
+	static const unsigned char question[QLEN - 12] = {
+		3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		3, 'j', 'o', 's', 0, 0, 1, 0, 1
+	};
+
+	memset(q, 0, 12);
+	q[0] = id >> 8;
+	q[1] = id;
+	q[2] = 0x01;		// Recursion desired
+	q[5] = 1;		// One question
+	memmove(q + 12, question, sizeof(question));
+}
+
+// Wait up to TIMEOUT ms for something to read on s.
+static bool
+readable(int s)
+{
+	struct pollfd pfd = { s, POLLIN, 0 };
+
+	return poll(&pfd, 1, TIMEOUT) > 0;
+}
+
+static void
+report(const char *what, int answered, int lost, unsigned start)
+{
+	unsigned ms = sys_time_msec() - start;
+	if (ms == 0)
+		ms = 1;
+	cprintf("%s: %d queries in %u ms, %u queries/s, %u datagrams/s, "
+		"%d lost\n", what, answered, ms,
+		(unsigned) ((uint64_t) answered * 1000 / ms),
+		(unsigned) ((uint64_t) answered * 2000 / ms), lost);
+}
+
+// A window of queries at a time, each sent and received on its own.
+static void
+run_single(struct sockaddr_in *to)
+{
+	char q[QLEN], resp[QLEN + ALEN];
+	int s, i, sent = 0, answered = 0, lost = 0;
+	unsigned start;
+
+	s = udp_socket(0);
+	start = sys_time_msec();
+	while (sent < NQUERIES) {
+		int n = MIN(WINDOW, NQUERIES - sent);
+		for (i = 0; i < n; i++) {
+			make_query(q, sent + i);
+			if (sendto(s, q, QLEN, 0, (struct sockaddr *) to,
+				   sizeof(*to)) != QLEN)
+				die("Failed to send query");
+		}
+		sent += n;
+		for (i = 0; i < n; i++) {
+			if (!readable(s)) {
+				lost += n - i;
+				break;
+			}
+			if (recvfrom(s, resp, sizeof(resp), 0, NULL, NULL) > 0)
+				answered++;
+		}
+	}
+	report("sendto/recvfrom", answered, lost, start);
+	close(s);
+}
+
+// The same, a window at a time in one sendmmsg and as few recvmmsgs as
+// it takes.
+static void
+run_batch(struct sockaddr_in *to)
+{
+	static char qs[WINDOW][QLEN], resps[WINDOW][QLEN + ALEN];
+	struct mmsg msgs[WINDOW];
+	int s, i, r, got, sent = 0, answered = 0, lost = 0;
+	unsigned start;
+
+	s = udp_socket(0);
+	start = sys_time_msec();
+	while (sent < NQUERIES) {
+		int n = MIN(WINDOW, NQUERIES - sent);
+		for (i = 0; i < n; i++) {
+			make_query(qs[i], sent + i);
+			msgs[i].msg_buf = qs[i];
+			msgs[i].msg_len = QLEN;
+			msgs[i].msg_addr = *to;
+		}
+		if (sendmmsg(s, msgs, n, 0) != n)
+			die("Failed to send queries");
+		sent += n;
+		for (got = 0; got < n; got += r) {
+			if (!readable(s)) {
+				lost += n - got;
+				break;
+			}
+			for (i = 0; i < n - got; i++) {
+				msgs[i].msg_buf = resps[i];
+				msgs[i].msg_len = sizeof(resps[i]);
+			}
+			if ((r = recvmmsg(s, msgs, n - got, 0)) < 0)
+				die("Failed to receive responses");
+			answered += r;
+		}
+	}
+	report("sendmmsg/recvmmsg", answered, lost, start);
+	close(s);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in to;
+	envid_t single, batch;
+	int s1, s2;
+
+	binaryname = "dnsbench";
+
+	// Bound before the forks, so no query beats its server to it.
+	s1 = udp_socket(PORT_SINGLE);
+	if ((single = fork()) < 0)
+		die("Failed to fork");
+	if (single == 0)
+		serve_single(s1);
+	s2 = udp_socket(PORT_BATCH);
+	if ((batch = fork()) < 0)
+		die("Failed to fork");
+	if (batch == 0)
+		serve_batch(s2);
+
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = inet_addr(IPADDR);
+	to.sin_port = htons(PORT_SINGLE);
+	run_single(&to);
+	to.sin_port = htons(PORT_BATCH);
+	run_batch(&to);
+
+	// With the servers gone, ours are the last references, and these
+	// closes free the sockets in ns.
+	sys_env_destroy(single);
+	sys_env_destroy(batch);
+	close(s1);
+	close(s2);
+}
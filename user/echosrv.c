@@ -6,6 +6,7 @@
 
 #define BUFFSIZE 32
 #define MAXPENDING 5    // Max connection requests
+#define MAXCLIENTS 256  // Served at once
 
 static void
 die(char *m)
@@ -14,36 +15,59 @@ die(char *m)
 	exit();
 }
 
-void
-handle_client(int sock)
+static struct pollfd fds[MAXCLIENTS + 1];
+static int nfds;
+
+// Echo whatever client fds[i] sent; drop it once it hangs up.
+static void
+handle_client(int i)
 {
 	char buffer[BUFFSIZE];
-	int received = -1;
-	// Receive message
-	if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-		die("Failed to receive initial bytes from client");
-
-	// Send bytes and check for more incoming data in loop
-	while (received > 0) {
-		// Send back received data
-		if (write(sock, buffer, received) != received)
+	int received;
+
+	if ((received = read(fds[i].fd, buffer, BUFFSIZE)) > 0) {
+		if (write(fds[i].fd, buffer, received) != received)
 			die("Failed to send bytes to client");
+		return;
+	}
+	if (received < 0)
+		cprintf("Failed to receive bytes from client: %e\n", received);
+	close(fds[i].fd);
+	fds[i] = fds[--nfds];
+}
 
-		// Check for more data
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			die("Failed to receive additional bytes from client");
+// Take a connection from the (non-blocking) server socket.  Just the
+// one poll said was there: ns tells each worker of a different one.
+static void
+accept_client(int serversock)
+{
+	struct sockaddr_in echoclient;
+	unsigned int clientlen;
+	int clientsock;
+
+	clientlen = sizeof(echoclient);
+	if ((clientsock = accept(serversock, (struct sockaddr *) &echoclient,
+				 &clientlen)) < 0) {
+		if (clientsock != -E_AGAIN)
+			die("Failed to accept client connection");
+		return;
 	}
-	close(sock);
+	cprintf("Client connected: %s\n", inet_ntoa(echoclient.sin_addr));
+	if (nfds == MAXCLIENTS + 1) {
+		close(clientsock);
+		return;
+	}
+	fds[nfds].fd = clientsock;
+	fds[nfds].events = POLLIN;
+	nfds++;
 }
 
+// echosrv [workers]: one per CPU by default.
 void
 umain(int argc, char **argv)
 {
-	int serversock, clientsock;
-	struct sockaddr_in echoserver, echoclient;
-	char buffer[BUFFSIZE];
-	unsigned int echolen;
-	int received = 0;
+	int serversock, nworkers;
+	struct sockaddr_in echoserver;
 
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
@@ -71,19 +95,24 @@ umain(int argc, char **argv)
 
 	cprintf("bound\n");
 
-	// Run until canceled
+	// Each worker serves its clients from one env: it polls for
+	// whichever has something to say, and for new connections.
+	fcntl(serversock, F_SETFL, O_NONBLOCK);
+	nworkers = argc > 1 ? strtol(argv[1], 0, 0) : sys_ncpu();
+	if (prefork(nworkers) < 0)
+		die("Failed to fork workers");
+	fds[0].fd = serversock;
+	fds[0].events = POLLIN;
+	nfds = 1;
 	while (1) {
-		unsigned int clientlen = sizeof(echoclient);
-		// Wait for client connection
-		if ((clientsock =
-		     accept(serversock, (struct sockaddr *) &echoclient,
-			    &clientlen)) < 0) {
-			die("Failed to accept client connection");
-		}
-		cprintf("Client connected: %s\n", inet_ntoa(echoclient.sin_addr));
-		handle_client(clientsock);
+		int i;
+
+		if (poll(fds, nfds, -1) < 0)
+			die("Failed to poll");
+		for (i = nfds - 1; i > 0; i--)
+			if (fds[i].revents)
+				handle_client(i);
+		if (fds[0].revents & POLLIN)
+			accept_client(serversock);
 	}
-
-	close(serversock);
-
 }
@@ -0,0 +1,101 @@
+// Allocation benchmark for the file server.  Fills the disk with files
+// written a block at a time, removes them, and fills it again, which
+// the second time makes the allocator search from wherever its cursor
+// got to.  For each fill, reports blocks allocated per second end to
+// end, and the fs server's cycles per allocation in the allocator
+// alone.  Build the image bigger for a longer run: make FS_NBLOCKS=65536.
+//
+//	fsalloc [maxblocks]
+//	make run-fsalloc-nox FS_NBLOCKS=65536
+
+#include <inc/lib.h>
+
+#define MAXFILES	1024
+#define FILEBLOCKS	(MAXFILESIZE / BLKSIZE)
+
+static char buf[BLKSIZE];
+
+static void
+path(char *p, int i)
+{
+	snprintf(p, MAXPATHLEN, "/fsalloc.%d", i);
+}
+
+// Write blocks until the disk is full or 'max' have been; return the
+// number of files used.
+static int
+fill(uint32_t max, uint32_t *pblocks)
+{
+	char p[MAXPATHLEN];
+	uint32_t n = 0, i;
+	int fd, nfiles, r = 0;
+
+	for (nfiles = 0; nfiles < MAXFILES && n < max && r >= 0; nfiles++) {
+		path(p, nfiles);
+		if ((fd = open(p, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+			break;
+		for (i = 0; i < FILEBLOCKS && n < max; i++, n++)
+			if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+				break;
+		close(fd);
+	}
+	*pblocks = n;
+	return nfiles;
+}
+
+static void
+report(const char *what, uint32_t blocks, unsigned start,
+       struct Fsret_bcstats *before)
+{
+	struct Fsret_bcstats st;
+	unsigned ms = sys_time_msec() - start;
+	uint64_t allocs;
+	int r;
+
+	if (ms == 0)
+		ms = 1;
+	if ((r = fs_bcstats(&st)) < 0)
+		panic("fs_bcstats: %e", r);
+	allocs = st.ret_allocs - before->ret_allocs;
+	cprintf("%s: %u blocks in %u ms, %u allocations/s, "
+		"%llu allocations, %llu cycles each\n",
+		what, blocks, ms, (unsigned) ((uint64_t) blocks * 1000 / ms),
+		(unsigned long long) allocs,
+		(unsigned long long) ((st.ret_alloc_cycles - before->ret_alloc_cycles)
+				      / MAX(allocs, 1)));
+	*before = st;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_bcstats st;
+	char p[MAXPATHLEN];
+	uint32_t max = ~0, blocks;
+	unsigned start;
+	int pass, nfiles, i, r;
+
+	binaryname = "fsalloc";
+
+	if (argc > 1)
+		max = strtol(argv[1], 0, 0);
+	if ((r = fs_bcstats(&st)) < 0)
+		panic("fs_bcstats: %e", r);
+
+	for (pass = 1; pass <= 2; pass++) {
+		start = sys_time_msec();
+		nfiles = fill(max, &blocks);
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+		report(pass == 1 ? "fill" : "refill", blocks, start, &st);
+
+		for (i = 0; i < nfiles; i++) {
+			path(p, i);
+			remove(p);
+		}
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+		if ((r = fs_bcstats(&st)) < 0)
+			panic("fs_bcstats: %e", r);
+	}
+}
@@ -0,0 +1,21 @@
+// Have the file system server write back its dirty blocks every
+// FLUSH_MSEC milliseconds, as update(8) did for Unix.  The kernel
+// starts it along with fs.
+
+#include <inc/lib.h>
+
+#define FLUSH_MSEC	5000
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	binaryname = "fsflush";
+	while (1) {
+		if ((r = sys_sleep(FLUSH_MSEC)) < 0)
+			panic("sys_sleep: %e", r);
+		if ((r = sync()) < 0)
+			cprintf("fsflush: sync: %e\n", r);
+	}
+}
@@ -1,42 +1,75 @@
+// A web server with a pool of workers, one per CPU unless given as the
+// argument, forked once at startup and sharing the listening socket.
+// Each worker drives all of its connections from one poll() loop: HTTP/1.1 connections stay open for further requests,
+// which a client may pipeline, and are parsed in place in a per-
+// connection buffer.  Hot files are kept in a small LRU cache together
+// with their response headers.  File data never passes through a
+// buffer of ours: cached files are the file server's own block pages
+// (see fmap) and the rest go out with sendfile, so whole pages are lent
+// to ns as they are.
+
 #include <inc/lib.h>
 #include <lwip/sockets.h>
 #include <lwip/inet.h>
 
 #define PORT 80
-#define VERSION "0.1"
-#define HTTP_VERSION "1.0"
-
-#define E_BAD_REQ	1000
-
-#define BUFFSIZE 512
-#define MAXPENDING 5	// Max connection requests
-
-struct http_request {
-	int sock;
-	char *url;
-	char *version;
+#define VERSION "0.2"
+#define HTTP_VERSION "1.1"
+
+#define MAXPENDING 64	// Max connection requests
+#define MAXCONN 128	// Max open connections
+#define INBUFSIZE 1024	// A request line and its headers must fit
+#define HDRSIZE 256
+
+// The file cache.  Files are assumed not to change under a running
+// httpd; a cached file keeps the size it had when it was first served.
+#define NCACHE 16
+#define CACHE_PAGES 16		// Largest file cached, in pages
+#define CACHE_PATHLEN 128
+#define CACHEVA 0x20000000	// Entry i's pages are at CACHEVA + i*CACHE_PAGES*PGSIZE
+
+struct cfile {
+	char path[CACHE_PATHLEN];	// Empty if the entry is free
+	off_t size;
+	char *body;
+	char hdr[2][HDRSIZE];		// Headers, for [keep_alive]
+	int hdrlen[2];
+	unsigned lastuse;
+	int refs;			// Connections sending from it
 };
 
-struct responce_header {
-	int code;
-	char *header;
-};
-
-struct responce_header headers[] = {
-	{ 200, 	"HTTP/" HTTP_VERSION " 200 OK\r\n"
-	  "Server: jhttpd/" VERSION "\r\n"},
-	{0, 0},
+struct conn {
+	int fd;				// -1 if the slot is free
+	char in[INBUFSIZE];		// Received, not yet parsed
+	int inlen;
+	bool keep_alive;
+	// The response going out, if busy
+	bool busy;
+	const char *hdr;		// Headers left to send
+	int hdrlen;
+	char hdrbuf[HDRSIZE];
+	struct cfile *cf;		// The body is in the cache, or
+	int filefd;			// it streams from this file, or neither
+	off_t off, len;			// Body bytes sent, and body length
 };
 
 struct error_messages {
 	int code;
 	char *msg;
+	char resp[2][HDRSIZE];		// Whole response, for [keep_alive]
+	int resplen[2];
 };
 
 struct error_messages errors[] = {
 	{400, "Bad Request"},
 	{404, "Not Found"},
 };
+#define NERRORS (sizeof(errors) / sizeof(errors[0]))
+
+static struct cfile cache[NCACHE];
+static unsigned cache_tick;
+static struct conn conns[MAXCONN];
+static int nconns;
 
 static void
 die(char *m)
@@ -45,281 +78,341 @@ die(char *m)
 	exit();
 }
 
-static void
-req_free(struct http_request *req)
+static const char*
+mime_type(const char *file)
 {
-	free(req->url);
-	free(req->version);
+	//TODO: for now only a single mime type
+	return "text/html";
 }
 
 static int
-send_header(struct http_request *req, int code)
+make_header(char *buf, const char *url, off_t size, bool keep_alive)
 {
-	struct responce_header *h = headers;
-	while (h->code != 0 && h->header!= 0) {
-		if (h->code == code)
-			break;
-		h++;
-	}
-
-	if (h->code == 0)
-		return -1;
-
-	int len = strlen(h->header);
-	if (write(req->sock, h->header, len) != len) {
-		die("Failed to send bytes to client");
-	}
+	int r;
 
-	return 0;
+	r = snprintf(buf, HDRSIZE, "HTTP/" HTTP_VERSION " 200 OK\r\n"
+		     "Server: jhttpd/" VERSION "\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %ld\r\n"
+		     "Connection: %s\r\n"
+		     "\r\n",
+		     mime_type(url), (long) size,
+		     keep_alive ? "keep-alive" : "close");
+	if (r > HDRSIZE - 1)
+		panic("buffer too small!");
+	return r;
 }
 
-static int
-send_data(struct http_request *req, int fd)
+static void
+errors_init(void)
 {
-	// LAB 6: Your code here.
-	cprintf("sending data\n");
-	char buf[200];
-	struct Stat stat;
-	int r;
-	r = fstat(fd, &stat);
-	if(r < 0 || stat.st_isdir){
-		panic("");
-	}
-	int file_size = stat.st_size;
-	// so why did I put sock here??
-	if(readn(fd, buf, file_size) != file_size){
-		cprintf("%llx\n", file_size);
-		panic("");
-	}
-	if(write(req->sock, buf, file_size) != file_size) {
-		cprintf("huh\n");
-		panic("");
-	}
-	return 0;
+	struct error_messages *e;
+	int k;
+
+	for (e = errors; e < errors + NERRORS; e++)
+		for (k = 0; k < 2; k++) {
+			char body[64];
+			int n = snprintf(body, sizeof(body),
+					 "<html><body><p>%d - %s</p></body></html>\r\n",
+					 e->code, e->msg);
+			e->resplen[k] = snprintf(e->resp[k], HDRSIZE,
+						 "HTTP/" HTTP_VERSION " %d %s\r\n"
+						 "Server: jhttpd/" VERSION "\r\n"
+						 "Content-Type: text/html\r\n"
+						 "Content-Length: %d\r\n"
+						 "Connection: %s\r\n"
+						 "\r\n"
+						 "%s",
+						 e->code, e->msg, n,
+						 k ? "keep-alive" : "close", body);
+			if (e->resplen[k] > HDRSIZE - 1)
+				panic("buffer too small!");
+		}
 }
 
-static int
-send_size(struct http_request *req, off_t size)
+static struct cfile *
+cache_lookup(const char *path)
 {
-	char buf[64];
-	int r;
+	int i;
 
-	r = snprintf(buf, 64, "Content-Length: %ld\r\n", (long)size);
-	if (r > 63)
-		panic("buffer too small!");
+	for (i = 0; i < NCACHE; i++)
+		if (cache[i].path[0] && strcmp(cache[i].path, path) == 0) {
+			cache[i].lastuse = ++cache_tick;
+			return &cache[i];
+		}
+	return NULL;
+}
 
-	if (write(req->sock, buf, r) != r)
-		return -1;
+static void
+cache_evict(struct cfile *cf)
+{
+	int i;
 
-	return 0;
+	for (i = 0; i < CACHE_PAGES; i++)
+		sys_page_unmap(0, cf->body + i * PGSIZE);
+	cf->path[0] = '\0';
 }
 
-static const char*
-mime_type(const char *file)
+// Cache 'path', open as 'fd' and 'size' bytes long, in place of the
+// least recently used entry that nothing is sending from.  Returns
+// NULL if there is no such entry or the file can't be mapped.
+static struct cfile *
+cache_fill(const char *path, int fd, off_t size)
 {
-	//TODO: for now only a single mime type
-	return "text/html";
+	struct cfile *cf = NULL;
+	off_t off;
+	int i, r;
+
+	for (i = 0; i < NCACHE; i++) {
+		if (cache[i].refs)
+			continue;
+		if (!cf || !cache[i].path[0]
+		    || (cf->path[0] && cache[i].lastuse < cf->lastuse))
+			cf = &cache[i];
+	}
+	if (!cf)
+		return NULL;
+	if (cf->path[0])
+		cache_evict(cf);
+
+	for (off = 0; off < size; off += PGSIZE)
+		if ((r = fmap(fd, off, cf->body + off)) <= 0) {
+			cache_evict(cf);
+			return NULL;
+		}
+	strcpy(cf->path, path);
+	cf->size = size;
+	cf->hdrlen[0] = make_header(cf->hdr[0], path, size, false);
+	cf->hdrlen[1] = make_header(cf->hdr[1], path, size, true);
+	cf->lastuse = ++cache_tick;
+	return cf;
 }
 
-static int
-send_content_type(struct http_request *req)
+static void
+respond_error(struct conn *c, int code)
 {
-	char buf[128];
-	int r;
-	const char *type;
-
-	type = mime_type(req->url);
-	if (!type)
-		return -1;
-
-	r = snprintf(buf, 128, "Content-Type: %s\r\n", type);
-	if (r > 127)
-		panic("buffer too small!");
-
-	if (write(req->sock, buf, r) != r)
-		return -1;
-
-	return 0;
+	struct error_messages *e;
+
+	for (e = errors; e->code != code; e++)
+		assert(e < errors + NERRORS - 1);
+	if (code == 400)
+		c->keep_alive = false;
+	c->busy = true;
+	c->hdr = e->resp[c->keep_alive];
+	c->hdrlen = e->resplen[c->keep_alive];
+	c->cf = NULL;
+	c->filefd = -1;
+	c->off = c->len = 0;
 }
 
-static int
-send_header_fin(struct http_request *req)
+static void
+respond_file(struct conn *c, const char *url)
 {
-	const char *fin = "\r\n";
-	int fin_len = strlen(fin);
+	struct cfile *cf;
+	struct Stat st;
+	int fd;
 
-	if (write(req->sock, fin, fin_len) != fin_len)
-		return -1;
+	if (!(cf = cache_lookup(url))) {
+		if ((fd = open(url, O_RDONLY)) < 0) {
+			respond_error(c, 404);
+			return;
+		}
+		if (fstat(fd, &st) < 0 || st.st_isdir) {
+			close(fd);
+			respond_error(c, 404);
+			return;
+		}
+		if (st.st_size > CACHE_PAGES * PGSIZE
+		    || strlen(url) >= CACHE_PATHLEN
+		    || !(cf = cache_fill(url, fd, st.st_size))) {
+			c->busy = true;
+			c->hdr = c->hdrbuf;
+			c->hdrlen = make_header(c->hdrbuf, url, st.st_size,
+						c->keep_alive);
+			c->cf = NULL;
+			c->filefd = fd;
+			c->off = 0;
+			c->len = st.st_size;
+			return;
+		}
+		close(fd);
+	}
 
-	return 0;
+	cf->refs++;
+	c->busy = true;
+	c->hdr = cf->hdr[c->keep_alive];
+	c->hdrlen = cf->hdrlen[c->keep_alive];
+	c->cf = cf;
+	c->filefd = -1;
+	c->off = 0;
+	c->len = cf->size;
 }
 
-// given a request, this function creates a struct http_request
-static int
-http_request_parse(struct http_request *req, char *request)
+static void
+lowercase(char *s)
 {
-	const char *url;
-	const char *version;
-	int url_len, version_len;
-
-	if (!req)
-		return -1;
-
-	if (strncmp(request, "GET ", 4) != 0)
-		return -E_BAD_REQ;
-
-	// skip GET
-	request += 4;
-
-	// get the url
-	url = request;
-	while (*request && *request != ' ')
-		request++;
-	url_len = request - url;
-
-	req->url = malloc(url_len + 1);
-	memmove(req->url, url, url_len);
-	req->url[url_len] = '\0';
-
-	// skip space
-	request++;
-
-	version = request;
-	while (*request && *request != '\n')
-		request++;
-	version_len = request - version;
-
-	req->version = malloc(version_len + 1);
-	memmove(req->version, version, version_len);
-	req->version[version_len] = '\0';
-
-	// no entity parsing
-
-	return 0;
+	for (; *s; s++)
+		if (*s >= 'A' && *s <= 'Z')
+			*s += 'a' - 'A';
 }
 
-static int
-send_error(struct http_request *req, int code)
+// Start on the first request in c->in, if all of it is there.  Only
+// GET is supported, so a request is its line and headers.
+static void
+conn_parse(struct conn *c)
 {
-	char buf[512];
-	int r;
+	char *p, *url, *line, *next;
+	int n;
 
-	struct error_messages *e = errors;
-	while (e->code != 0 && e->msg != 0) {
-		if (e->code == code)
+	if (c->busy)
+		return;
+	for (n = 3; n < c->inlen; n++)
+		if (memcmp(&c->in[n - 3], "\r\n\r\n", 4) == 0)
 			break;
-		e++;
+	if (n >= c->inlen) {
+		if (c->inlen == INBUFSIZE)
+			respond_error(c, 400);
+		return;
 	}
+	n++;
+	c->in[n - 2] = '\0';
 
-	if (e->code == 0)
-		return -1;
-
-	r = snprintf(buf, 512, "HTTP/" HTTP_VERSION" %d %s\r\n"
-		     "Server: jhttpd/" VERSION "\r\n"
-		     "Connection: close"
-		     "Content-type: text/html\r\n"
-		     "\r\n"
-		     "<html><body><p>%d - %s</p></body></html>\r\n",
-		     e->code, e->msg, e->code, e->msg);
-
-	if (write(req->sock, buf, r) != r)
-		return -1;
-
-	return 0;
-}
-
-static int
-send_file(struct http_request *req)
-{
-	int r;
-	off_t file_size = -1;
-	int fd;
-
-	// open the requested url for reading
-	// if the file does not exist, send a 404 error using send_error
-	// if the file is a directory, send a 404 error using send_error
-	// set file_size to the size of the file
-
-	// LAB 6: Your code here.
-	r = open(req->url, O_RDONLY);
-	if(r < 0) {
-		send_error(req, 404);
-		goto end;
+	if (strncmp(c->in, "GET ", 4) != 0) {
+		respond_error(c, 400);
+		goto done;
 	}
-		
-	fd = r;
-	struct Stat stat;
-	r = fstat(fd, &stat);
-	if(r < 0 || stat.st_isdir){
-		send_error(req, 404);
-		goto end;
+	url = p = c->in + 4;
+	while (*p && *p != ' ' && *p != '\r')
+		p++;
+	if (*p != ' ') {
+		respond_error(c, 400);
+		goto done;
 	}
-	file_size = stat.st_size;
-	
-
-	if ((r = send_header(req, 200)) < 0)
-		goto end;
-
-	if ((r = send_size(req, file_size)) < 0)
-		goto end;
+	*p++ = '\0';
+	c->keep_alive = strncmp(p, "HTTP/1.1\r", 9) == 0;
+
+	for (line = strstr(p, "\r\n"); line; line = next) {
+		line += 2;
+		if ((next = strstr(line, "\r\n")) != NULL)
+			*next = '\0';
+		lowercase(line);
+		if (strncmp(line, "connection:", 11) == 0) {
+			if (strstr(line, "close"))
+				c->keep_alive = false;
+			else if (strstr(line, "keep-alive"))
+				c->keep_alive = true;
+		}
+	}
+	respond_file(c, url);
 
-	if ((r = send_content_type(req)) < 0)
-		goto end;
+done:
+	memmove(c->in, c->in + n, c->inlen - n);
+	c->inlen -= n;
+}
 
-	if ((r = send_header_fin(req)) < 0)
-		goto end;
+static void
+conn_open(int fd)
+{
+	struct conn *c;
+
+	for (c = conns; c->fd >= 0; c++)
+		assert(c < conns + MAXCONN - 1);
+	c->fd = fd;
+	c->inlen = 0;
+	c->busy = false;
+	nconns++;
+}
 
-	r = send_data(req, fd);
+static void
+conn_end_response(struct conn *c)
+{
+	if (c->cf)
+		c->cf->refs--;
+	if (c->filefd >= 0)
+		close(c->filefd);
+	c->busy = false;
+}
 
-end:
-	close(fd);
-	return r;
+static void
+conn_close(struct conn *c)
+{
+	if (c->busy)
+		conn_end_response(c);
+	close(c->fd);
+	c->fd = -1;
+	nconns--;
 }
 
 static void
-handle_client(int sock)
+conn_read(struct conn *c)
 {
-	struct http_request con_d;
 	int r;
-	char buffer[BUFFSIZE];
-	int received = -1;
-	struct http_request *req = &con_d;
-
-	while (1)
-	{
-		// Receive message
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			panic("failed to read");
 
-		memset(req, 0, sizeof(req));
+	if ((r = read(c->fd, c->in + c->inlen, INBUFSIZE - c->inlen)) <= 0) {
+		conn_close(c);
+		return;
+	}
+	c->inlen += r;
+	conn_parse(c);
+}
 
-		req->sock = sock;
+// Send the rest of the headers and up to a page of body, so that one
+// connection can't hold up the others for long.
+static void
+conn_write(struct conn *c)
+{
+	int n, r;
 
-		r = http_request_parse(req, buffer);
-		if (r == -E_BAD_REQ)
-			send_error(req, 400);
-		else if (r < 0)
-			panic("parse failed");
+	if (c->hdrlen > 0) {
+		if ((r = write(c->fd, c->hdr, c->hdrlen)) <= 0) {
+			conn_close(c);
+			return;
+		}
+		c->hdr += r;
+		c->hdrlen -= r;
+		if (c->hdrlen > 0)
+			return;
+	}
+	if (c->off < c->len) {
+		n = MIN(PGSIZE - c->off % PGSIZE, c->len - c->off);
+		if (c->cf)
+			r = write(c->fd, c->cf->body + c->off, n);
 		else
-			send_file(req);
-
-		req_free(req);
-
-		// no keep alive
-		break;
+			r = sendfile(c->fd, c->filefd, c->off, n);
+		if (r <= 0) {
+			conn_close(c);
+			return;
+		}
+		c->off += r;
+		if (c->off < c->len)
+			return;
 	}
 
-	close(sock);
+	conn_end_response(c);
+	if (c->keep_alive)
+		conn_parse(c);
+	else
+		conn_close(c);
 }
 
 void
 umain(int argc, char **argv)
 {
+	static struct pollfd pfd[MAXCONN + 1];
+	static struct conn *pconn[MAXCONN + 1];
 	int serversock, clientsock;
 	struct sockaddr_in server, client;
+	struct conn *c;
+	int i, n, r, nworkers;
 
 	binaryname = "jhttpd";
 
+	errors_init();
+	for (i = 0; i < NCACHE; i++)
+		cache[i].body = (char *) CACHEVA + i * CACHE_PAGES * PGSIZE;
+	for (i = 0; i < MAXCONN; i++)
+		conns[i].fd = -1;
+
 	// Create the TCP socket
 	if ((serversock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
 		die("Failed to create socket");
@@ -340,19 +433,48 @@ umain(int argc, char **argv)
 	// Listen on the server socket
 	if (listen(serversock, MAXPENDING) < 0)
 		die("Failed to listen on server socket");
+	if (fcntl(serversock, F_SETFL, O_NONBLOCK) < 0)
+		die("Failed to make the server socket nonblocking");
 
 	cprintf("Waiting for http connections...\n");
 
+	nworkers = argc > 1 ? strtol(argv[1], 0, 0) : sys_ncpu();
+	if (prefork(nworkers) < 0)
+		die("Failed to fork workers");
+
 	while (1) {
-		unsigned int clientlen = sizeof(client);
-		// Wait for client connection
-		if ((clientsock = accept(serversock,
-					 (struct sockaddr *) &client,
-					 &clientlen)) < 0)
-		{
-			die("Failed to accept client connection");
+		pfd[0].fd = serversock;
+		pfd[0].events = nconns < MAXCONN ? POLLIN : 0;
+		n = 1;
+		for (c = conns; c < conns + MAXCONN; c++)
+			if (c->fd >= 0) {
+				pfd[n].fd = c->fd;
+				pfd[n].events = c->busy ? POLLOUT : POLLIN;
+				pconn[n++] = c;
+			}
+
+		if ((r = poll(pfd, n, -1)) < 0)
+			die("Failed to poll");
+
+		for (i = 1; i < n; i++) {
+			c = pconn[i];
+			if (pfd[i].revents & (POLLERR | POLLNVAL))
+				conn_close(c);
+			else if (c->busy && (pfd[i].revents & (POLLOUT | POLLHUP)))
+				conn_write(c);
+			else if (!c->busy && (pfd[i].revents & (POLLIN | POLLHUP)))
+				conn_read(c);
+		}
+
+		// Just the connection poll said was there: ns tells each
+		// worker of a different one.
+		if (pfd[0].revents & POLLIN) {
+			unsigned int clientlen = sizeof(client);
+			if ((clientsock = accept(serversock,
+						 (struct sockaddr *) &client,
+						 &clientlen)) >= 0)
+				conn_open(clientsock);
 		}
-		handle_client(clientsock);
 	}
 
 	close(serversock);
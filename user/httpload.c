@@ -0,0 +1,220 @@
+// Load generator for httpd.  Opens a number of keep-alive connections
+// to the web server at our own address (ns loops the traffic back; if
+// nothing answers, we spawn httpd from the file system) and keeps each
+// busy with GETs for one file, a few pipelined at a time, then reports
+// requests per second and latency percentiles.
+//
+//	httpload [connections [requests [pipeline [path]]]]
+//	make run-httpload-nox
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define IPADDR		"10.0.2.15"
+#define PORT		80
+
+#define MAXCONN		64
+#define MAXPIPE		16
+#define BUFSIZE		2048
+#define MAXMS		1000	// Latencies at or above this share a bucket
+
+struct client {
+	int fd;
+	char buf[BUFSIZE];
+	int len;
+	int body_left;		// Body bytes of the current response to skip
+	bool in_body;
+	int outstanding;	// Requests sent, responses not yet read
+	unsigned sent_at;
+};
+
+static struct client clients[MAXCONN];
+static struct pollfd pfd[MAXCONN];
+static unsigned hist[MAXMS + 1];
+static char reqbuf[MAXPIPE * 128];
+static int reqlen;
+static int nconn = 8, nreqs = 2000, depth = 1;
+static int issued, completed, errors;
+
+static void
+die(char *m)
+{
+	cprintf("%s\n", m);
+	exit();
+}
+
+static void
+client_send(struct client *c)
+{
+	int n = MIN(depth, nreqs - issued);
+
+	if (n <= 0)
+		return;
+	c->sent_at = sys_time_msec();
+	if (write(c->fd, reqbuf, n * reqlen) != n * reqlen)
+		die("Failed to send request");
+	c->outstanding = n;
+	issued += n;
+}
+
+static void
+response_done(struct client *c)
+{
+	unsigned ms = sys_time_msec() - c->sent_at;
+
+	hist[MIN(ms, MAXMS)]++;
+	completed++;
+	c->in_body = false;
+	if (--c->outstanding == 0)
+		client_send(c);
+}
+
+// Consume what's in c->buf: response headers and bodies.
+static void
+client_parse(struct client *c)
+{
+	char *p, *cl;
+	int n;
+
+	while (c->len > 0) {
+		if (c->in_body) {
+			n = MIN(c->body_left, c->len);
+			memmove(c->buf, c->buf + n, c->len - n);
+			c->len -= n;
+			c->body_left -= n;
+			if (c->body_left == 0)
+				response_done(c);
+			continue;
+		}
+
+		for (n = 3; n < c->len; n++)
+			if (memcmp(&c->buf[n - 3], "\r\n\r\n", 4) == 0)
+				break;
+		if (n >= c->len) {
+			if (c->len == BUFSIZE)
+				die("Response headers too long");
+			return;
+		}
+		n++;
+		c->buf[n - 1] = '\0';
+		if (strncmp(c->buf, "HTTP/1.1 200 ", 13) != 0)
+			errors++;
+		if (!(cl = strstr(c->buf, "Content-Length:")))
+			die("Response without Content-Length");
+		c->body_left = strtol(cl + 15, &p, 10);
+		memmove(c->buf, c->buf + n, c->len - n);
+		c->len -= n;
+		c->in_body = true;
+		if (c->body_left == 0)
+			response_done(c);
+	}
+}
+
+// A socket connected to httpd, which is spawned the first time there's
+// no answer, and given a few seconds to start listening.
+static int
+httpd_socket(struct sockaddr_in *server)
+{
+	static bool spawned;
+	unsigned stop = sys_time_msec() + 5000;
+	int fd;
+
+	while (1) {
+		if ((fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+			die("Failed to create socket");
+		if (connect(fd, (struct sockaddr *) server, sizeof(*server)) == 0)
+			return fd;
+		close(fd);
+		if (!spawned) {
+			if (spawnl("httpd", "httpd", (char *) 0) < 0)
+				die("Failed to spawn httpd");
+			spawned = true;
+		}
+		if ((int) (sys_time_msec() - stop) >= 0)
+			die("Failed to connect to httpd");
+		sys_sleep(100);
+	}
+}
+
+static unsigned
+percentile(int pct)
+{
+	unsigned want = ((uint64_t) completed * pct + 99) / 100, seen = 0;
+	int ms;
+
+	for (ms = 0; ms < MAXMS; ms++)
+		if ((seen += hist[ms]) >= want)
+			break;
+	return ms;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in server;
+	const char *path = "/index.html";
+	struct client *c;
+	unsigned start, ms;
+	int i, r;
+
+	binaryname = "httpload";
+
+	if (argc > 1)
+		nconn = MIN(MAX(strtol(argv[1], 0, 0), 1), MAXCONN);
+	if (argc > 2)
+		nreqs = strtol(argv[2], 0, 0);
+	if (argc > 3)
+		depth = MIN(MAX(strtol(argv[3], 0, 0), 1), MAXPIPE);
+	if (argc > 4)
+		path = argv[4];
+
+	reqlen = snprintf(reqbuf, sizeof(reqbuf) / MAXPIPE,
+			  "GET %s HTTP/1.1\r\nHost: " IPADDR "\r\n\r\n", path);
+	if (reqlen >= sizeof(reqbuf) / MAXPIPE)
+		die("Path too long");
+	for (i = 1; i < depth; i++)
+		memmove(reqbuf + i * reqlen, reqbuf, reqlen);
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr(IPADDR);
+	server.sin_port = htons(PORT);
+
+	for (i = 0; i < nconn; i++) {
+		c = &clients[i];
+		c->fd = httpd_socket(&server);
+		pfd[i].fd = c->fd;
+		pfd[i].events = POLLIN;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < nconn; i++)
+		client_send(&clients[i]);
+	while (completed < issued) {
+		if ((r = poll(pfd, nconn, -1)) < 0)
+			die("Failed to poll");
+		for (i = 0; i < nconn; i++) {
+			if (!pfd[i].revents)
+				continue;
+			c = &clients[i];
+			if ((r = read(c->fd, c->buf + c->len, BUFSIZE - c->len)) <= 0)
+				die("Connection closed by httpd");
+			c->len += r;
+			client_parse(c);
+		}
+	}
+	ms = sys_time_msec() - start;
+	if (ms == 0)
+		ms = 1;
+
+	for (i = 0; i < nconn; i++)
+		close(clients[i].fd);
+
+	cprintf("%d requests for %s on %d connections, %d pipelined: "
+		"%u ms, %u requests/s\n", completed, path, nconn, depth, ms,
+		(unsigned) ((uint64_t) completed * 1000 / ms));
+	cprintf("latency: p50 %u ms, p99 %u ms%s; %d errors\n",
+		percentile(50), percentile(99),
+		percentile(99) >= MAXMS ? " or more" : "", errors);
+}
@@ -0,0 +1,76 @@
+// Round-trip latency benchmark for the network server.
+// Times socket()/close() pairs and would-block accepts on a listening
+// socket, each of which is one IPC round trip through ns with no
+// packets involved, then prints each ns shard's request page pool
+// counters.
+//
+//	make run-nslat-nox
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define NROUNDS		2000
+#define PORT		7001
+
+static void
+report(const char *what, int n, unsigned start)
+{
+	unsigned ms = sys_time_msec() - start;
+	if (ms == 0)
+		ms = 1;
+	cprintf("%s: %d round trips in %u ms, %u us each\n",
+		what, n, ms, (unsigned) ((uint64_t) ms * 1000 / n));
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	unsigned start;
+	int i, s, r;
+
+	binaryname = "nslat";
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUNDS; i++) {
+		if ((s = nsipc_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+			panic("socket: %e", s);
+		if ((r = nsipc_close(s)) < 0)
+			panic("close: %e", r);
+	}
+	report("socket+close", 2 * NROUNDS, start);
+
+	if ((s = nsipc_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		panic("socket: %e", s);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+	if ((r = nsipc_bind(s, (struct sockaddr *) &addr, sizeof(addr))) < 0)
+		panic("bind: %e", r);
+	if ((r = nsipc_listen(s, 5)) < 0)
+		panic("listen: %e", r);
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUNDS; i++) {
+		addrlen = sizeof(addr);
+		r = nsipc_try_accept(s, (struct sockaddr *) &addr, &addrlen);
+		if (r != -E_AGAIN)
+			panic("accept: expected %e, got %e", -E_AGAIN, r);
+	}
+	report("accept (would block)", NROUNDS, start);
+
+	nsipc_close(s);
+
+	for (i = 0; i < nsipc_nshards(); i++) {
+		struct Nsret_stats st;
+		if ((r = nsipc_stats(i, &st)) < 0)
+			panic("stats: %e", r);
+		cprintf("ns shard %d: %u/%u request pages in use, high water %u, "
+			"%llu taken, pool ran dry %llu times\n", i, st.ret_inuse,
+			st.ret_bufs, st.ret_hiwat, (unsigned long long) st.ret_allocs,
+			(unsigned long long) st.ret_waits);
+	}
+}
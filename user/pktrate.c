@@ -0,0 +1,79 @@
+// Packet-rate benchmark for the e1000 transmit path.
+// Blasts minimum-size Ethernet frames through sys_send_packet (one frame
+// per trap) and then through sys_send_packets (a page of frames per
+// trap), and reports packets per second for each.
+//
+//	make run-pktrate-nox
+
+#include <inc/lib.h>
+
+#define NPKTS		20000
+#define FRAMELEN	64
+
+static struct pkt_batch batch __attribute__((aligned(PGSIZE)));
+
+static void
+fill_frame(uint8_t *f)
+{
+	memset(f, 0, FRAMELEN);
+	memset(f, 0xff, 6);			// broadcast
+	f[6] = 0x52; f[7] = 0x54; f[8] = 0x00;	// our MAC
+	f[9] = 0x12; f[10] = 0x34; f[11] = 0x56;
+	f[12] = 0x88; f[13] = 0xb5;		// local experimental ethertype
+}
+
+static void
+report(const char *what, int n, unsigned start)
+{
+	unsigned ms = sys_time_msec() - start;
+	if (ms == 0)
+		ms = 1;
+	cprintf("%s: %d packets in %u ms, %u pps\n",
+		what, n, ms, (unsigned) ((uint64_t) n * 1000 / ms));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint8_t frame[FRAMELEN];
+	struct pkt_rec *rec;
+	unsigned start;
+	int i, sent, r;
+
+	binaryname = "pktrate";
+	fill_frame(frame);
+
+	start = sys_time_msec();
+	for (i = 0; i < NPKTS; i++) {
+		while ((r = sys_send_packet(frame, FRAMELEN)) == -E_TX_FULL)
+			sys_yield();
+		if (r < 0)
+			panic("sys_send_packet: %e", r);
+	}
+	report("single", NPKTS, start);
+
+	batch.pb_count = 0;
+	batch.pb_used = 0;
+	while (PKT_BATCH_FITS(&batch, FRAMELEN)) {
+		rec = (struct pkt_rec *) (batch.pb_data + batch.pb_used);
+		rec->pr_len = FRAMELEN;
+		rec->pr_flags = 0;
+		memcpy(rec->pr_data, frame, FRAMELEN);
+		batch.pb_used += PKT_REC_SIZE(FRAMELEN);
+		batch.pb_count++;
+	}
+
+	start = sys_time_msec();
+	for (sent = 0; sent < NPKTS; ) {
+		int skip = 0;
+		while (skip < batch.pb_count && sent < NPKTS) {
+			if ((r = sys_send_packets(&batch, skip)) < 0)
+				panic("sys_send_packets: %e", r);
+			if (r == 0)
+				sys_yield();
+			skip += r;
+			sent += r;
+		}
+	}
+	report("batched", sent, start);
+}